@@ -12,6 +12,7 @@
 
 #include <linux/delay.h>
 #include <linux/i2c.h>
+#include <linux/ktime.h>
 #include <linux/v4l2-mediabus.h>
 #include <linux/slab.h>
 #include <linux/videodev2.h>
@@ -69,6 +70,9 @@
 #define IMX074_WIDTH			1052
 #define IMX074_HEIGHT			780
 
+/* Longest auto-increment write the sequencer sends in one message */
+#define IMX074_MAX_BURST		16
+
 /* IMX074 has only one fixed colorspace per pixelcode */
 struct imx074_datafmt {
 	u32	code;
@@ -81,6 +85,119 @@ struct imx074 {
 	struct v4l2_clk			*clk;
 };
 
+struct imx074_reg {
+	u16	addr;
+	u8	val;
+};
+
+/* A group of register writes, followed by the settling time it needs */
+struct imx074_reg_phase {
+	const char			*name;
+	const struct imx074_reg		*regs;
+	unsigned int			num_regs;
+	unsigned int			settle_us;
+};
+
+#define IMX074_PHASE(_name, _regs, _settle_us) {	\
+	.name		= _name,			\
+	.regs		= _regs,			\
+	.num_regs	= ARRAY_SIZE(_regs),		\
+	.settle_us	= _settle_us,			\
+}
+
+/* PLL Setting EXTCLK=24MHz, 22.5times */
+static const struct imx074_reg imx074_pll_regs[] = {
+	{PLL_MULTIPLIER, 0x2D},
+	{PRE_PLL_CLK_DIV, 0x02},
+	{PLSTATIM, 0x4B},
+};
+
+static const struct imx074_reg imx074_base_regs[] = {
+	/* 2-lane mode */
+	{0x3024, 0x00},
+
+	{IMAGE_ORIENTATION, 0x00},
+
+	/* select RAW mode:
+	 * 0x08+0x08 = top 8 bits
+	 * 0x0a+0x08 = compressed 8-bits
+	 * 0x0a+0x0a = 10 bits
+	 */
+	{0x0112, 0x08},
+	{0x0113, 0x08},
+
+	/* Base setting for High frame mode */
+	{VNDMY_ABLMGSHLMT, 0x80},
+	{Y_OPBADDR_START_DI, 0x08},
+	{0x3015, 0x37},
+	{0x301C, 0x01},
+	{0x302C, 0x05},
+	{0x3031, 0x26},
+	{0x3041, 0x60},
+	{0x3051, 0x24},
+	{0x3053, 0x34},
+	{0x3057, 0xC0},
+	{0x305C, 0x09},
+	{0x305D, 0x07},
+	{0x3060, 0x30},
+	{0x3065, 0x00},
+	{0x30AA, 0x08},
+	{0x30AB, 0x1C},
+	{0x30B0, 0x32},
+	{0x30B2, 0x83},
+	{0x30D3, 0x04},
+	{0x3106, 0x78},
+	{0x310C, 0x82},
+	{0x3304, 0x05},
+	{0x3305, 0x04},
+	{0x3306, 0x11},
+	{0x3307, 0x02},
+	{0x3308, 0x0C},
+	{0x3309, 0x06},
+	{0x330A, 0x08},
+	{0x330B, 0x04},
+	{0x330C, 0x08},
+	{0x330D, 0x06},
+	{0x330E, 0x01},
+	{0x3381, 0x00},
+};
+
+static const struct imx074_reg imx074_mode_regs[] = {
+	/* V : 1/2V-addition (1,3), H : 1/2H-averaging (1,3) -> Full HD */
+	/* 1608 = 1560 + 48 (black lines) */
+	{FRAME_LENGTH_LINES_HI, 0x06},
+	{FRAME_LENGTH_LINES_LO, 0x48},
+	{YADDR_START, 0x00},
+	{YADDR_END, 0x2F},
+	/* 0x838 == 2104 */
+	{X_OUTPUT_SIZE_MSB, 0x08},
+	{X_OUTPUT_SIZE_LSB, 0x38},
+	/* 0x618 == 1560 */
+	{Y_OUTPUT_SIZE_MSB, 0x06},
+	{Y_OUTPUT_SIZE_LSB, 0x18},
+	{X_EVEN_INC, 0x01},
+	{X_ODD_INC, 0x03},
+	{Y_EVEN_INC, 0x01},
+	{Y_ODD_INC, 0x03},
+	{HMODEADD, 0x00},
+	{VMODEADD, 0x16},
+	{VAPPLINE_START, 0x24},
+	{VAPPLINE_END, 0x53},
+	{SHUTTER, 0x00},
+	{HADDAVE, 0x80},
+
+	{LANESEL, 0x00},
+
+	{GROUPED_PARAMETER_HOLD, 0x00},	/* off */
+};
+
+/* Only the PLL needs time to settle before the next register writes */
+static const struct imx074_reg_phase imx074_init_seq[] = {
+	IMX074_PHASE("pll", imx074_pll_regs, 2000),
+	IMX074_PHASE("base", imx074_base_regs, 0),
+	IMX074_PHASE("mode", imx074_mode_regs, 0),
+};
+
 static const struct imx074_datafmt imx074_colour_fmts[] = {
 	{MEDIA_BUS_FMT_SBGGR8_1X8, V4L2_COLORSPACE_SRGB},
 };
@@ -102,27 +219,88 @@ static const struct imx074_datafmt *imx074_find_datafmt(u32 code)
 	return NULL;
 }
 
-static int reg_write(struct i2c_client *client, const u16 addr, const u8 data)
+/*
+ * Write a register table. Runs of registers at consecutive addresses are
+ * sent as one auto-incrementing burst. Returns the number of transfers.
+ */
+static int imx074_write_regs(struct i2c_client *client,
+			     const struct imx074_reg *regs, unsigned int num)
 {
 	struct i2c_adapter *adap = client->adapter;
 	struct i2c_msg msg;
-	unsigned char tx[3];
-	int ret;
+	unsigned char tx[2 + IMX074_MAX_BURST];
+	unsigned int i = 0, len;
+	int ret, xfers = 0;
 
 	msg.addr = client->addr;
 	msg.buf = tx;
-	msg.len = 3;
 	msg.flags = 0;
 
-	tx[0] = addr >> 8;
-	tx[1] = addr & 0xff;
-	tx[2] = data;
+	while (i < num) {
+		tx[0] = regs[i].addr >> 8;
+		tx[1] = regs[i].addr & 0xff;
+
+		len = 0;
+		do {
+			tx[2 + len++] = regs[i++].val;
+		} while (i < num && len < IMX074_MAX_BURST &&
+			 regs[i].addr == regs[i - 1].addr + 1);
+
+		msg.len = 2 + len;
+
+		ret = i2c_transfer(adap, &msg, 1);
+		if (ret != 1) {
+			dev_warn(&client->dev,
+				 "Writing %u registers from %x failed\n",
+				 len, (tx[0] << 8) | tx[1]);
+			return ret < 0 ? ret : -EIO;
+		}
+		xfers++;
+	}
+
+	return xfers;
+}
+
+/* Apply a sequence of register tables, timing each of them */
+static int imx074_write_seq(struct i2c_client *client,
+			    const struct imx074_reg_phase *seq,
+			    unsigned int num)
+{
+	ktime_t start, phase_start;
+	unsigned int i;
+	int ret;
+
+	start = ktime_get();
+
+	for (i = 0; i < num; i++) {
+		phase_start = ktime_get();
+
+		ret = imx074_write_regs(client, seq[i].regs, seq[i].num_regs);
+		if (ret < 0)
+			return ret;
+
+		if (seq[i].settle_us)
+			usleep_range(seq[i].settle_us, 2 * seq[i].settle_us);
 
-	ret = i2c_transfer(adap, &msg, 1);
+		dev_dbg(&client->dev, "%s: %u registers in %d transfers, %lld us\n",
+			seq[i].name, seq[i].num_regs, ret,
+			ktime_us_delta(ktime_get(), phase_start));
+	}
+
+	dev_dbg(&client->dev, "register setup took %lld us\n",
+		ktime_us_delta(ktime_get(), start));
+
+	return 0;
+}
+
+static int reg_write(struct i2c_client *client, const u16 addr, const u8 data)
+{
+	struct imx074_reg reg = {addr, data};
+	int ret;
 
-	mdelay(2);
+	ret = imx074_write_regs(client, &reg, 1);
 
-	return ret == 1 ? 0 : -EIO;
+	return ret < 0 ? ret : 0;
 }
 
 static int reg_read(struct i2c_client *client, const u16 addr)
@@ -323,87 +501,8 @@ static int imx074_video_probe(struct i2c_client *client)
 		goto done;
 	}
 
-	/* PLL Setting EXTCLK=24MHz, 22.5times */
-	reg_write(client, PLL_MULTIPLIER, 0x2D);
-	reg_write(client, PRE_PLL_CLK_DIV, 0x02);
-	reg_write(client, PLSTATIM, 0x4B);
-
-	/* 2-lane mode */
-	reg_write(client, 0x3024, 0x00);
-
-	reg_write(client, IMAGE_ORIENTATION, 0x00);
-
-	/* select RAW mode:
-	 * 0x08+0x08 = top 8 bits
-	 * 0x0a+0x08 = compressed 8-bits
-	 * 0x0a+0x0a = 10 bits
-	 */
-	reg_write(client, 0x0112, 0x08);
-	reg_write(client, 0x0113, 0x08);
-
-	/* Base setting for High frame mode */
-	reg_write(client, VNDMY_ABLMGSHLMT, 0x80);
-	reg_write(client, Y_OPBADDR_START_DI, 0x08);
-	reg_write(client, 0x3015, 0x37);
-	reg_write(client, 0x301C, 0x01);
-	reg_write(client, 0x302C, 0x05);
-	reg_write(client, 0x3031, 0x26);
-	reg_write(client, 0x3041, 0x60);
-	reg_write(client, 0x3051, 0x24);
-	reg_write(client, 0x3053, 0x34);
-	reg_write(client, 0x3057, 0xC0);
-	reg_write(client, 0x305C, 0x09);
-	reg_write(client, 0x305D, 0x07);
-	reg_write(client, 0x3060, 0x30);
-	reg_write(client, 0x3065, 0x00);
-	reg_write(client, 0x30AA, 0x08);
-	reg_write(client, 0x30AB, 0x1C);
-	reg_write(client, 0x30B0, 0x32);
-	reg_write(client, 0x30B2, 0x83);
-	reg_write(client, 0x30D3, 0x04);
-	reg_write(client, 0x3106, 0x78);
-	reg_write(client, 0x310C, 0x82);
-	reg_write(client, 0x3304, 0x05);
-	reg_write(client, 0x3305, 0x04);
-	reg_write(client, 0x3306, 0x11);
-	reg_write(client, 0x3307, 0x02);
-	reg_write(client, 0x3308, 0x0C);
-	reg_write(client, 0x3309, 0x06);
-	reg_write(client, 0x330A, 0x08);
-	reg_write(client, 0x330B, 0x04);
-	reg_write(client, 0x330C, 0x08);
-	reg_write(client, 0x330D, 0x06);
-	reg_write(client, 0x330E, 0x01);
-	reg_write(client, 0x3381, 0x00);
-
-	/* V : 1/2V-addition (1,3), H : 1/2H-averaging (1,3) -> Full HD */
-	/* 1608 = 1560 + 48 (black lines) */
-	reg_write(client, FRAME_LENGTH_LINES_HI, 0x06);
-	reg_write(client, FRAME_LENGTH_LINES_LO, 0x48);
-	reg_write(client, YADDR_START, 0x00);
-	reg_write(client, YADDR_END, 0x2F);
-	/* 0x838 == 2104 */
-	reg_write(client, X_OUTPUT_SIZE_MSB, 0x08);
-	reg_write(client, X_OUTPUT_SIZE_LSB, 0x38);
-	/* 0x618 == 1560 */
-	reg_write(client, Y_OUTPUT_SIZE_MSB, 0x06);
-	reg_write(client, Y_OUTPUT_SIZE_LSB, 0x18);
-	reg_write(client, X_EVEN_INC, 0x01);
-	reg_write(client, X_ODD_INC, 0x03);
-	reg_write(client, Y_EVEN_INC, 0x01);
-	reg_write(client, Y_ODD_INC, 0x03);
-	reg_write(client, HMODEADD, 0x00);
-	reg_write(client, VMODEADD, 0x16);
-	reg_write(client, VAPPLINE_START, 0x24);
-	reg_write(client, VAPPLINE_END, 0x53);
-	reg_write(client, SHUTTER, 0x00);
-	reg_write(client, HADDAVE, 0x80);
-
-	reg_write(client, LANESEL, 0x00);
-
-	reg_write(client, GROUPED_PARAMETER_HOLD, 0x00);	/* off */
-
-	ret = 0;
+	ret = imx074_write_seq(client, imx074_init_seq,
+			       ARRAY_SIZE(imx074_init_seq));
 
 done:
 	imx074_s_power(subdev, 0);
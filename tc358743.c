@@ -6,16 +6,22 @@
 #define DEBUG
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/bsearch.h>
 #include <linux/slab.h>
 #include <linux/i2c.h>
 #include <linux/clk.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/gpio/consumer.h>
 #include <linux/interrupt.h>
+#include <linux/math64.h>
+#include <linux/pm_runtime.h>
 #include <linux/videodev2.h>
 #include <linux/workqueue.h>
 #include <linux/v4l2-dv-timings.h>
 #include <linux/hdmi.h>
+#include <linux/regmap.h>
 #include <media/v4l2-dv-timings.h>
 #include <media/v4l2-device.h>
 #include <media/v4l2-ctrls.h>
@@ -44,14 +50,24 @@
 #include <media/soc_camera.h>
 
 #include "tc358743_regs.h"
+#include "tc358xxx_debug.h"
 
 /* RGB ouput selection */
 // #define TC358743_VOUT_RGB
 
-static int debug = 3;
+static int debug;
 module_param(debug, int, 0644);
 MODULE_PARM_DESC(debug, "debug level (0-3)");
 
+/*
+ * The chip can't detect a source while it sleeps, so it stays awake unless
+ * autosuspend is asked for.
+ */
+static int autosuspend_delay_ms = -1;
+module_param(autosuspend_delay_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay_ms,
+		 "runtime PM autosuspend delay in ms, negative (default) keeps the chip awake");
+
 MODULE_DESCRIPTION("Toshiba TC358743 HDMI to CSI-2 bridge driver");
 MODULE_AUTHOR("Ramakrishnan Muthukrishnan <ram@rkrishnan.org>");
 MODULE_AUTHOR("Mikhail Khelik <mkhelik@cisco.com>");
@@ -96,6 +112,46 @@ static const struct camera_common_frmfmt tc358743_frmfmt[] = {
 // 	},
 // };
 
+/* PLL limits: pllinclk = refclk / prd, bps per lane = pllinclk * fbd */
+#define TC358743_PLL_PRD_MAX		16
+#define TC358743_PLL_FBD_MAX		512
+#define TC358743_PLL_INCLK_MIN		6000000U
+#define TC358743_PLL_INCLK_MAX		40000000U
+#define TC358743_BPS_PR_LANE_MIN	62500000U
+#define TC358743_BPS_PR_LANE_MAX	1000000000U
+
+/* MIPI D-PHY minimum timings plus some margin */
+#define TC358743_LINEINIT_MIN_US	110
+#define TC358743_TWAKEUP_MIN_US		1200
+#define TC358743_LPTXTIME_MIN_NS	55
+#define TC358743_TCLKPREPARE_MIN_NS	43
+#define TC358743_TCLKZERO_MIN_NS	305
+#define TC358743_TCLKTRAIL_MIN_NS	65
+#define TC358743_TCLKPOST_MIN_NS	65
+#define TC358743_THSZERO_MIN_NS		150
+#define TC358743_THSTRAIL_MIN_NS	65
+#define TC358743_THSPREPARE_MIN_NS	45
+#define TC358743_HSTXVREGCNT		5
+
+/* MIPI D-PHY limits the timings are verified against */
+#define TC358743_DPHY_LINEINIT_MIN_US		100
+#define TC358743_DPHY_LPX_MIN_NS		50
+#define TC358743_DPHY_TCLKPREPARE_MIN_NS	38
+#define TC358743_DPHY_TCLKPREPARE_MAX_NS	95
+#define TC358743_DPHY_TCLKPREPZERO_MIN_NS	300
+#define TC358743_DPHY_TCLKTRAIL_MIN_NS		60
+#define TC358743_DPHY_TCLKTRAIL_MAX_NS		105	/* + 12 UI, TEOT */
+#define TC358743_DPHY_TCLKPOST_MIN_NS		60	/* + 52 UI */
+#define TC358743_DPHY_THSPREPARE_MIN_NS		40	/* + 4 UI */
+#define TC358743_DPHY_THSPREPARE_MAX_NS		85	/* + 6 UI */
+#define TC358743_DPHY_THSPREPZERO_MIN_NS	145	/* + 10 UI */
+#define TC358743_DPHY_THSTRAIL_MIN_NS		60	/* + 4 UI */
+#define TC358743_DPHY_THSTRAIL_MAX_NS		105	/* + 12 UI */
+#define TC358743_DPHY_TWAKEUP_MIN_US		1000
+
+#define TC358743_FS_PER_NS	1000000ULL
+#define TC358743_FS_PER_US	1000000000ULL
+
 #define EDID_NUM_BLOCKS_MAX 8
 #define EDID_BLOCK_SIZE 128
 static u8 edid[] = {
@@ -168,8 +224,10 @@ static u8 edid[] = {
 	0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x02,
 #endif
 };
-/* Max transfer size done by I2C transfer functions */
-#define MAX_XFER_SIZE  (EDID_NUM_BLOCKS_MAX * EDID_BLOCK_SIZE + 2)
+/* Max transfer size done by I2C transfer functions, EDID is sent in chunks */
+#define MAX_XFER_SIZE  (EDID_BLOCK_SIZE + 2)
+/* Max registers queued by a register batch before it is flushed */
+#define BATCH_MAX_REGS 24
 
 static const struct v4l2_dv_timings_cap tc358743_timings_cap = {
 	.type = V4L2_DV_BT_656_1120,
@@ -184,6 +242,77 @@ static const struct v4l2_dv_timings_cap tc358743_timings_cap = {
 			V4L2_DV_BT_CAP_CUSTOM)
 };
 
+/* Steps of enable_stream(sd, true), timed for the "latency" debugfs file */
+enum tc358743_lat_idx {
+	TC358743_LAT_CLK,	/* clock lane LP11->HS */
+	TC358743_LAT_UNMUTE,
+	TC358743_LAT_BUFFERS,
+	TC358743_LAT_STREAM_ON,	/* all of the above */
+	TC358743_LAT_RESUME,	/* system resume to the next stream on */
+	TC358743_LAT_NUM
+};
+
+static const char * const tc358743_lat_names[TC358743_LAT_NUM] = {
+	[TC358743_LAT_CLK]		= "clk",
+	[TC358743_LAT_UNMUTE]		= "unmute",
+	[TC358743_LAT_BUFFERS]		= "buffers",
+	[TC358743_LAT_STREAM_ON]	= "stream_on",
+	[TC358743_LAT_RESUME]		= "resume",
+};
+
+struct tc358743_lat {
+	spinlock_t lock;
+	struct tc358xxx_lat_hist hist[TC358743_LAT_NUM];
+};
+
+/* Start of the step being timed */
+struct tc358743_lat_mark {
+	ktime_t t;
+	unsigned long xfers;
+};
+
+/*
+ * Chip status as last read by tc358743_refresh_status(). log_status and the
+ * "status" debugfs file render it without touching the bus.
+ */
+struct tc358743_status {
+	u64 ts;			/* ktime_get_ns() of the refresh */
+	u16 chipid;
+	u16 sysctl;
+	u8 sys_status;
+	u8 edid_mode;
+	u8 hpd_ctl;
+	u16 cecen;
+	u8 vi_status1;
+	u8 vi_status3;
+	u32 csi_status;
+	unsigned lanes_in_use;
+	bool detected;		/* detected_timings is valid */
+	struct v4l2_dv_timings detected_timings;
+	bool avi_valid;
+	u8 avi[HDMI_INFOFRAME_SIZE(AVI)];
+};
+
+/* PLL and CSI TX settings for one DT link frequency */
+struct tc358743_csi_param {
+	u32 bps_pr_lane; /* refclk_hz / pll_prd * pll_fbd */
+	u16 pll_prd;
+	u16 pll_fbd;
+
+	u32 lineinitcnt;
+	u32 lptxtimecnt;
+	u32 tclk_headercnt;
+	u32 tclk_trailcnt;
+	u32 ths_headercnt;
+	u32 twakeup;
+	u32 tclk_postcnt;
+	u32 ths_trailcnt;
+	u32 hstxvregcnt;
+
+	u32 hs_lp_hs_ns; /* clock lane HS->LP->HS turnaround */
+	bool usable; /* PLL and D-PHY timings in spec, offered by LINK_FREQ */
+};
+
 struct tc358743_state {
 	struct tc358743_platform_data pdata;
 	// struct v4l2_of_bus_mipi_csi2 bus;
@@ -199,6 +328,17 @@ struct tc358743_state {
 	struct v4l2_ctrl *detect_tx_5v_ctrl;
 	struct v4l2_ctrl *audio_sampling_rate_ctrl;
 	struct v4l2_ctrl *audio_present_ctrl;
+	struct v4l2_ctrl *link_freq;
+
+	/* CSI TX, one set of settings per DT link frequency */
+	struct tc358743_csi_param *link_freq_settings;
+	u64 *link_frequencies;
+	unsigned int link_frequencies_num;
+	unsigned int link_freq_def; /* first usable entry */
+	unsigned int csi_lanes_max; /* lanes wired up */
+	unsigned int csi_lanes; /* lanes the current mode uses */
+	u32 csi_hs_lp_hs_ns; /* 0 if unknown */
+	bool csi_continuous_clk; /* clock mode the current mode uses */
 
 	/* work queues */
 	struct workqueue_struct *work_queues;
@@ -206,14 +346,53 @@ struct tc358743_state {
 
 	/* edid  */
 	u8 edid_blocks_written;
+	u32 edid_crc;		/* crc32 of the EDID in EDID_RAM */
+	bool edid_crc_valid;
+	u8 edid[EDID_NUM_BLOCKS_MAX * EDID_BLOCK_SIZE]; /* replayed on resume */
 
 	/* used by i2c_wr() */
 	u8 wr_data[MAX_XFER_SIZE];
 
+	/* batch being flushed, see tc358743_regmap_reg_write() */
+	struct tc358743_reg_batch *batch;
+
 	struct v4l2_dv_timings timings;
 	u32 mbus_fmt_code;
 
 	struct gpio_desc *reset_gpio;
+	struct clk *refclk;	/* optional, NULL if always running */
+	bool streaming;
+
+	/* debug */
+	unsigned long xfer_cnt;	/* number of i2c_transfer() calls */
+	struct tc358xxx_trace trace;
+	struct tc358743_lat lat;
+	struct tc358743_lat_mark resume_mark;
+	bool resume_pending;	/* no stream on since the system resume */
+	struct mutex status_lock;
+	struct tc358743_status status;
+	struct dentry *debugfs;
+};
+
+/*
+ * Register write batch. Runs of registers at adjacent addresses are sent as
+ * one auto-incrementing burst, all runs go out in a single multi-message
+ * i2c_transfer(). Unlike the debug helpers this stays per driver: the
+ * tc358743 sends register values little endian, the tc358748 packs them in
+ * its own word order.
+ */
+struct tc358743_reg_batch {
+	unsigned int num;
+	int err; /* first flush error, later writes are dropped */
+	struct reg_sequence seq[BATCH_MAX_REGS];
+
+	/* writes passed on by regmap, in bus order */
+	unsigned int num_regs;
+	struct {
+		u16 reg;
+		u8 len;
+		u32 val;
+	} regs[BATCH_MAX_REGS];
 };
 
 static inline struct tc358743_state *to_state(struct v4l2_subdev *sd)
@@ -261,6 +440,118 @@ static char * audout_sel [] = {
     [0b11] = "TDM",
 };
 */
+/* --------------- TRACE --------------- */
+
+static void tc358743_trace(struct tc358743_state *state, char dir, u16 reg,
+			   u32 val, u32 len, int ret)
+{
+	tc358xxx_trace_add(&state->trace, dir, reg, val, len, ret);
+
+	if (debug >= 3)
+		v4l2_info(&state->sd, "I2C %s 0x%04x = 0x%08x (%u)%s\n",
+			  dir == 'R' ? "read" : "write", reg, val, len,
+			  ret ? " failed" : "");
+}
+
+static int tc358743_trace_show(struct seq_file *m, void *unused)
+{
+	struct tc358743_state *state = m->private;
+
+	return tc358xxx_trace_show(m, &state->trace);
+}
+
+static int tc358743_trace_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tc358743_trace_show, inode->i_private);
+}
+
+static const struct file_operations tc358743_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = tc358743_trace_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void tc358743_lat_start(struct tc358743_state *state,
+			       struct tc358743_lat_mark *mark)
+{
+	mark->t = ktime_get();
+	mark->xfers = state->xfer_cnt;
+}
+
+/* Account the time since mark to idx and start the next step */
+static void tc358743_lat_step(struct tc358743_state *state,
+			      enum tc358743_lat_idx idx,
+			      struct tc358743_lat_mark *mark)
+{
+	ktime_t now = ktime_get();
+
+	spin_lock(&state->lat.lock);
+	tc358xxx_lat_add(&state->lat.hist[idx],
+			 ktime_to_ns(ktime_sub(now, mark->t)),
+			 state->xfer_cnt - mark->xfers);
+	spin_unlock(&state->lat.lock);
+
+	mark->t = now;
+	mark->xfers = state->xfer_cnt;
+}
+
+/*
+ * One line per step of enable_stream(): samples, bus transactions, worst
+ * case and the log2 histogram.
+ */
+static int tc358743_latency_show(struct seq_file *m, void *unused)
+{
+	struct tc358743_state *state = m->private;
+	struct tc358xxx_lat_hist *hist;
+	unsigned int i;
+
+	hist = kmalloc_array(TC358743_LAT_NUM, sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	spin_lock(&state->lat.lock);
+	memcpy(hist, state->lat.hist, TC358743_LAT_NUM * sizeof(*hist));
+	spin_unlock(&state->lat.lock);
+
+	tc358xxx_lat_show_header(m);
+	for (i = 0; i < TC358743_LAT_NUM; i++)
+		tc358xxx_lat_show(m, tc358743_lat_names[i], &hist[i]);
+
+	kfree(hist);
+	return 0;
+}
+
+static int tc358743_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tc358743_latency_show, inode->i_private);
+}
+
+/* Any write clears the histograms */
+static ssize_t tc358743_latency_write(struct file *file,
+				      const char __user *buf, size_t count,
+				      loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct tc358743_state *state = m->private;
+
+	spin_lock(&state->lat.lock);
+	memset(state->lat.hist, 0, sizeof(state->lat.hist));
+	spin_unlock(&state->lat.lock);
+
+	return count;
+}
+
+static const struct file_operations tc358743_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = tc358743_latency_open,
+	.read = seq_read,
+	.write = tc358743_latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 /* --------------- I2C --------------- */
 static int i2c_rd(struct v4l2_subdev *sd, u16 reg, u8 *values, u32 n)
 {
@@ -284,11 +575,16 @@ static int i2c_rd(struct v4l2_subdev *sd, u16 reg, u8 *values, u32 n)
 	};
 
 	err = i2c_transfer(client->adapter, msgs, ARRAY_SIZE(msgs));
+	state->xfer_cnt++;
 	if (err != ARRAY_SIZE(msgs)) {
+		if (err >= 0)
+			err = -EIO;
+		tc358743_trace(state, 'R', reg, 0, n, err);
 		v4l2_err(sd, "%s: #### reading register0x%x from0x%x failed\n",
 				__func__, reg, client->addr);
-		return -1;
+		return err;
 	}
+	tc358743_trace(state, 'R', reg, tc358xxx_trace_val(values, n), n, 0);
 	//udelay(10);
 	return 0;
 }
@@ -304,7 +600,7 @@ static int i2c_wr(struct v4l2_subdev *sd, u16 reg, u8 *values, u32 n)
 	if ((2 + n) > sizeof(state->wr_data)){
 		v4l2_warn(sd, "i2c wr reg=%04x: len=%d is too big!\n",
 			  reg, 2 + n);
-		return -1;
+		return -EINVAL;
 	}
 
 	msg.addr = client->addr;
@@ -319,43 +615,458 @@ static int i2c_wr(struct v4l2_subdev *sd, u16 reg, u8 *values, u32 n)
 		data[2 + i] = values[i];
 
 	err = i2c_transfer(client->adapter, &msg, 1);
-	if (err != 1) {
+	state->xfer_cnt++;
+	if (err >= 0)
+		err = err == 1 ? 0 : -EIO;
+	tc358743_trace(state, 'W', reg, tc358xxx_trace_val(values, n), n, err);
+	if (err) {
 		v4l2_err(sd, "%s: writing register0x%x from0x%x failed\n",
 				__func__, reg, client->addr);
+		return err;
+	}
+	return 0;
+}
+/* --------------- REGMAP --------------- */
+
+/*
+ * Register descriptors, REF_01 p. 66-72. The table is sorted by address.
+ * def is the power-on value where REF_01 documents one and 0 otherwise; it is
+ * informational only and not used to seed the cache. The EDID RAM isn't part
+ * of the map, it is written in bursts by tc358743_write_edid().
+ */
+#define TC358743_REG_RD		BIT(0)
+#define TC358743_REG_WR		BIT(1)
+#define TC358743_REG_RW		(TC358743_REG_RD | TC358743_REG_WR)
+#define TC358743_REG_VOLATILE	BIT(2)	/* changed by the hardware */
+
+struct tc358743_reg_desc {
+	u16 reg;
+	u8 width;	/* bytes on the bus */
+	u8 flags;
+	u32 def;
+};
+
+/* Register width of each address block, REF_01 p. 66-72 */
+#define TC358743_BLOCK_WIDTH(reg)					\
+	((reg) <= 0x00ff ? 2 : (reg) <= 0x06ff ? 4 : (reg) <= 0x84ff ? 2 : 1)
+
+/* A width that doesn't match the block or the reset value breaks the build */
+#define TC358743_REG(_reg, _width, _flags, _def)			\
+	{								\
+		.reg = (_reg) + BUILD_BUG_ON_ZERO((_reg) % (_width)),	\
+		.width = (_width) +					\
+			BUILD_BUG_ON_ZERO(TC358743_BLOCK_WIDTH(_reg) !=	\
+					  (_width)) +			\
+			BUILD_BUG_ON_ZERO((u64)(_def) >> (8 * (_width))), \
+		.flags = (_flags),					\
+		.def = (_def),						\
+	}
+
+/*
+ * Status, interrupt flags, detected timings, infoframes, the HDCP port and
+ * write triggers are volatile. ANA_CTL is cleared by hardware in DVI mode.
+ */
+static const struct tc358743_reg_desc tc358743_regs[] = {
+	/* Global */
+	TC358743_REG(CHIPID, 2, TC358743_REG_RD, 0x0000),
+	TC358743_REG(SYSCTL, 2, TC358743_REG_RW, 0x0000),
+	TC358743_REG(CONFCTL, 2, TC358743_REG_RW, 0x0000),
+	TC358743_REG(FIFOCTL, 2, TC358743_REG_RW, 0x0000),
+	TC358743_REG(INTSTATUS, 2,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x0000),
+	TC358743_REG(INTMASK, 2, TC358743_REG_RW, 0x0000),
+	TC358743_REG(INTFLAG, 2,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x0000),
+	TC358743_REG(INTSYSSTATUS, 2,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x0000),
+	TC358743_REG(PLLCTL0, 2, TC358743_REG_RW, 0x0000),
+	TC358743_REG(PLLCTL1, 2, TC358743_REG_RW, 0x0000),
+	/* CSI2-TX D-PHY */
+	TC358743_REG(CLW_CNTRL, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(D0W_CNTRL, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(D1W_CNTRL, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(D2W_CNTRL, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(D3W_CNTRL, 4, TC358743_REG_RW, 0x00000000),
+	/* CSI2-TX PPI */
+	TC358743_REG(STARTCNTRL, 4,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00000000),
+	TC358743_REG(LINEINITCNT, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(LPTXTIMECNT, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(TCLK_HEADERCNT, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(TCLK_TRAILCNT, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(THS_HEADERCNT, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(TWAKEUP, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(TCLK_POSTCNT, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(THS_TRAILCNT, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(HSTXVREGCNT, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(HSTXVREGEN, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(TXOPTIONCNTRL, 4, TC358743_REG_RW, 0x00000000),
+	/* CSI2-TX control */
+	TC358743_REG(CSI_CONTROL, 4,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00000000),
+	TC358743_REG(CSI_STATUS, 4,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00000000),
+	TC358743_REG(CSI_INT, 4,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00000000),
+	TC358743_REG(CSI_INT_ENA, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(CSI_ERR, 4,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00000000),
+	TC358743_REG(CSI_ERR_INTENA, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(CSI_ERR_HALT, 4, TC358743_REG_RW, 0x00000000),
+	TC358743_REG(CSI_CONFW, 4,
+		     TC358743_REG_WR | TC358743_REG_VOLATILE, 0x00000000),
+	TC358743_REG(CSI_INT_CLR, 4,
+		     TC358743_REG_WR | TC358743_REG_VOLATILE, 0x00000000),
+	TC358743_REG(CSI_START, 4,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00000000),
+	/* CEC */
+	TC358743_REG(CECEN, 4, TC358743_REG_RW, 0x00000000),
+	/* HDMIRX interrupts and status */
+	TC358743_REG(HDMI_INT0, 1,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(HDMI_INT1, 1,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(SYS_INT, 1, TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(CLK_INT, 1, TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(CBIT_INT, 1,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(AUDIO_INT, 1,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(ERR_INT, 1, TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(HDCP_INT, 1,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(MISC_INT, 1,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(KEY_INT, 1, TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(SYS_INTM, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(CLK_INTM, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(PACKET_INTM, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(CBIT_INTM, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(AUDIO_INTM, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(ERR_INTM, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(HDCP_INTM, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(MISC_INTM, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(KEY_INTM, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(SYS_STATUS, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(VI_STATUS1, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(AU_STATUS0, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(VI_STATUS3, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	/* HDMIRX PHY and system control */
+	TC358743_REG(PHY_CTL0, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(PHY_CTL1, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(PHY_CTL2, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(PHY_EN, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(PHY_RST, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(PHY_BIAS, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(PHY_CSQ, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(SYS_FREQ0, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(SYS_FREQ1, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(SYS_CLK, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(DDC_CTL, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(HPD_CTL, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(ANA_CTL, 1, TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(AVM_CTL, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(INIT_END, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(HDMI_DET, 1, TC358743_REG_RW, 0x00),
+	/* HDMIRX HDCP and video */
+	TC358743_REG(HDCP_MODE, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(HDCP_REG1, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(HDCP_REG2, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(VI_MODE, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(VOUT_SET2, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(VOUT_SET3, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(VI_REP, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(VI_MUTE, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(DE_WIDTH_H_LO, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(DE_WIDTH_H_HI, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(DE_WIDTH_V_LO, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(DE_WIDTH_V_HI, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(H_SIZE_LO, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(H_SIZE_HI, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(V_SIZE_LO, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(V_SIZE_HI, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(FV_CNT_LO, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(FV_CNT_HI, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(FH_MIN0, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(FH_MIN1, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(FH_MAX0, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(FH_MAX1, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(HV_RST, 1, TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(EDID_MODE, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(EDID_LEN1, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(EDID_LEN2, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(HDCP_REG3, 1, TC358743_REG_RW, 0x00),
+	/* HDMIRX audio */
+	TC358743_REG(FORCE_MUTE, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(CMD_AUD, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(AUTO_CMD0, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(AUTO_CMD1, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(AUTO_CMD2, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(BUFINIT_START, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(FS_MUTE, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(FS_IMODE, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(FS_SET, 1, TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(LOCKDET_REF0, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(LOCKDET_REF1, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(LOCKDET_REF2, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(ACR_MODE, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(ACR_MDF0, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(ACR_MDF1, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(SDO_MODE1, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(DIV_MODE, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(NCO_F0_MOD, 1, TC358743_REG_RW, 0x00),
+	/* HDMIRX infoframes */
+	TC358743_REG(PK_INT_MODE, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(NO_PKT_LIMIT, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(NO_PKT_CLR, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(ERR_PK_LIMIT, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(NO_PKT_LIMIT2, 1, TC358743_REG_RW, 0x00),
+	TC358743_REG(PK_AVI_0HEAD, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_1HEAD, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_2HEAD, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_0BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_1BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_2BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_3BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_4BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_5BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_6BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_7BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_8BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_9BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_10BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_11BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_12BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_13BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_14BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_15BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(PK_AVI_16BYTE, 1,
+		     TC358743_REG_RD | TC358743_REG_VOLATILE, 0x00),
+	/* HDMIRX HDCP port */
+	TC358743_REG(BKSV, 1, TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(BKSV + 1, 1,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(BKSV + 2, 1,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(BKSV + 3, 1,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(BKSV + 4, 1,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(BCAPS, 1, TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	TC358743_REG(BSTATUS1, 1,
+		     TC358743_REG_RW | TC358743_REG_VOLATILE, 0x00),
+	/* GBD extraction control */
+	TC358743_REG(NO_GDB_LIMIT, 1, TC358743_REG_RW, 0x00),
+};
+
+static int tc358743_reg_desc_cmp(const void *key, const void *elt)
+{
+	const struct tc358743_reg_desc *desc = elt;
+	unsigned int reg = *(const unsigned int *)key;
+
+	if (reg < desc->reg)
 		return -1;
+	return reg > desc->reg;
+}
+
+/* Returns NULL for addresses without a documented register */
+static const struct tc358743_reg_desc *tc358743_reg_desc(unsigned int reg)
+{
+	return bsearch(&reg, tc358743_regs, ARRAY_SIZE(tc358743_regs),
+		       sizeof(tc358743_regs[0]), tc358743_reg_desc_cmp);
+}
+
+static bool tc358743_reg_is(unsigned int reg, u8 flags)
+{
+	const struct tc358743_reg_desc *desc = tc358743_reg_desc(reg);
+
+	return desc && (desc->flags & flags);
+}
+
+static bool tc358743_readable_reg(struct device *dev, unsigned int reg)
+{
+	return tc358743_reg_is(reg, TC358743_REG_RD);
+}
+
+static bool tc358743_writeable_reg(struct device *dev, unsigned int reg)
+{
+	return tc358743_reg_is(reg, TC358743_REG_WR);
+}
+
+static bool tc358743_volatile_reg(struct device *dev, unsigned int reg)
+{
+	return tc358743_reg_is(reg, TC358743_REG_VOLATILE);
+}
+
+/* Bus width of a register known to regmap */
+static u8 tc358743_reg_width(unsigned int reg)
+{
+	return tc358743_reg_desc(reg)->width;
+}
+
+/*
+ * Register widths depend on the address, so regmap uses the widest one and
+ * the bus callbacks pick the right width for each register.
+ */
+static int tc358743_regmap_reg_read(void *context, unsigned int reg,
+				    unsigned int *val)
+{
+	struct tc358743_state *state = context;
+	__le32 raw = 0;
+	int err;
+
+	err = i2c_rd(&state->sd, reg, (u8 *)&raw, tc358743_reg_width(reg));
+	if (err)
+		return err;
+
+	*val = le32_to_cpu(raw);
+	return 0;
+}
+
+static int i2c_batch_xfer(struct v4l2_subdev *sd,
+			  struct tc358743_reg_batch *batch);
+
+static int tc358743_regmap_reg_write(void *context, unsigned int reg,
+				     unsigned int val)
+{
+	struct tc358743_state *state = context;
+	struct tc358743_reg_batch *batch = state->batch;
+	__le32 raw = cpu_to_le32(val);
+	int err;
+
+	/* a batch is being flushed, the bus transfer is done by the batch */
+	if (batch) {
+		/* regcache_sync() passes on more writes than a batch holds */
+		if (batch->num_regs == ARRAY_SIZE(batch->regs)) {
+			err = i2c_batch_xfer(&state->sd, batch);
+			if (err)
+				return err;
+		}
+		batch->regs[batch->num_regs].reg = reg;
+		batch->regs[batch->num_regs].val = val;
+		batch->regs[batch->num_regs].len = tc358743_reg_width(reg);
+		batch->num_regs++;
+		return 0;
 	}
+
+	return i2c_wr(&state->sd, reg, (u8 *)&raw, tc358743_reg_width(reg));
+}
+
+static const struct regmap_config sensor_regmap_config = {
+	.reg_bits = 16,
+	.val_bits = 32,
+	.max_register = 0x90ff,
+	.reg_read = tc358743_regmap_reg_read,
+	.reg_write = tc358743_regmap_reg_write,
+	.readable_reg = tc358743_readable_reg,
+	.writeable_reg = tc358743_writeable_reg,
+	.volatile_reg = tc358743_volatile_reg,
+	.cache_type = REGCACHE_RBTREE,
+};
+
+static int i2c_rdreg(struct v4l2_subdev *sd, u16 reg, u32 *val)
+{
+	struct tc358743_state *state = to_state(sd);
+	unsigned int tmp;
+	int err;
+
+	err = regmap_read(state->regmap, reg, &tmp);
+	if (err)
+		return err;
+
+	*val = tmp;
 	return 0;
 }
+
+/*
+ * Writes that wouldn't change a cached register are dropped. Volatile and
+ * write-only registers are triggers or not cached, they always go out.
+ */
+static int i2c_wrreg(struct v4l2_subdev *sd, u16 reg, u32 val)
+{
+	struct tc358743_state *state = to_state(sd);
+	unsigned int cur;
+
+	if (tc358743_reg_is(reg, TC358743_REG_RD) &&
+	    !tc358743_reg_is(reg, TC358743_REG_VOLATILE) &&
+	    !regmap_read(state->regmap, reg, &cur) && cur == val)
+		return 0;
+
+	return regmap_write(state->regmap, reg, val);
+}
+
+/* Bits cleared in mask are replaced by val, skipped if nothing changes */
+static void i2c_update_bits(struct v4l2_subdev *sd, u16 reg, u32 mask,
+			    u32 val)
+{
+	struct tc358743_state *state = to_state(sd);
+
+	regmap_update_bits(state->regmap, reg, ~mask | val, val);
+}
+
 static u8 i2c_rd8(struct v4l2_subdev *sd, u16 reg)
 {
-	u8 val;
+	u32 val = 0;
 
-	i2c_rd(sd, reg, &val, 1);
+	i2c_rdreg(sd, reg, &val);
 
 	return val;
 }
 
 static void i2c_wr8(struct v4l2_subdev *sd, u16 reg, u8 val)
 {
-	i2c_wr(sd, reg, &val, 1);
+	i2c_wrreg(sd, reg, val);
 }
 
 static void i2c_wr8_and_or(struct v4l2_subdev *sd, u16 reg,	u8 mask, u8 val)
 {
-	i2c_wr8(sd, reg, (i2c_rd8(sd, reg) & mask) | val);
+	i2c_update_bits(sd, reg, mask, val & 0xff);
 }
 
 static u16 i2c_rd16(struct v4l2_subdev *sd, u16 reg)
 {
-	u16 val;
+	u32 val;
 	int ret;
 	// v4l2_info(sd, "Reading i2c_rd16\n");
 	
 
-	ret = i2c_rd(sd, reg, (u8 *)&val, 2);
+	ret = i2c_rdreg(sd, reg, &val);
 	// v4l2_info(sd, "RET %d\n", ret);
 
-	if (ret == -1) {
+	if (ret) {
 		// Read failed
 		return 99;  // TODO. Make this better!
 	}
@@ -365,27 +1076,203 @@ static u16 i2c_rd16(struct v4l2_subdev *sd, u16 reg)
 
 static void i2c_wr16(struct v4l2_subdev *sd, u16 reg, u16 val)
 {
-	i2c_wr(sd, reg, (u8 *)&val, 2);
+	i2c_wrreg(sd, reg, val);
 }
 
 static void i2c_wr16_and_or(struct v4l2_subdev *sd, u16 reg, u16 mask, u16 val)
 {
-	i2c_wr16(sd, reg, (i2c_rd16(sd, reg) & mask) | val);
+	i2c_update_bits(sd, reg, mask, val);
 }
 
 static u32 i2c_rd32(struct v4l2_subdev *sd, u16 reg)
 {
-	u32 val;
+	u32 val = 0;
 
-	i2c_rd(sd, reg, (u8 *)&val, 4);
+	i2c_rdreg(sd, reg, &val);
 
 	return val;
 }
 
 static void i2c_wr32(struct v4l2_subdev *sd, u16 reg, u32 val)
 {
-	i2c_wr(sd, reg, (u8 *)&val, 4);
+	i2c_wrreg(sd, reg, val);
+}
+
+static void i2c_batch_init(struct tc358743_reg_batch *batch)
+{
+	batch->num = 0;
+	batch->num_regs = 0;
+	batch->err = 0;
+}
+
+/* Send the writes regmap passed on, merging adjacent registers */
+static int i2c_batch_xfer(struct v4l2_subdev *sd,
+			  struct tc358743_reg_batch *batch)
+{
+	struct tc358743_state *state = to_state(sd);
+	struct i2c_client *client = state->i2c_client;
+	struct i2c_msg msgs[BATCH_MAX_REGS];
+	u8 data[BATCH_MAX_REGS * (2 + 4)];
+	unsigned int i, j, num_msgs = 0;
+	u8 *buf = data;
+	int err;
+
+	if (!batch->num_regs)
+		return 0;
+
+	for (i = 0; i < batch->num_regs; i++) {
+		u16 reg = batch->regs[i].reg;
+		u8 len = batch->regs[i].len;
+		u32 val = batch->regs[i].val;
+
+		if (i && reg == batch->regs[i - 1].reg +
+			       batch->regs[i - 1].len) {
+			msgs[num_msgs - 1].len += len;
+		} else {
+			buf[0] = reg >> 8;
+			buf[1] = reg & 0xff;
+
+			msgs[num_msgs].addr = client->addr;
+			msgs[num_msgs].flags = 0;
+			msgs[num_msgs].len = 2 + len;
+			msgs[num_msgs].buf = buf;
+			num_msgs++;
+			buf += 2;
+		}
+
+		/* register values are little endian on the bus */
+		for (j = 0; j < len; j++)
+			*buf++ = (val >> (8 * j)) & 0xff;
+	}
+
+	err = i2c_transfer(client->adapter, msgs, num_msgs);
+	state->xfer_cnt++;
+	/* a short transfer left the later registers unwritten */
+	if (err >= 0)
+		err = err == num_msgs ? 0 : -EIO;
+	for (i = 0; i < batch->num_regs; i++)
+		tc358743_trace(state, 'W', batch->regs[i].reg,
+			       batch->regs[i].val, batch->regs[i].len, err);
+	if (err)
+		v4l2_err(sd, "%s: writing %u messages to 0x%x failed: %d\n",
+			 __func__, num_msgs, client->addr, err);
+
+	batch->num_regs = 0;
+	return err;
+}
+
+/*
+ * Flush the batch. The writes go through regmap, which updates the cache and
+ * hands them back to i2c_batch_xfer() for the bus transfer.
+ */
+static int i2c_batch_flush(struct v4l2_subdev *sd,
+			   struct tc358743_reg_batch *batch)
+{
+	struct tc358743_state *state = to_state(sd);
+	unsigned int i;
+	int err;
+
+	if (batch->err || !batch->num)
+		return batch->err;
+
+	state->batch = batch;
+	err = regmap_multi_reg_write(state->regmap, batch->seq, batch->num);
+	state->batch = NULL;
+	if (!err)
+		err = i2c_batch_xfer(sd, batch);
+
+	/* the cache doesn't match the hardware anymore */
+	if (err)
+		for (i = 0; i < batch->num; i++)
+			regcache_drop_region(state->regmap, batch->seq[i].reg,
+					     batch->seq[i].reg);
+
+	batch->num = 0;
+	batch->num_regs = 0;
+	batch->err = err;
+	return err;
+}
+
+/*
+ * Write back the registers changed while the cache was cache-only, merged
+ * into bursts by i2c_batch_xfer().
+ */
+static int tc358743_regcache_sync(struct v4l2_subdev *sd)
+{
+	struct tc358743_state *state = to_state(sd);
+	unsigned long xfers = state->xfer_cnt;
+	struct tc358743_reg_batch batch;
+	int err;
+
+	i2c_batch_init(&batch);
+	regcache_cache_only(state->regmap, false);
+
+	state->batch = &batch;
+	err = regcache_sync(state->regmap);
+	state->batch = NULL;
+	if (!err)
+		err = i2c_batch_xfer(sd, &batch);
+
+	/* retry the whole cache next time */
+	if (err)
+		regcache_mark_dirty(state->regmap);
+
+	v4l2_dbg(1, debug, sd, "%s: %lu bus transactions: %d\n", __func__,
+		 state->xfer_cnt - xfers, err);
+
+	return err;
 }
+
+static void i2c_batch_add(struct v4l2_subdev *sd,
+			  struct tc358743_reg_batch *batch,
+			  u16 reg, u32 val)
+{
+	if (batch->num == BATCH_MAX_REGS)
+		i2c_batch_flush(sd, batch);
+
+	/* the sequence is aborted, drop the remaining writes */
+	if (batch->err)
+		return;
+
+	batch->seq[batch->num].reg = reg;
+	batch->seq[batch->num].def = val;
+	batch->seq[batch->num].delay_us = 0;
+	batch->num++;
+}
+
+static void i2c_batch_wr32(struct v4l2_subdev *sd,
+			   struct tc358743_reg_batch *batch, u16 reg, u32 val)
+{
+	i2c_batch_add(sd, batch, reg, val);
+}
+/* --------------- RUNTIME PM REFERENCES --------------- */
+
+/*
+ * The status registers are volatile, reading them while runtime suspended
+ * fails. Everything that reads them holds a reference.
+ */
+static int tc358743_pm_get(struct v4l2_subdev *sd)
+{
+	struct device *dev = &to_state(sd)->i2c_client->dev;
+	int err;
+
+	err = pm_runtime_get_sync(dev);
+	if (err < 0) {
+		pm_runtime_put_noidle(dev);
+		return err;
+	}
+
+	return 0;
+}
+
+static void tc358743_pm_put(struct v4l2_subdev *sd)
+{
+	struct device *dev = &to_state(sd)->i2c_client->dev;
+
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_put_autosuspend(dev);
+}
+
 /* --------------- STATUS --------------- */
 
 static inline bool is_hdmi(struct v4l2_subdev *sd)
@@ -506,11 +1393,15 @@ static void tc358743_delayed_work_enable_hotplug(struct work_struct *work)
 
 	v4l2_info(sd, "%s:\n", __func__);
 
-	
+	if (tc358743_pm_get(sd))
+		return;
+
 	i2c_wr8_and_or(sd, HPD_CTL, ~MASK_HPD_OUT0, MASK_HPD_OUT0);
 	/*hainh 
 	i2c_wr8_and_or(sd, HPD_CTL, ~MASK_HPD_CTL0, MASK_HPD_CTL0);
 	*/
+
+	tc358743_pm_put(sd);
 }
 
 static void tc358743_set_hdmi_hdcp(struct v4l2_subdev *sd, bool enable)
@@ -564,30 +1455,6 @@ static void tc358743_erase_bksv(struct v4l2_subdev *sd)
 		i2c_wr8(sd, BKSV + i, 0);
 }
 
-/* --------------- AVI infoframe --------------- */
-
-static void print_avi_infoframe(struct v4l2_subdev *sd)
-{
-	struct i2c_client *client = v4l2_get_subdevdata(sd);
-	struct device *dev = &client->dev;
-	union hdmi_infoframe frame;
-	u8 buffer[HDMI_INFOFRAME_SIZE(AVI)];
-
-	if (!is_hdmi(sd)) {
-		v4l2_info(sd, "DVI-D signal - AVI infoframe not supported\n");
-		return;
-	}
-
-	i2c_rd(sd, PK_AVI_0HEAD, buffer, HDMI_INFOFRAME_SIZE(AVI));
-
-	if (hdmi_infoframe_unpack(&frame, buffer) < 0) {
-		v4l2_err(sd, "%s: unpack of AVI infoframe failed\n", __func__);
-		return;
-	}
-
-	hdmi_infoframe_log(KERN_INFO, dev, &frame);
-}
-
 /* --------------- CTRLS --------------- */
 
 static int tc358743_s_ctrl_detect_tx_5v(struct v4l2_subdev *sd)
@@ -623,29 +1490,80 @@ static int tc358743_update_controls(struct v4l2_subdev *sd)
 
 	return ret;
 }
+/*
+ * A line has to leave the chip within one HDMI line period, so the CSI link
+ * must carry the active pixels of a line at the output bpp in the time of a
+ * full line. Receivers rarely take 3 lanes, so 1, 2 or 4 are used, limited to
+ * the lanes wired up.
+ */
 static unsigned tc358743_num_csi_lanes_needed(struct v4l2_subdev *sd)
 {
 	struct tc358743_state *state = to_state(sd);
 	struct v4l2_bt_timings *bt = &state->timings.bt;
 	struct tc358743_platform_data *pdata = &state->pdata;
 	u32 bits_pr_pixel = (state->mbus_fmt_code == MEDIA_BUS_FMT_UYVY8_1X16) ?  16 : 24;
+	u32 bps_pr_lane = (pdata->refclk_hz / pdata->pll_prd) * pdata->pll_fbd;
+	u32 frame_width = V4L2_DV_BT_FRAME_WIDTH(bt);
+	unsigned lanes;
+	u64 bps;
+
+	if (!frame_width || !bt->pixelclock)
+		return state->csi_lanes_max;
+
+	bps = div_u64(bt->pixelclock * bits_pr_pixel * bt->width, frame_width);
+	lanes = DIV_ROUND_UP_ULL(bps, bps_pr_lane);
+	if (lanes == 3)
+		lanes = 4;
+
+	if (lanes > state->csi_lanes_max) {
+		v4l2_warn(sd, "%llu bps need %u lanes, only %u available\n",
+			  bps, lanes, state->csi_lanes_max);
+		lanes = state->csi_lanes_max;
+	}
 
-	u32 bps = bt->width * bt->height * fps(bt) * bits_pr_pixel;
+	v4l2_dbg(1, debug, sd, "%s: %llu bps over %u lanes of %u bps\n",
+		 __func__, bps, lanes, bps_pr_lane);
 
+	return lanes;
+}
+
+/*
+ * Non-continuous clock mode is only usable when the time each line spends
+ * in LP, i.e. the HDMI line period minus the time the line takes on the
+ * CSI lanes, covers the clock lane HS->LP->HS turnaround. Fall back to
+ * continuous clock otherwise.
+ */
+static bool tc358743_csi_continuous_clk(struct v4l2_subdev *sd,
+					 unsigned lanes)
+{
+	struct tc358743_state *state = to_state(sd);
+	struct v4l2_bt_timings *bt = &state->timings.bt;
+	struct tc358743_platform_data *pdata = &state->pdata;
+	u32 bits_pr_pixel = (state->mbus_fmt_code == MEDIA_BUS_FMT_UYVY8_1X16) ?  16 : 24;
 	u32 bps_pr_lane = (pdata->refclk_hz / pdata->pll_prd) * pdata->pll_fbd;
+	u32 frame_width = V4L2_DV_BT_FRAME_WIDTH(bt);
+	u64 line_ns, tx_ns;
 
+	if (pdata->endpoint.bus.mipi_csi2.flags &
+	    V4L2_MBUS_CSI2_CONTINUOUS_CLOCK)
+		return true;
 
-	printk("TC358743DEBUG: tc358743_num_csi_lanes_needed, u32 bt->width is %u ", bt->width );
-	printk("TC358743DEBUG: tc358743_num_csi_lanes_needed, u32 bt->height is %u ", bt->height ); 
-	printk("TC358743DEBUG: tc358743_num_csi_lanes_needed, u32 fps(bt) is %u ", fps(bt) );
-	printk("TC358743DEBUG: tc358743_num_csi_lanes_needed, u32 bits_pr_pixel is %u ", bits_pr_pixel );
-	printk("TC358743DEBUG: tc358743_num_csi_lanes_needed, u32 bps is %u ", bps );
+	if (!state->csi_hs_lp_hs_ns || !frame_width || !bt->pixelclock ||
+	    !lanes)
+		return false;
 
-	printk("TC358743DEBUG: tc358743_num_csi_lanes_needed, u32 bps_pr_lane is %u ", bps_pr_lane );
-	printk("TC358743DEBUG: tc358743_num_csi_lanes_needed, u tc358743_num_csi_lanes_needed is %u ", DIV_ROUND_UP(bps, bps_pr_lane) );
+	line_ns = div64_u64((u64)frame_width * NSEC_PER_SEC, bt->pixelclock);
+	tx_ns = div64_u64((u64)bt->width * bits_pr_pixel * NSEC_PER_SEC,
+			  (u64)bps_pr_lane * lanes);
+
+	if (line_ns < tx_ns + state->csi_hs_lp_hs_ns) {
+		v4l2_warn(sd, "%llu ns line blanking too short for %u ns clock lane turnaround, using continuous clock\n",
+			  line_ns > tx_ns ? line_ns - tx_ns : 0,
+			  state->csi_hs_lp_hs_ns);
+		return true;
+	}
 
-//	return DIV_ROUND_UP(bps, bps_pr_lane);
-	return 2;
+	return false;
 }
 // static int tc358743_get_edid(struct v4l2_subdev *sd){
 // 	//static int i2c_rd(struct v4l2_subdev *sd, u16 reg, u8 *values, u32 n)
@@ -661,94 +1579,188 @@ static unsigned tc358743_num_csi_lanes_needed(struct v4l2_subdev *sd)
 // 	v4l2_info(sd, "%s done\r\n",__func__);
 // 	return 0;
 // }
-static int tc358743_log_status(struct v4l2_subdev *sd)
+/* Called from the interrupt handler, reads everything log_status shows */
+static void tc358743_refresh_status(struct v4l2_subdev *sd)
 {
 	struct tc358743_state *state = to_state(sd);
-	struct v4l2_dv_timings timings;
-	uint8_t hdmi_sys_status =  i2c_rd8(sd, SYS_STATUS);
-	uint16_t sysctl = i2c_rd16(sd, SYSCTL);
-	u8 vi_status3 =  i2c_rd8(sd, VI_STATUS3);
+	struct tc358743_status st = { 0 };
+
+	st.chipid = i2c_rd16(sd, CHIPID);
+	st.sysctl = i2c_rd16(sd, SYSCTL);
+	st.sys_status = i2c_rd8(sd, SYS_STATUS);
+	st.edid_mode = i2c_rd8(sd, EDID_MODE);
+	st.hpd_ctl = i2c_rd8(sd, HPD_CTL);
+	st.cecen = i2c_rd16(sd, CECEN);
+	st.vi_status1 = i2c_rd8(sd, VI_STATUS1);
+	st.vi_status3 = i2c_rd8(sd, VI_STATUS3);
+	st.csi_status = i2c_rd16(sd, CSI_STATUS);
+	st.lanes_in_use = tc358743_num_csi_lanes_in_use(sd);
+	st.detected = !tc358743_get_detected_timings(sd, &st.detected_timings);
+	if (st.sys_status & MASK_S_HDMI)
+		st.avi_valid = !i2c_rd(sd, PK_AVI_0HEAD, st.avi,
+				       sizeof(st.avi));
+	st.ts = ktime_get_ns();
+
+	mutex_lock(&state->status_lock);
+	state->status = st;
+	mutex_unlock(&state->status_lock);
+}
+
+/* Render to the debugfs file if m is set, to the kernel log otherwise */
+#define tc358743_status_printf(m, sd, fmt, ...)				\
+	do {								\
+		if (m)							\
+			seq_printf(m, fmt, ##__VA_ARGS__);		\
+		else							\
+			v4l2_info(sd, fmt, ##__VA_ARGS__);		\
+	} while (0)
+
+static void tc358743_status_timings(struct seq_file *m,
+				    struct v4l2_subdev *sd, const char *prefix,
+				    const struct v4l2_dv_timings *t)
+{
+	const struct v4l2_bt_timings *bt = &t->bt;
+
+	if (!m) {
+		v4l2_print_dv_timings(sd->name, prefix, t, true);
+		return;
+	}
+
+	seq_printf(m, "%s%ux%u%s%u (%ux%u), pixelclock %llu\n", prefix,
+		   bt->width, bt->height, bt->interlaced ? "i" : "p", fps(bt),
+		   V4L2_DV_BT_FRAME_WIDTH(bt), V4L2_DV_BT_FRAME_HEIGHT(bt),
+		   bt->pixelclock);
+}
+
+static void tc358743_status_avi(struct seq_file *m, struct v4l2_subdev *sd,
+				const struct tc358743_status *st)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	union hdmi_infoframe frame;
+
+	if (!st->avi_valid) {
+		tc358743_status_printf(m, sd, "AVI infoframe: not read\n");
+		return;
+	}
+
+	if (m) {
+		seq_printf(m, "AVI infoframe: %*ph\n", (int)sizeof(st->avi),
+			   st->avi);
+		return;
+	}
+
+	if (hdmi_infoframe_unpack(&frame, (void *)st->avi) < 0) {
+		v4l2_err(sd, "%s: unpack of AVI infoframe failed\n", __func__);
+		return;
+	}
+
+	hdmi_infoframe_log(KERN_INFO, &client->dev, &frame);
+}
+
+static void tc358743_show_status(struct seq_file *m, struct v4l2_subdev *sd)
+{
+	struct tc358743_state *state = to_state(sd);
+	struct tc358743_status snap, *st = &snap;
+	bool hdmi;
 	const int deep_color_mode[4] = { 8, 10, 12, 16 };
 	static const char * const input_color_space[] = {
 		"RGB", "YCbCr 601", "Adobe RGB", "YCbCr 709", "NA (4)",
 		"xvYCC 601", "NA(6)", "xvYCC 709", "NA(8)", "sYCC601",
 		"NA(10)", "NA(11)", "NA(12)", "Adobe YCC 601"};
-	//tc358743_get_edid(sd);
-	v4l2_info(sd, "-----Chip status-----\n");
-	v4l2_info(sd, "Chip ID:0x%02x\n",
-			(i2c_rd16(sd, CHIPID) & MASK_CHIPID) >> 8);
-	v4l2_info(sd, "Chip revision:0x%02x\n",
-			i2c_rd16(sd, CHIPID) & MASK_REVID);
-	v4l2_info(sd, "Reset: IR: %d, CEC: %d, CSI TX: %d, HDMI: %d\n",
-			!!(sysctl & MASK_IRRST),
-			!!(sysctl & MASK_CECRST),
-			!!(sysctl & MASK_CTXRST),
-			!!(sysctl & MASK_HDMIRST));
-	v4l2_info(sd, "Sleep mode: %s\n", sysctl & MASK_SLEEP ? "on" : "off");
-	v4l2_info(sd, "Cable detected (+5V power): %s\n",
-			hdmi_sys_status & MASK_S_DDC5V ? "yes" : "no");
-	v4l2_info(sd, "DDC lines enabled: %s\n",
-			(i2c_rd8(sd, EDID_MODE) & MASK_EDID_MODE_E_DDC) ?
-			"yes" : "no");
-	v4l2_info(sd, "Hotplug enabled: %s\n",
-			(i2c_rd8(sd, HPD_CTL) & MASK_HPD_OUT0) ?
-			"yes" : "no");
-	v4l2_info(sd, "CEC enabled: %s\n",
-			(i2c_rd16(sd, CECEN) & MASK_CECEN) ?  "yes" : "no");
-	v4l2_info(sd, "-----Signal status-----\n");
-	v4l2_info(sd, "TMDS signal detected: %s\n",
-			hdmi_sys_status & MASK_S_TMDS ? "yes" : "no");
-	v4l2_info(sd, "Stable sync signal: %s\n",
-			hdmi_sys_status & MASK_S_SYNC ? "yes" : "no");
-	v4l2_info(sd, "PHY PLL locked: %s\n",
-			hdmi_sys_status & MASK_S_PHY_PLL ? "yes" : "no");
-	v4l2_info(sd, "PHY DE detected: %s\n",
-			hdmi_sys_status & MASK_S_PHY_SCDT ? "yes" : "no");
 
-	if (tc358743_get_detected_timings(sd, &timings)) {
-		v4l2_info(sd, "No video detected\n");
-	} else {
-		v4l2_print_dv_timings(sd->name, "Detected format: ", &timings, true);
-	}
-	v4l2_print_dv_timings(sd->name, "Configured format: ", &state->timings, true);
-
-	v4l2_info(sd, "-----CSI-TX status-----\n");
-	v4l2_info(sd, "Lanes needed: %d\n",
-			tc358743_num_csi_lanes_needed(sd));
-	v4l2_info(sd, "Lanes in use: %d\n",
-			tc358743_num_csi_lanes_in_use(sd));
-	v4l2_info(sd, "Waiting for particular sync signal: %s\n",
-			(i2c_rd16(sd, CSI_STATUS) & MASK_S_WSYNC) ?
-			"yes" : "no");
-	v4l2_info(sd, "Transmit mode: %s\n",
-			(i2c_rd16(sd, CSI_STATUS) & MASK_S_TXACT) ?
-			"yes" : "no");
-	v4l2_info(sd, "Receive mode: %s\n",
-			(i2c_rd16(sd, CSI_STATUS) & MASK_S_RXACT) ?
-			"yes" : "no");
-	v4l2_info(sd, "Stopped: %s\n",
-			(i2c_rd16(sd, CSI_STATUS) & MASK_S_HLT) ?
+	mutex_lock(&state->status_lock);
+	snap = state->status;
+	mutex_unlock(&state->status_lock);
+	hdmi = st->sys_status & MASK_S_HDMI;
+
+	tc358743_status_printf(m, sd, "Snapshot age: %llu ms\n",
+			div_u64(ktime_get_ns() - st->ts, NSEC_PER_MSEC));
+	tc358743_status_printf(m, sd, "-----Chip status-----\n");
+	tc358743_status_printf(m, sd, "Chip ID:0x%02x\n",
+			(st->chipid & MASK_CHIPID) >> 8);
+	tc358743_status_printf(m, sd, "Chip revision:0x%02x\n",
+			st->chipid & MASK_REVID);
+	tc358743_status_printf(m, sd,
+			"Reset: IR: %d, CEC: %d, CSI TX: %d, HDMI: %d\n",
+			!!(st->sysctl & MASK_IRRST),
+			!!(st->sysctl & MASK_CECRST),
+			!!(st->sysctl & MASK_CTXRST),
+			!!(st->sysctl & MASK_HDMIRST));
+	tc358743_status_printf(m, sd, "Sleep mode: %s\n",
+			st->sysctl & MASK_SLEEP ? "on" : "off");
+	tc358743_status_printf(m, sd, "Cable detected (+5V power): %s\n",
+			st->sys_status & MASK_S_DDC5V ? "yes" : "no");
+	tc358743_status_printf(m, sd, "DDC lines enabled: %s\n",
+			(st->edid_mode & MASK_EDID_MODE_E_DDC) ?
 			"yes" : "no");
-	v4l2_info(sd, "Color space: %s\n",
+	tc358743_status_printf(m, sd, "Hotplug enabled: %s\n",
+			(st->hpd_ctl & MASK_HPD_OUT0) ? "yes" : "no");
+	tc358743_status_printf(m, sd, "CEC enabled: %s\n",
+			(st->cecen & MASK_CECEN) ?  "yes" : "no");
+	tc358743_status_printf(m, sd, "-----Signal status-----\n");
+	tc358743_status_printf(m, sd, "TMDS signal detected: %s\n",
+			st->sys_status & MASK_S_TMDS ? "yes" : "no");
+	tc358743_status_printf(m, sd, "Stable sync signal: %s\n",
+			st->sys_status & MASK_S_SYNC ? "yes" : "no");
+	tc358743_status_printf(m, sd, "PHY PLL locked: %s\n",
+			st->sys_status & MASK_S_PHY_PLL ? "yes" : "no");
+	tc358743_status_printf(m, sd, "PHY DE detected: %s\n",
+			st->sys_status & MASK_S_PHY_SCDT ? "yes" : "no");
+
+	if (st->detected)
+		tc358743_status_timings(m, sd, "Detected format: ",
+					&st->detected_timings);
+	else
+		tc358743_status_printf(m, sd, "No video detected\n");
+	tc358743_status_timings(m, sd, "Configured format: ",
+				&state->timings);
+
+	tc358743_status_printf(m, sd, "-----CSI-TX status-----\n");
+	tc358743_status_printf(m, sd, "Lanes needed: %u\n", state->csi_lanes);
+	tc358743_status_printf(m, sd, "Lanes in use: %u\n",
+			st->lanes_in_use);
+	tc358743_status_printf(m, sd, "Waiting for particular sync signal: %s\n",
+			(st->csi_status & MASK_S_WSYNC) ? "yes" : "no");
+	tc358743_status_printf(m, sd, "Transmit mode: %s\n",
+			(st->csi_status & MASK_S_TXACT) ? "yes" : "no");
+	tc358743_status_printf(m, sd, "Receive mode: %s\n",
+			(st->csi_status & MASK_S_RXACT) ? "yes" : "no");
+	tc358743_status_printf(m, sd, "Stopped: %s\n",
+			(st->csi_status & MASK_S_HLT) ? "yes" : "no");
+	tc358743_status_printf(m, sd, "Color space: %s\n",
 			state->mbus_fmt_code == MEDIA_BUS_FMT_UYVY8_1X16 ?
 			"YCbCr 422 16-bit" :
 			state->mbus_fmt_code == MEDIA_BUS_FMT_RGB888_1X24 ?
 			"RGB 888 24-bit" : "Unsupported");
 
-	v4l2_info(sd, "-----%s status-----\n", is_hdmi(sd) ? "HDMI" : "DVI-D");
-	v4l2_info(sd, "HDCP encrypted content: %s\n",
-			hdmi_sys_status & MASK_S_HDCP ? "yes" : "no");
-	v4l2_info(sd, "Input color space: %s %s range\n",
-			input_color_space[(vi_status3 & MASK_S_V_COLOR) >> 1],
-			(vi_status3 & MASK_LIMITED) ? "limited" : "full");
-	if (!is_hdmi(sd))
-		return 0;
-	v4l2_info(sd, "AV Mute: %s\n", hdmi_sys_status & MASK_S_AVMUTE ? "on" :
-			"off");
-	v4l2_info(sd, "Deep color mode: %d-bits per channel\n",
-			deep_color_mode[(i2c_rd8(sd, VI_STATUS1) &
-				MASK_S_DEEPCOLOR) >> 2]);
-	print_avi_infoframe(sd);
+	tc358743_status_printf(m, sd, "-----%s status-----\n",
+			hdmi ? "HDMI" : "DVI-D");
+	tc358743_status_printf(m, sd, "HDCP encrypted content: %s\n",
+			st->sys_status & MASK_S_HDCP ? "yes" : "no");
+	tc358743_status_printf(m, sd, "Input color space: %s %s range\n",
+			input_color_space[(st->vi_status3 & MASK_S_V_COLOR) >> 1],
+			(st->vi_status3 & MASK_LIMITED) ? "limited" : "full");
+	if (hdmi) {
+		tc358743_status_printf(m, sd, "AV Mute: %s\n",
+				st->sys_status & MASK_S_AVMUTE ? "on" : "off");
+		tc358743_status_printf(m, sd,
+				"Deep color mode: %d-bits per channel\n",
+				deep_color_mode[(st->vi_status1 &
+						 MASK_S_DEEPCOLOR) >> 2]);
+		tc358743_status_avi(m, sd, st);
+	}
+}
+
+static int tc358743_log_status(struct v4l2_subdev *sd)
+{
+	int err;
+
+	err = tc358743_pm_get(sd);
+	if (err)
+		return err;
+
+	tc358743_show_status(NULL, sd);
+	tc358743_pm_put(sd);
 
 	return 0;
 }
@@ -765,10 +1777,20 @@ static void tc358743_reset_phy(struct v4l2_subdev *sd)
 
 static void tc358743_reset(struct v4l2_subdev *sd, uint16_t mask)
 {
+	struct tc358743_state *state = to_state(sd);
 	u16 sysctl = i2c_rd16(sd, SYSCTL);
 
 	i2c_wr16(sd, SYSCTL, sysctl | mask);
 	i2c_wr16(sd, SYSCTL, sysctl & ~mask);
+
+	/* the reset blocks are back at their default values */
+	if (mask & MASK_CTXRST)
+		regcache_drop_region(state->regmap, 0x0100, 0x05ff);
+	if (mask & MASK_HDMIRST) {
+		regcache_drop_region(state->regmap, 0x8500, 0x90ff);
+		/* don't trust the EDID RAM content anymore */
+		state->edid_crc_valid = false;
+	}
 }
 
 static inline void tc358743_sleep_mode(struct v4l2_subdev *sd, bool enable)
@@ -779,18 +1801,26 @@ static inline void tc358743_sleep_mode(struct v4l2_subdev *sd, bool enable)
 static inline void enable_stream(struct v4l2_subdev *sd, bool enable)
 {
 	struct tc358743_state *state = to_state(sd);
+	struct tc358743_lat_mark start, step;
+
+	v4l2_dbg(1, debug, sd, "%s: %sable\n", __func__, enable ? "en" : "dis");
 
-	v4l2_info(sd, "%s: %sable\n",	__func__, enable ? "en" : "dis");
+	tc358743_lat_start(state, &start);
+	step = start;
 
 	if (enable) {
 		/* It is critical for CSI receiver to see lane transition
 		 * LP11->HS. Set to non-continuous mode to enable clock lane
 		 * LP11 state. */
 		i2c_wr32(sd, TXOPTIONCNTRL, 0);
-		/* Set to continuous mode to trigger LP11->HS transition */
-		i2c_wr32(sd, TXOPTIONCNTRL, MASK_CONTCLKMODE);
+		/* Set to continuous mode to trigger LP11->HS transition. In
+		 * non-continuous mode the clock lane does this every line. */
+		if (state->csi_continuous_clk)
+			i2c_wr32(sd, TXOPTIONCNTRL, MASK_CONTCLKMODE);
+		tc358743_lat_step(state, TC358743_LAT_CLK, &step);
 		/* Unmute video */
 		i2c_wr8(sd, VI_MUTE, MASK_AUTO_MUTE);
+		tc358743_lat_step(state, TC358743_LAT_UNMUTE, &step);
 	} else {
 		/* Mute video so that all data lanes go to LSP11 state.
 		 * No data is output to CSI Tx block. */
@@ -801,10 +1831,15 @@ static inline void enable_stream(struct v4l2_subdev *sd, bool enable)
 	i2c_wr16_and_or(sd, CONFCTL, ~(MASK_VBUFEN | MASK_ABUFEN),
 			enable ? (MASK_VBUFEN | MASK_ABUFEN) :0x0);
 	mutex_unlock(&state->confctl_mutex);
-	v4l2_info(sd,"%d:%s: end\n",__LINE__,__FUNCTION__);		
-	if (enable)	{		
-        tc358743_log_status(sd);		
-    }
+	if (enable) {
+		tc358743_lat_step(state, TC358743_LAT_BUFFERS, &step);
+		tc358743_lat_step(state, TC358743_LAT_STREAM_ON, &start);
+		if (state->resume_pending) {
+			tc358743_lat_step(state, TC358743_LAT_RESUME,
+					  &state->resume_mark);
+			state->resume_pending = false;
+		}
+	}
 }
 static void tc358743_set_pll(struct v4l2_subdev *sd)
 {
@@ -838,7 +1873,7 @@ static void tc358743_set_pll(struct v4l2_subdev *sd)
 				~(MASK_PLL_FRS | MASK_RESETB | MASK_PLL_EN),
 				(SET_PLL_FRS(pll_frs) | MASK_RESETB |
 				 MASK_PLL_EN));
-		udelay(10); /* REF_02, Sheet "Source HDMI" */
+		usleep_range(10, 20); /* REF_02, Sheet "Source HDMI" */
 		i2c_wr16_and_or(sd, PLLCTL1, ~MASK_CKEN, MASK_CKEN);
 		tc358743_sleep_mode(sd, false);
 	}
@@ -915,60 +1950,57 @@ static void tc358743_set_csi_color_space(struct v4l2_subdev *sd)
 
 
 
-static void tc358743_set_csi(struct v4l2_subdev *sd)
+static int tc358743_set_csi(struct v4l2_subdev *sd)
 {
 	struct tc358743_state *state = to_state(sd);
 	struct tc358743_platform_data *pdata = &state->pdata;
 	unsigned lanes = tc358743_num_csi_lanes_needed(sd);
-	printk("TC358743_DEBUG: %d Lane needed!",lanes);
-	v4l2_info(sd, "%s:\n", __func__);
+	struct tc358743_reg_batch batch;
 
-	tc358743_reset(sd, MASK_CTXRST);
-
-	if (lanes < 1){
-		i2c_wr32(sd, CLW_CNTRL, MASK_CLW_LANEDISABLE);
-		printk("TC358743_DEBUG: Clock Land Disbled!!");
-	}
-	if (lanes < 1){
-		i2c_wr32(sd, D0W_CNTRL, MASK_D0W_LANEDISABLE);
-		printk("TC358743_DEBUG: D0 Land Disbled!!");
-	}
-	if (lanes < 2){
-		i2c_wr32(sd, D1W_CNTRL, MASK_D1W_LANEDISABLE);
-		printk("TC358743_DEBUG: D1 Land Disbled!!");
-	}
-	if (lanes < 3){
-		i2c_wr32(sd, D2W_CNTRL, MASK_D2W_LANEDISABLE);
-		printk("TC358743_DEBUG: D2 Land Disbled!!");
-	}
-	if (lanes < 4){
-		i2c_wr32(sd, D3W_CNTRL, MASK_D3W_LANEDISABLE);
-		printk("TC358743_DEBUG: D3 Land Disbled!!");
-	}
+	state->csi_lanes = lanes;
+	state->csi_continuous_clk = tc358743_csi_continuous_clk(sd, lanes);
+	v4l2_info(sd, "%s: %u lanes, %scontinuous clock\n", __func__, lanes,
+		  state->csi_continuous_clk ? "" : "non-");
 
-	i2c_wr32(sd, LINEINITCNT, pdata->lineinitcnt);
-	i2c_wr32(sd, LPTXTIMECNT, pdata->lptxtimecnt);
-	i2c_wr32(sd, TCLK_HEADERCNT, pdata->tclk_headercnt);
-	i2c_wr32(sd, TCLK_TRAILCNT, pdata->tclk_trailcnt);
-	i2c_wr32(sd, THS_HEADERCNT, pdata->ths_headercnt);
-	i2c_wr32(sd, TWAKEUP, pdata->twakeup);
-	i2c_wr32(sd, TCLK_POSTCNT, pdata->tclk_postcnt);
-	i2c_wr32(sd, THS_TRAILCNT, pdata->ths_trailcnt);
-	i2c_wr32(sd, HSTXVREGCNT, pdata->hstxvregcnt);
+	tc358743_reset(sd, MASK_CTXRST);
 
-	i2c_wr32(sd, HSTXVREGEN,
+	i2c_batch_init(&batch);
+
+	if (lanes < 1)
+		i2c_batch_wr32(sd, &batch, CLW_CNTRL, MASK_CLW_LANEDISABLE);
+	if (lanes < 1)
+		i2c_batch_wr32(sd, &batch, D0W_CNTRL, MASK_D0W_LANEDISABLE);
+	if (lanes < 2)
+		i2c_batch_wr32(sd, &batch, D1W_CNTRL, MASK_D1W_LANEDISABLE);
+	if (lanes < 3)
+		i2c_batch_wr32(sd, &batch, D2W_CNTRL, MASK_D2W_LANEDISABLE);
+	if (lanes < 4)
+		i2c_batch_wr32(sd, &batch, D3W_CNTRL, MASK_D3W_LANEDISABLE);
+
+	/* LINEINITCNT..TXOPTIONCNTRL are contiguous and sent as one burst */
+	i2c_batch_wr32(sd, &batch, LINEINITCNT, pdata->lineinitcnt);
+	i2c_batch_wr32(sd, &batch, LPTXTIMECNT, pdata->lptxtimecnt);
+	i2c_batch_wr32(sd, &batch, TCLK_HEADERCNT, pdata->tclk_headercnt);
+	i2c_batch_wr32(sd, &batch, TCLK_TRAILCNT, pdata->tclk_trailcnt);
+	i2c_batch_wr32(sd, &batch, THS_HEADERCNT, pdata->ths_headercnt);
+	i2c_batch_wr32(sd, &batch, TWAKEUP, pdata->twakeup);
+	i2c_batch_wr32(sd, &batch, TCLK_POSTCNT, pdata->tclk_postcnt);
+	i2c_batch_wr32(sd, &batch, THS_TRAILCNT, pdata->ths_trailcnt);
+	i2c_batch_wr32(sd, &batch, HSTXVREGCNT, pdata->hstxvregcnt);
+
+	i2c_batch_wr32(sd, &batch, HSTXVREGEN,
 			((lanes > 0) ? MASK_CLM_HSTXVREGEN :0x0) |
 			((lanes > 0) ? MASK_D0M_HSTXVREGEN :0x0) |
 			((lanes > 1) ? MASK_D1M_HSTXVREGEN :0x0) |
 			((lanes > 2) ? MASK_D2M_HSTXVREGEN :0x0) |
 			((lanes > 3) ? MASK_D3M_HSTXVREGEN :0x0));
 
-	i2c_wr32(sd, TXOPTIONCNTRL, (pdata->endpoint.bus.mipi_csi2.flags &
-		 V4L2_MBUS_CSI2_CONTINUOUS_CLOCK) ? MASK_CONTCLKMODE : 0);
-	i2c_wr32(sd, STARTCNTRL, MASK_START);
-	i2c_wr32(sd, CSI_START, MASK_STRT);
+	i2c_batch_wr32(sd, &batch, TXOPTIONCNTRL,
+			state->csi_continuous_clk ? MASK_CONTCLKMODE : 0);
+	i2c_batch_wr32(sd, &batch, STARTCNTRL, MASK_START);
+	i2c_batch_wr32(sd, &batch, CSI_START, MASK_STRT);
 
-	i2c_wr32(sd, CSI_CONFW, MASK_MODE_SET |
+	i2c_batch_wr32(sd, &batch, CSI_CONFW, MASK_MODE_SET |
 			MASK_ADDRESS_CSI_CONTROL |
 			MASK_CSI_MODE |
 			MASK_TXHSMD |
@@ -976,15 +2008,17 @@ static void tc358743_set_csi(struct v4l2_subdev *sd)
 			 (lanes == 3) ? MASK_NOL_3 :
 			 (lanes == 2) ? MASK_NOL_2 : MASK_NOL_1));
 
-	i2c_wr32(sd, CSI_CONFW, MASK_MODE_SET |
+	i2c_batch_wr32(sd, &batch, CSI_CONFW, MASK_MODE_SET |
 			MASK_ADDRESS_CSI_ERR_INTENA | MASK_TXBRK | MASK_QUNK |
 			MASK_WCER | MASK_INER);
 
-	i2c_wr32(sd, CSI_CONFW, MASK_MODE_CLEAR |
+	i2c_batch_wr32(sd, &batch, CSI_CONFW, MASK_MODE_CLEAR |
 			MASK_ADDRESS_CSI_ERR_HALT | MASK_TXBRK | MASK_QUNK);
 
-	i2c_wr32(sd, CSI_CONFW, MASK_MODE_SET |
+	i2c_batch_wr32(sd, &batch, CSI_CONFW, MASK_MODE_SET |
 			MASK_ADDRESS_CSI_INT_ENA | MASK_INTER);
+
+	return i2c_batch_flush(sd, &batch);
 }
 
 static void tc358743_set_hdmi_phy(struct v4l2_subdev *sd)
@@ -1378,30 +2412,25 @@ static void tc358743_print_register_map(struct v4l2_subdev *sd)
 	v4l2_info(sd, "0x9300-      : Reserved\n");
 }
 
-static int tc358743_get_reg_size(u16 address)
-{
-	/* REF_01 p. 66-72 */
-	if (address <=0x00ff)
-		return 2;
-	else if ((address >=0x0100) && (address <=0x06FF))
-		return 4;
-	else if ((address >=0x0700) && (address <=0x84ff))
-		return 2;
-	else
-		return 1;
-}
-
 static int tc358743_g_register(struct v4l2_subdev *sd,
 			                   struct v4l2_dbg_register *reg)
 {
-	if (reg->reg >0xffff) {
+	const struct tc358743_reg_desc *desc = tc358743_reg_desc(reg->reg);
+	int err;
+
+	if (!desc || !(desc->flags & TC358743_REG_RD)) {
 		tc358743_print_register_map(sd);
 		return -EINVAL;
 	}
 
-	reg->size = tc358743_get_reg_size(reg->reg);
+	reg->size = desc->width;
+
+	err = tc358743_pm_get(sd);
+	if (err)
+		return err;
 
 	i2c_rd(sd, reg->reg, (u8 *)&reg->val, reg->size);
+	tc358743_pm_put(sd);
 
 	return 0;
 }
@@ -1409,7 +2438,9 @@ static int tc358743_g_register(struct v4l2_subdev *sd,
 static int tc358743_s_register(struct v4l2_subdev *sd,
 			             const struct v4l2_dbg_register *reg)
 {
-	if (reg->reg >0xffff) {
+	const struct tc358743_reg_desc *desc = tc358743_reg_desc(reg->reg);
+
+	if (!desc || !(desc->flags & TC358743_REG_WR)) {
 		tc358743_print_register_map(sd);
 		return -EINVAL;
 	}
@@ -1427,8 +2458,8 @@ static int tc358743_s_register(struct v4l2_subdev *sd,
 	    reg->reg == BCAPS)
 		return 0;
 
-	i2c_wr(sd, (u16)reg->reg, (u8 *)&reg->val,
-		   tc358743_get_reg_size(reg->reg));
+	i2c_wr(sd, (u16)reg->reg, (u8 *)&reg->val, desc->width);
+	regcache_drop_region(to_state(sd)->regmap, reg->reg, reg->reg);
 
 	return 0;
 }
@@ -1476,6 +2507,8 @@ static int tc358743_isr(struct v4l2_subdev *sd, u32 status, bool *handled)
 				__func__, intstatus);
 	}
 
+	tc358743_refresh_status(sd);
+
 	return 0;
 }
 
@@ -1484,8 +2517,13 @@ static irqreturn_t tc358743_irq_handler(int irq, void *dev_id)
 	struct tc358743_state *state = dev_id;
 	bool handled = false;
 
+	if (tc358743_pm_get(&state->sd))
+		return IRQ_NONE;
+
 	tc358743_isr(&state->sd, 0, &handled);
 
+	tc358743_pm_put(&state->sd);
+
 	return handled ? IRQ_HANDLED : IRQ_NONE;
 }
 
@@ -1511,6 +2549,7 @@ static int tc358743_s_dv_timings(struct v4l2_subdev *sd,
 				                 struct v4l2_dv_timings *timings)
 {
 	struct tc358743_state *state = to_state(sd);
+	int ret;
 	v4l2_info(sd, "%s\n",__func__);
 	if (!timings)
 		return -EINVAL;
@@ -1527,11 +2566,17 @@ static int tc358743_s_dv_timings(struct v4l2_subdev *sd,
 
 	state->timings = *timings;
 
+	ret = tc358743_pm_get(sd);
+	if (ret)
+		return ret;
+
 	enable_stream(sd, false);
 	tc358743_set_pll(sd);
-	tc358743_set_csi(sd);
-	
-	return 0;
+	ret = tc358743_set_csi(sd);
+
+	tc358743_pm_put(sd);
+
+	return ret;
 }
 
 static int tc358743_g_dv_timings(struct v4l2_subdev *sd,
@@ -1563,7 +2608,12 @@ static int tc358743_query_dv_timings(struct v4l2_subdev *sd,
 	int ret;
 	v4l2_info(sd, "Calling %s\n", __FUNCTION__);
 
+	ret = tc358743_pm_get(sd);
+	if (ret)
+		return ret;
+
 	ret = tc358743_get_detected_timings(sd, timings);
+	tc358743_pm_put(sd);
 	if (ret) {
 		v4l2_err(sd, "%s: @@@@@ timings detected error\n", __func__);
 		return ret;
@@ -1586,8 +2636,15 @@ static int tc358743_g_input_status(struct v4l2_subdev *sd, u32 *status)
 {
 	struct tc358743_state *state = to_state(sd);
 	struct v4l2_dv_timings *timings = &(state->timings);
+	int err;
 	
+
 	v4l2_info(sd, "Calling %s\n", __FUNCTION__);
+
+	err = tc358743_pm_get(sd);
+	if (err)
+		return err;
+
 	*status = 0;
 	*status |= no_signal(sd) ? V4L2_IN_ST_NO_SIGNAL : 0;
 	*status |= no_sync(sd) ? V4L2_IN_ST_NO_SYNC : 0;
@@ -1598,6 +2655,8 @@ static int tc358743_g_input_status(struct v4l2_subdev *sd, u32 *status)
 	tc358743_query_dv_timings(sd, timings);
 	tc358743_s_dv_timings(sd, timings);
 
+	tc358743_pm_put(sd);
+
 	return 0;
 }
 
@@ -1619,10 +2678,11 @@ static int tc358743_g_mbus_config(struct v4l2_subdev *sd,
 	v4l2_info(sd, "Calling %s\n", __FUNCTION__);
 	cfg->type = V4L2_MBUS_CSI2;
 
-	/* Support for non-continuous CSI-2 clock is missing in the driver */
-	cfg->flags = V4L2_MBUS_CSI2_CONTINUOUS_CLOCK;
+	cfg->flags = to_state(sd)->csi_continuous_clk ?
+		     V4L2_MBUS_CSI2_CONTINUOUS_CLOCK :
+		     V4L2_MBUS_CSI2_NONCONTINUOUS_CLOCK;
 
-	switch (tc358743_num_csi_lanes_in_use(sd)) {
+	switch (to_state(sd)->csi_lanes) {
 	case 1:
 		cfg->flags |= V4L2_MBUS_CSI2_1_LANE;
 		break;
@@ -1643,18 +2703,22 @@ static int tc358743_g_mbus_config(struct v4l2_subdev *sd,
 }
 static int tc358743_s_stream(struct v4l2_subdev *sd, int enable)
 {
-	v4l2_info(sd, "Calling %s\n", __FUNCTION__);
-	v4l2_err(sd, "Calling %s\n", __FUNCTION__);
-	/* FIXME: show log status for test */
-	/*hainh
+	struct tc358743_state *state = to_state(sd);
+	int err;
+
+	/* held from stream on to stream off */
+	if (enable && !state->streaming) {
+		err = tc358743_pm_get(sd);
+		if (err)
+			return err;
+	}
+
 	enable_stream(sd, enable);
-	if (enable)
-		tc358743_log_status(sd);
-	*/
-	enable_stream(sd, true);
-	// if (true)
-	// 	tc358743_log_status(sd);
-	
+
+	if (!enable && state->streaming)
+		tc358743_pm_put(sd);
+	state->streaming = enable;
+
 	return 0;
 }
 
@@ -1665,7 +2729,8 @@ static int tc358743_get_fmt(struct v4l2_subdev *sd,
 		struct v4l2_subdev_format *format)
 {
 	struct tc358743_state *state = to_state(sd);
-	u8 vi_rep = i2c_rd8(sd, VI_REP);
+	u8 vi_rep;
+	int err;
 	v4l2_info(sd, "Calling %s\n", __FUNCTION__);
 
 	if (format->pad != 0) {
@@ -1673,6 +2738,12 @@ static int tc358743_get_fmt(struct v4l2_subdev *sd,
 		return -EINVAL;
 	}
 
+	err = tc358743_pm_get(sd);
+	if (err)
+		return err;
+	vi_rep = i2c_rd8(sd, VI_REP);
+	tc358743_pm_put(sd);
+
 	format->format.code = state->mbus_fmt_code;
 	format->format.width = state->timings.bt.width;
 	format->format.height = state->timings.bt.height;
@@ -1741,10 +2812,18 @@ static int tc358743_set_fmt(struct v4l2_subdev *sd,
 
 	state->mbus_fmt_code = format->format.code;
 
+	ret = tc358743_pm_get(sd);
+	if (ret)
+		return ret;
+
 	enable_stream(sd, false);
 	tc358743_set_pll(sd);
-	tc358743_set_csi(sd);
-	tc358743_set_csi_color_space(sd);
+	ret = tc358743_set_csi(sd);
+	if (!ret)
+		tc358743_set_csi_color_space(sd);
+	tc358743_pm_put(sd);
+	if (ret)
+		return ret;
 	v4l2_info(sd, "Called %s, completed successfully\n", __FUNCTION__);
 	return 0;
 }
@@ -1753,6 +2832,7 @@ static int tc358743_g_edid(struct v4l2_subdev *sd,
 		                   struct v4l2_subdev_edid *edid)
 {
 	struct tc358743_state *state = to_state(sd);
+	int err;
 	// int i=0;
 	v4l2_info(sd, "Calling %s\n", __FUNCTION__);
 
@@ -1773,8 +2853,12 @@ static int tc358743_g_edid(struct v4l2_subdev *sd,
 	if (edid->start_block + edid->blocks > state->edid_blocks_written)
 		edid->blocks = state->edid_blocks_written - edid->start_block;
 
+	err = tc358743_pm_get(sd);
+	if (err)
+		return err;
 	i2c_rd(sd, EDID_RAM + (edid->start_block * EDID_BLOCK_SIZE), edid->edid,
 			edid->blocks * EDID_BLOCK_SIZE);
+	tc358743_pm_put(sd);
 	v4l2_info(sd,"EDID_RAM has %d byte from: 0x%04x to 0x%04x \r\n",
 		edid->blocks * EDID_BLOCK_SIZE,
 		EDID_RAM + (edid->start_block * EDID_BLOCK_SIZE),
@@ -1788,11 +2872,53 @@ static int tc358743_g_edid(struct v4l2_subdev *sd,
 	return 0;
 }
 
+/*
+ * Write the EDID RAM in chunks the adapter can handle, then read all of it
+ * back and check that its crc32 matches what was written.
+ */
+static int tc358743_write_edid(struct v4l2_subdev *sd, u8 *data, u16 len)
+{
+	struct tc358743_state *state = to_state(sd);
+	const struct i2c_adapter_quirks *quirks =
+		state->i2c_client->adapter->quirks;
+	u16 wr_chunk = EDID_BLOCK_SIZE, rd_chunk = EDID_BLOCK_SIZE;
+	u8 buf[EDID_BLOCK_SIZE];
+	u32 crc = ~0;
+	u16 offset, n;
+
+	if (quirks && quirks->max_write_len)
+		wr_chunk = min_t(u16, wr_chunk, quirks->max_write_len - 2);
+	if (quirks && quirks->max_read_len)
+		rd_chunk = min_t(u16, rd_chunk, quirks->max_read_len);
+
+	for (offset = 0; offset < len; offset += n) {
+		n = min_t(u16, wr_chunk, len - offset);
+		if (i2c_wr(sd, EDID_RAM + offset, data + offset, n))
+			return -EIO;
+	}
+
+	for (offset = 0; offset < len; offset += n) {
+		n = min_t(u16, rd_chunk, len - offset);
+		if (i2c_rd(sd, EDID_RAM + offset, buf, n))
+			return -EIO;
+		crc = crc32_le(crc, buf, n);
+	}
+
+	if (crc != crc32_le(~0, data, len)) {
+		v4l2_err(sd, "%s: EDID readback mismatch\n", __func__);
+		return -EIO;
+	}
+
+	return 0;
+}
+
 static int tc358743_s_edid(struct v4l2_subdev *sd,
 				           struct v4l2_subdev_edid *edid)
 {
 	struct tc358743_state *state = to_state(sd);
 	u16 edid_len = edid->blocks * EDID_BLOCK_SIZE;
+	u32 crc;
+	int err;
 	
 	v4l2_info(sd, "%s, pad %d, start block %d, blocks %d\n",
 		 __func__, edid->pad, edid->start_block, edid->blocks);
@@ -1808,28 +2934,54 @@ static int tc358743_s_edid(struct v4l2_subdev *sd,
 		return -E2BIG;
 	}
 
+	/*
+	 * Rewriting the EDID toggles hotplug, which makes the source drop
+	 * the link for a few seconds. Skip it if nothing changed.
+	 */
+	crc = crc32_le(~0, edid->edid, edid_len);
+	if (state->edid_crc_valid &&
+	    state->edid_blocks_written == edid->blocks &&
+	    state->edid_crc == crc) {
+		v4l2_info(sd, "%s: EDID unchanged\n", __func__);
+		return 0;
+	}
+
+	/* the EDID RAM is written and read back directly */
+	err = tc358743_pm_get(sd);
+	if (err)
+		return err;
+
 	tc358743_disable_edid(sd);
+	state->edid_crc_valid = false;
 
 	i2c_wr8(sd, EDID_LEN1, edid_len &0xff);
 	i2c_wr8(sd, EDID_LEN2, edid_len >> 8);
 
 	if (edid->blocks == 0) {
 		state->edid_blocks_written = 0;
-		return 0;
+		state->edid_crc = crc;
+		state->edid_crc_valid = true;
+		goto out;
 	}
-	i2c_wr(sd, EDID_RAM, edid->edid, edid_len);
-	/* richardyou
-	for (i=0; i<edid_len; i++) {
-		i2c_wr8(sd, EDID_RAM + i, edid->edid[i]);
+
+	err = tc358743_write_edid(sd, edid->edid, edid_len);
+	if (err) {
+		state->edid_blocks_written = 0;
+		goto out;
 	}
-	*/
+
+	memcpy(state->edid, edid->edid, edid_len);
 	state->edid_blocks_written = edid->blocks;
+	state->edid_crc = crc;
+	state->edid_crc_valid = true;
 
 	// if (tx_5v_power_present(sd))
 		tc358743_enable_edid(sd);
 
 	v4l2_info(sd, "%s completed successfully", __FUNCTION__);
-	return 0;
+out:
+	tc358743_pm_put(sd);
+	return err;
 }
 // static int tc358743_mbus_fmt(struct v4l2_subdev *sd, struct v4l2_mbus_framefmt *mf)
 // {
@@ -1974,6 +3126,12 @@ static int tc358743_enum_frame_interval(struct v4l2_subdev *sd,
 
 static int tc358743_s_power(struct v4l2_subdev *sd, int on)
 {
+	/* held from power on to power off */
+	if (on)
+		return tc358743_pm_get(sd);
+
+	tc358743_pm_put(sd);
+
 	return 0;
 }
 static const struct v4l2_subdev_core_ops tc358743_core_ops = {
@@ -2015,6 +3173,68 @@ static const struct v4l2_subdev_ops tc358743_ops = {
 	.video = &tc358743_video_ops,
 	.pad = &tc358743_pad_ops,
 };
+/* --------------- LINK FREQUENCY --------------- */
+
+/* Copy the settings of a link frequency to the ones set_pll/set_csi use */
+static void tc358743_apply_link_freq(struct tc358743_state *state,
+				     unsigned int idx)
+{
+	const struct tc358743_csi_param *csi = &state->link_freq_settings[idx];
+	struct tc358743_platform_data *pdata = &state->pdata;
+
+	pdata->pll_prd = csi->pll_prd;
+	pdata->pll_fbd = csi->pll_fbd;
+	pdata->lineinitcnt = csi->lineinitcnt;
+	pdata->lptxtimecnt = csi->lptxtimecnt;
+	pdata->tclk_headercnt = csi->tclk_headercnt;
+	pdata->tclk_trailcnt = csi->tclk_trailcnt;
+	pdata->ths_headercnt = csi->ths_headercnt;
+	pdata->twakeup = csi->twakeup;
+	pdata->tclk_postcnt = csi->tclk_postcnt;
+	pdata->ths_trailcnt = csi->ths_trailcnt;
+	pdata->hstxvregcnt = csi->hstxvregcnt;
+	state->csi_hs_lp_hs_ns = csi->hs_lp_hs_ns;
+}
+
+static int tc358743_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct tc358743_state *state = container_of(ctrl->handler,
+					struct tc358743_state, hdl);
+	struct v4l2_subdev *sd = &state->sd;
+	int ret;
+
+	switch (ctrl->id) {
+	case V4L2_CID_LINK_FREQ:
+		if (ctrl->val == ctrl->cur.val)
+			return 0;
+
+		/* the PLL can't be reprogrammed under a running stream */
+		if (state->streaming)
+			return -EBUSY;
+
+		v4l2_info(sd, "link frequency %llu -> %llu Hz\n",
+			  state->link_frequencies[ctrl->cur.val],
+			  state->link_frequencies[ctrl->val]);
+		tc358743_apply_link_freq(state, ctrl->val);
+
+		ret = tc358743_pm_get(sd);
+		if (ret)
+			return ret;
+
+		tc358743_set_pll(sd);
+		ret = tc358743_set_csi(sd);
+
+		tc358743_pm_put(sd);
+		return ret;
+	}
+
+	return -EINVAL;
+}
+
+static const struct v4l2_ctrl_ops tc358743_ctrl_ops = {
+	.s_ctrl = tc358743_s_ctrl,
+};
+
 /* --------------- CUSTOM CTRLS --------------- */
 
 static const struct v4l2_ctrl_config tc358743_ctrl_audio_sampling_rate = {
@@ -2074,22 +3294,278 @@ static void tc358743_gpio_reset(struct tc358743_state *state)
 	msleep(20);
 }
 
+/* Smallest count of period_fs long cycles that lasts at least t_fs */
+static u32 tc358743_fs_to_cnt(s64 t_fs, u64 period_fs)
+{
+	if (t_fs <= 0)
+		return 0;
+
+	return div64_u64(t_fs + period_fs - 1, period_fs);
+}
+
+/*
+ * Search the legal PLL settings for the one closest to the link frequency:
+ *   pllinclk = refclk / prd,	6 MHz .. 40 MHz
+ *   bps per lane = pllinclk * fbd,	62.5 Mbps .. 1 Gbps
+ * For each prd only the two fbd around the target can be closest. On a tie
+ * the lower PLL input clock wins.
+ */
+static int tc358743_calc_pll(struct tc358743_state *state, u64 link_freq,
+			     struct tc358743_csi_param *csi)
+{
+	struct device *dev = &state->i2c_client->dev;
+	u32 refclk = state->pdata.refclk_hz;
+	u64 bps = 2 * link_freq; /* MIPI data lanes are double data rate */
+	u64 best_err = U64_MAX;
+	u64 fbd, fbd0, rate, err;
+	unsigned int prd;
+
+	for (prd = 1; prd <= TC358743_PLL_PRD_MAX; prd++) {
+		if (refclk < prd * TC358743_PLL_INCLK_MIN ||
+		    refclk > prd * TC358743_PLL_INCLK_MAX)
+			continue;
+
+		fbd0 = div_u64(bps, refclk / prd);
+		for (fbd = fbd0; fbd <= fbd0 + 1; fbd++) {
+			if (fbd < 1 || fbd > TC358743_PLL_FBD_MAX)
+				continue;
+
+			/* the rate the rest of the driver derives from prd/fbd */
+			rate = (u64)(refclk / prd) * fbd;
+			if (rate < TC358743_BPS_PR_LANE_MIN ||
+			    rate > TC358743_BPS_PR_LANE_MAX)
+				continue;
+
+			err = rate > bps ? rate - bps : bps - rate;
+			if (err > best_err)
+				continue;
+
+			best_err = err;
+			csi->pll_prd = prd;
+			csi->pll_fbd = fbd;
+			csi->bps_pr_lane = rate;
+		}
+	}
+
+	if (best_err == U64_MAX) {
+		dev_warn(dev, "no PLL setting for %llu bps per lane\n", bps);
+		return -EINVAL;
+	}
+
+	dev_dbg(dev, "%llu bps per lane: prd %u fbd %u gives %u bps\n",
+		bps, csi->pll_prd, csi->pll_fbd, csi->bps_pr_lane);
+
+	return 0;
+}
+
+/*
+ * Verify the resulting periods against the MIPI D-PHY windows, using the
+ * equations from tc358743_calc_csi_timings(). All times are in fs, a max of
+ * 0 is unlimited. Out of spec timings are never programmed.
+ */
+static int tc358743_check_dphy(struct tc358743_state *state,
+			       const struct tc358743_csi_param *csi,
+			       u32 tclk_preparecnt, u32 tclk_zerocnt,
+			       u32 ths_preparecnt, u32 ths_zerocnt)
+{
+	struct device *dev = &state->i2c_client->dev;
+	u32 spl = csi->bps_pr_lane;
+	s64 ui = div_u64(FSEC_PER_SEC + spl / 2, spl);
+	s64 hsclk_p = 8 * ui;
+	s64 lptx = (csi->lptxtimecnt + 1) * hsclk_p;
+	s64 tclk_prepare = (tclk_preparecnt + 1) * hsclk_p;
+	s64 ths_prepare = (ths_preparecnt + 1) * hsclk_p;
+	const struct {
+		const char *name;
+		s64 val;
+		s64 min;
+		s64 max;
+	} t[] = {
+		{ "lineinit", csi->lineinitcnt * 2 * hsclk_p,
+		  TC358743_DPHY_LINEINIT_MIN_US * TC358743_FS_PER_US, 0 },
+		{ "lpx", lptx, TC358743_DPHY_LPX_MIN_NS * TC358743_FS_PER_NS, 0 },
+		{ "tclk_prepare", tclk_prepare,
+		  TC358743_DPHY_TCLKPREPARE_MIN_NS * TC358743_FS_PER_NS,
+		  TC358743_DPHY_TCLKPREPARE_MAX_NS * TC358743_FS_PER_NS },
+		{ "tclk_prepare+zero",
+		  tclk_prepare + (2 + tclk_zerocnt) * hsclk_p + 3 * ui,
+		  TC358743_DPHY_TCLKPREPZERO_MIN_NS * TC358743_FS_PER_NS, 0 },
+		{ "tclk_trail", (5 + csi->tclk_trailcnt) * hsclk_p - 3 * ui,
+		  TC358743_DPHY_TCLKTRAIL_MIN_NS * TC358743_FS_PER_NS,
+		  TC358743_DPHY_TCLKTRAIL_MAX_NS * TC358743_FS_PER_NS + 12 * ui },
+		{ "tclk_post", (4 + csi->tclk_postcnt) * hsclk_p + 3 * ui,
+		  TC358743_DPHY_TCLKPOST_MIN_NS * TC358743_FS_PER_NS + 52 * ui,
+		  0 },
+		{ "ths_prepare", ths_prepare,
+		  TC358743_DPHY_THSPREPARE_MIN_NS * TC358743_FS_PER_NS + 4 * ui,
+		  TC358743_DPHY_THSPREPARE_MAX_NS * TC358743_FS_PER_NS + 6 * ui },
+		{ "ths_prepare+zero",
+		  ths_prepare + (11 + ths_zerocnt) * hsclk_p + 11 * ui,
+		  TC358743_DPHY_THSPREPZERO_MIN_NS * TC358743_FS_PER_NS + 10 * ui,
+		  0 },
+		{ "ths_trail", (5 + csi->ths_trailcnt) * hsclk_p - 11 * ui,
+		  TC358743_DPHY_THSTRAIL_MIN_NS * TC358743_FS_PER_NS + 4 * ui,
+		  TC358743_DPHY_THSTRAIL_MAX_NS * TC358743_FS_PER_NS + 12 * ui },
+		{ "twakeup", lptx * (csi->twakeup + 1),
+		  TC358743_DPHY_TWAKEUP_MIN_US * TC358743_FS_PER_US, 0 },
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(t); i++) {
+		if (t[i].val < t[i].min) {
+			dev_err(dev, "%u bps/lane: %s %lld ps below %lld ps\n",
+				spl, t[i].name, div_s64(t[i].val, 1000),
+				div_s64(t[i].min, 1000));
+			return -ERANGE;
+		}
+
+		if (t[i].max && t[i].val > t[i].max) {
+			dev_err(dev, "%u bps/lane: %s %lld ps above %lld ps\n",
+				spl, t[i].name, div_s64(t[i].val, 1000),
+				div_s64(t[i].max, 1000));
+			return -ERANGE;
+		}
+	}
+
+	return 0;
+}
+
+static int tc358743_calc_csi_timings(struct tc358743_state *state,
+				     struct tc358743_csi_param *csi)
+{
+	struct device *dev = &state->i2c_client->dev;
+	u32 spl = csi->bps_pr_lane;
+	u32 tclk_preparecnt, tclk_zerocnt, ths_preparecnt, ths_zerocnt;
+	u64 ui, hsclk_p, hfclk_p, lptx;
+	u32 tmp;
+	int err;
+
+	/* All times are in femtoseconds, derived from the rounded UI */
+	ui = div_u64(FSEC_PER_SEC + spl / 2, spl);
+	hsclk_p = 8 * ui;
+	hfclk_p = 2 * hsclk_p; /* HFCLK = SYSCLK / 2 */
+
+	/* hfclk_p * lineinitcnt > 100us */
+	csi->lineinitcnt =
+		tc358743_fs_to_cnt(TC358743_LINEINIT_MIN_US * TC358743_FS_PER_US,
+				   hfclk_p);
+
+	/* (lptxtimecnt + 1) * hsclk_p > 50ns */
+	csi->lptxtimecnt =
+		tc358743_fs_to_cnt(TC358743_LPTXTIME_MIN_NS * TC358743_FS_PER_NS,
+				   hsclk_p) - 1;
+	lptx = (csi->lptxtimecnt + 1) * hsclk_p;
+
+	/*
+	 * 38ns < (tclk_preparecnt + 1) * hsclk_p < 95ns, solved on its own. If
+	 * the margin pushes the period past the maximum, go for the minimum.
+	 */
+	tmp = tc358743_fs_to_cnt(TC358743_TCLKPREPARE_MIN_NS * TC358743_FS_PER_NS,
+				 hsclk_p);
+	if (tmp * hsclk_p >= TC358743_DPHY_TCLKPREPARE_MAX_NS * TC358743_FS_PER_NS)
+		tmp = tc358743_fs_to_cnt(TC358743_DPHY_TCLKPREPARE_MIN_NS *
+					 TC358743_FS_PER_NS, hsclk_p);
+	tclk_preparecnt = tmp - 1;
+
+	/* tclk_zero = (2 + tclk_zerocnt) * hsclk_p + 3 * ui > 300ns */
+	tmp = tc358743_fs_to_cnt(TC358743_TCLKZERO_MIN_NS * TC358743_FS_PER_NS -
+				 3 * ui, hsclk_p);
+	tclk_zerocnt = tmp < 2 ? 0 : tmp - 2;
+
+	/* (ths_preparecnt + 1) * hsclk_p > 40ns + 4 * ui */
+	tmp = tc358743_fs_to_cnt(TC358743_THSPREPARE_MIN_NS *
+				 TC358743_FS_PER_NS + 4 * ui, hsclk_p);
+	ths_preparecnt = tmp - 1;
+
+	/* ths_zero = (11 + ths_zerocnt) * hsclk_p + 11 * ui > 145ns + 10 * ui */
+	tmp = tc358743_fs_to_cnt(TC358743_THSZERO_MIN_NS * TC358743_FS_PER_NS -
+				 ui, hsclk_p);
+	ths_zerocnt = tmp < 11 ? 0 : tmp - 11;
+
+	if (tclk_preparecnt > MASK_TCLK_PREPARECNT ||
+	    tclk_zerocnt > (MASK_TCLK_ZEROCNT >> 8) ||
+	    ths_preparecnt > MASK_THS_PREPARECNT ||
+	    ths_zerocnt > (MASK_THS_ZEROCNT >> 8)) {
+		dev_err(dev, "%u bps/lane: header counters out of range\n", spl);
+		return -ERANGE;
+	}
+	csi->tclk_headercnt = SET_TCLK_ZEROCNT(tclk_zerocnt) |
+			      SET_TCLK_PREPARECNT(tclk_preparecnt);
+	csi->ths_headercnt = SET_THS_ZEROCNT(ths_zerocnt) |
+			     SET_THS_PREPARECNT(ths_preparecnt);
+
+	/* lptx * (twakeup + 1) > 1ms */
+	csi->twakeup =
+		tc358743_fs_to_cnt(TC358743_TWAKEUP_MIN_US * TC358743_FS_PER_US,
+				   lptx) - 1;
+
+	/* tclk_trail = (5 + tclk_trailcnt) * hsclk_p - 3 * ui > 60ns */
+	tmp = tc358743_fs_to_cnt(TC358743_TCLKTRAIL_MIN_NS * TC358743_FS_PER_NS +
+				 3 * ui, hsclk_p);
+	csi->tclk_trailcnt = tmp < 5 ? 0 : tmp - 5;
+
+	/* tclk_post = (4 + tclk_postcnt) * hsclk_p + 3 * ui > 60ns + 52 * ui */
+	tmp = tc358743_fs_to_cnt(TC358743_TCLKPOST_MIN_NS * TC358743_FS_PER_NS +
+				 49 * ui, hsclk_p);
+	csi->tclk_postcnt = tmp < 3 ? 0 : tmp - 3;
+
+	/* ths_trail = (5 + ths_trailcnt) * hsclk_p - 11 * ui > 60ns + 4 * ui */
+	tmp = tc358743_fs_to_cnt(TC358743_THSTRAIL_MIN_NS * TC358743_FS_PER_NS +
+				 15 * ui, hsclk_p);
+	csi->ths_trailcnt = tmp < 5 ? 0 : tmp - 5;
+
+	csi->hstxvregcnt = TC358743_HSTXVREGCNT;
+
+	err = tc358743_check_dphy(state, csi, tclk_preparecnt, tclk_zerocnt,
+				  ths_preparecnt, ths_zerocnt);
+	if (err)
+		return err;
+
+	/*
+	 * In non-continuous clock mode the clock lane goes to LP after every
+	 * line: THS-TRAIL, TCLK-POST and TCLK-TRAIL on the way down, LP11 for
+	 * at least THS-EXIT (4 * lptx), then TCLK-PREPARE/ZERO, the 8 UI
+	 * TCLK-PRE, THS-PREPARE and THS-ZERO on the way up. The TCLK counters
+	 * above already meet the D-PHY minima for this; what is left is to
+	 * check that the line blanking can hold the whole turnaround, so
+	 * record it here with 50% margin for the FSM overhead.
+	 */
+	tmp = div_u64(((5 + csi->ths_trailcnt) * hsclk_p - 11 * ui) +
+		      ((4 + csi->tclk_postcnt) * hsclk_p + 3 * ui) +
+		      ((5 + csi->tclk_trailcnt) * hsclk_p - 3 * ui) +
+		      4 * lptx +
+		      (tclk_preparecnt + 1) * hsclk_p +
+		      ((2 + tclk_zerocnt) * hsclk_p + 3 * ui) +
+		      8 * ui +
+		      (ths_preparecnt + 1) * hsclk_p +
+		      ((11 + ths_zerocnt) * hsclk_p + 11 * ui),
+		      TC358743_FS_PER_NS);
+	csi->hs_lp_hs_ns = tmp + tmp / 2;
+
+	dev_dbg(dev, "%u bps/lane: pll_prd %u, pll_fbd %u, lineinitcnt 0x%x, lptxtimecnt 0x%x, tclk_headercnt 0x%x, tclk_trailcnt 0x%x, ths_headercnt 0x%x, twakeup 0x%x, tclk_postcnt 0x%x, ths_trailcnt 0x%x, hs_lp_hs %u ns\n",
+		spl, csi->pll_prd, csi->pll_fbd, csi->lineinitcnt,
+		csi->lptxtimecnt, csi->tclk_headercnt, csi->tclk_trailcnt,
+		csi->ths_headercnt, csi->twakeup, csi->tclk_postcnt,
+		csi->ths_trailcnt, csi->hs_lp_hs_ns);
+
+	return 0;
+}
+
 static int tc358743_probe_of(struct tc358743_state *state)
 {
 	struct device *dev = &state->i2c_client->dev;
 	struct v4l2_of_endpoint *endpoint;
 	struct device_node *ep;
-	// struct clk *refclk;
-	u32 bps_pr_lane;
+	unsigned int i, n, def;
 	int ret = -EINVAL;
 
-	// refclk = devm_clk_get(dev, "cam_mclk1");
-	// if (IS_ERR(refclk)) {
-	// 	if (PTR_ERR(refclk) != -EPROBE_DEFER)
-	// 		dev_err(dev, "failed to get refclk: %ld\n",
-	// 			PTR_ERR(refclk));
-	// 	return PTR_ERR(refclk);
-	// }
+	/* optional, boards with a free running oscillator have none */
+	state->refclk = devm_clk_get(dev, "refclk");
+	if (IS_ERR(state->refclk)) {
+		if (PTR_ERR(state->refclk) == -EPROBE_DEFER)
+			return -EPROBE_DEFER;
+		state->refclk = NULL;
+	}
 
 	ep = of_graph_get_next_endpoint(dev->of_node, NULL);
 	if (!ep) {
@@ -2126,10 +3602,15 @@ static int tc358743_probe_of(struct tc358743_state *state)
 
 	// state->bus = endpoint->bus.mipi_csi2;
     // pr_info("tc358743 state->bus %s\n",state->bus);
-	// clk_prepare_enable(refclk);
-
-	// state->pdata.refclk_hz = clk_get_rate(refclk);
-	state->pdata.refclk_hz = 27000000;
+	if (state->refclk) {
+		ret = clk_prepare_enable(state->refclk);
+		if (ret)
+			goto free_endpoint;
+		state->pdata.refclk_hz = clk_get_rate(state->refclk);
+		ret = -EINVAL;
+	} else {
+		state->pdata.refclk_hz = 27000000;
+	}
     // if ((state->pdata.refclk_hz != 26000000) ||
     //     (state->pdata.refclk_hz != 27000000) ||
     //     (state->pdata.refclk_hz != 42000000))
@@ -2157,7 +3638,6 @@ static int tc358743_probe_of(struct tc358743_state *state)
 	case 27000000:
 	//~ case 40800000: /* Tegra */
 	case 42000000:
-		state->pdata.pll_prd = state->pdata.refclk_hz / 6000000;
 		break;
 	default:
 		dev_err(dev, "Unsupported refclk rate: %u Hz\n",
@@ -2166,71 +3646,66 @@ static int tc358743_probe_of(struct tc358743_state *state)
 	}
 
 	/*
-	 * The CSI bps per lane must be between 62.5 Mbps and 1 Gbps.
-	 * The default is 594 Mbps for 4-lane 1080p60 or 2-lane 720p60.
+	 * PLL and D-PHY timings for every link frequency, selectable through
+	 * V4L2_CID_LINK_FREQ. E.g. 297 MHz (594 Mbps per lane) carries
+	 * 4-lane 1080p60 or 2-lane 720p60.
 	 */
-	bps_pr_lane = 2 * endpoint->link_frequencies[0];
-	if (bps_pr_lane < 62500000U || bps_pr_lane > 1000000000U) {
-		dev_err(dev, "unsupported bps per lane: %u bps\n", bps_pr_lane);
+	n = endpoint->nr_of_link_frequencies;
+	state->link_frequencies = devm_kcalloc(dev, n,
+				sizeof(*state->link_frequencies), GFP_KERNEL);
+	state->link_freq_settings = devm_kcalloc(dev, n,
+				sizeof(*state->link_freq_settings), GFP_KERNEL);
+	if (!state->link_frequencies || !state->link_freq_settings) {
+		ret = -ENOMEM;
 		goto disable_clk;
 	}
 
-	/* The CSI speed per lane is refclk / pll_prd * pll_fbd */
-	state->pdata.pll_fbd = bps_pr_lane /
-			       state->pdata.refclk_hz * state->pdata.pll_prd;
-
 	/*
-	 * FIXME: These timings are from REF_02 for 594 Mbps per lane (297 MHz
-	 * link frequency). In principle it should be possible to calculate
-	 * them based on link frequency and resolution.
+	 * An entry without a PLL setting or in spec D-PHY timings is dropped
+	 * from the LINK_FREQ menu, only if none is left the probe fails.
 	 */
-	if (bps_pr_lane != 594000000U)
-		dev_warn(dev, "untested bps per lane: %u bps\n", bps_pr_lane);
-	pr_info("tc358743 state->pdata.pll_prd=%d\r\n",state->pdata.pll_prd);
-	pr_info("tc358743 state->pdata.pll_fbd=%d\r\n",state->pdata.pll_fbd);
-
-	// freq = refclk / prd * fbd, default = 594 MHz
-	state->pdata.lineinitcnt = 0xe80;
-	state->pdata.lptxtimecnt = 0x003;
-	/* tclk-preparecnt: 3, tclk-zerocnt: 20 */
-	state->pdata.tclk_headercnt = 0x1403;
-	state->pdata.tclk_trailcnt = 0x00;
-	/* ths-preparecnt: 3, ths-zerocnt: 1 */
-	state->pdata.ths_headercnt = 0x0103;
-	state->pdata.twakeup = 0x4882;
-	state->pdata.tclk_postcnt = 0x008;
-	state->pdata.ths_trailcnt = 0x2;
-	state->pdata.hstxvregcnt = 2;
-/*richard you*/	
-	state->pdata.pll_prd        = 4;
-#ifdef TC358743_VOUT_RGB
-	state->pdata.pll_fbd        = 132;
-	
-	// timing setting
-	state->pdata.lineinitcnt    =0x00000fa0;
-	state->pdata.lptxtimecnt    =0x00000005;
-	state->pdata.tclk_headercnt =0x00001603;
-	state->pdata.tclk_trailcnt  =0x00000001;
-	state->pdata.ths_headercnt  =0x00000603;
-	state->pdata.twakeup        =0x000032c8;
-	state->pdata.tclk_postcnt   =0x00000008;
-	state->pdata.ths_trailcnt   =0x00000002;
-	state->pdata.hstxvregcnt    =0x00000005;
-#else
-	state->pdata.pll_fbd        = 88;
-
-	// timing setting
-	state->pdata.lineinitcnt    =0x00001770;
-	state->pdata.lptxtimecnt    =0x00000005;
-	state->pdata.tclk_headercnt =0x00002004;
-	state->pdata.tclk_trailcnt  =0x00000001;
-	state->pdata.ths_headercnt  =0x00000606;
-	state->pdata.twakeup        =0x00004a38;
-	state->pdata.tclk_postcnt   =0x00000008;
-	state->pdata.ths_trailcnt   =0x00000005;
-	state->pdata.hstxvregcnt    =0x00000005;
-#endif
-	
+	def = n;
+	for (i = 0; i < n; i++) {
+		struct tc358743_csi_param *csi = &state->link_freq_settings[i];
+
+		state->link_frequencies[i] = endpoint->link_frequencies[i];
+		if (tc358743_calc_pll(state, endpoint->link_frequencies[i],
+				      csi) ||
+		    tc358743_calc_csi_timings(state, csi)) {
+			dev_warn(dev, "link frequency %llu Hz: skipped\n",
+				 endpoint->link_frequencies[i]);
+			continue;
+		}
+		csi->usable = true;
+		if (def == n)
+			def = i;
+
+		/* the LINK_FREQ menu shows what the PLL really generates */
+		state->link_frequencies[i] = csi->bps_pr_lane / 2;
+		if (state->link_frequencies[i] != endpoint->link_frequencies[i])
+			dev_warn(dev, "link frequency %llu Hz: using %llu Hz\n",
+				 endpoint->link_frequencies[i],
+				 state->link_frequencies[i]);
+	}
+	if (def == n) {
+		dev_err(dev, "no usable link frequency\n");
+		ret = -EINVAL;
+		goto disable_clk;
+	}
+	state->link_frequencies_num = n;
+	state->link_freq_def = def;
+	tc358743_apply_link_freq(state, def);
+
+	if (endpoint->bus.mipi_csi2.num_data_lanes > 4) {
+		dev_err(dev, "invalid number of lanes\n");
+		ret = -EINVAL;
+		goto disable_clk;
+	}
+	state->csi_lanes_max = endpoint->bus.mipi_csi2.num_data_lanes;
+	/* v4l2_of sets CONTINUOUS_CLOCK unless "clock-noncontinuous" is set */
+	state->pdata.endpoint.bus.mipi_csi2.flags =
+		endpoint->bus.mipi_csi2.flags;
+
 	//~ state->reset_gpio = devm_gpiod_get_optional(dev, "reset",
 						    //~ GPIOD_OUT_LOW);
 	//~ if (IS_ERR(state->reset_gpio)) {
@@ -2247,7 +3722,7 @@ static int tc358743_probe_of(struct tc358743_state *state)
 	goto free_endpoint;
 
 disable_clk:
-	// clk_disable_unprepare(refclk);
+	clk_disable_unprepare(state->refclk);
 free_endpoint:
 	v4l2_of_free_endpoint(endpoint);
 	return ret;
@@ -2273,12 +3748,55 @@ static const struct media_entity_operations tc358743_media_ops = {
 };
 
 
-static const struct regmap_config sensor_regmap_config = {
-	.reg_bits = 16,
-	.val_bits = 8,
-	.cache_type = REGCACHE_RBTREE,
+/* Debug files are optional, failures are ignored */
+static int tc358743_status_show(struct seq_file *m, void *unused)
+{
+	struct tc358743_state *state = m->private;
+	int err;
+
+	err = tc358743_pm_get(&state->sd);
+	if (err)
+		return err;
+
+	tc358743_show_status(m, &state->sd);
+	tc358743_pm_put(&state->sd);
+
+	return 0;
+}
+
+static int tc358743_status_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tc358743_status_show, inode->i_private);
+}
+
+static const struct file_operations tc358743_status_fops = {
+	.owner = THIS_MODULE,
+	.open = tc358743_status_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
 };
 
+static void tc358743_debugfs_init(struct tc358743_state *state)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "tc358743-%s",
+		 dev_name(&state->i2c_client->dev));
+	state->debugfs = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(state->debugfs)) {
+		state->debugfs = NULL;
+		return;
+	}
+
+	debugfs_create_file("trace", 0444, state->debugfs, state,
+			    &tc358743_trace_fops);
+	debugfs_create_file("latency", 0644, state->debugfs, state,
+			    &tc358743_latency_fops);
+	debugfs_create_file("status", 0444, state->debugfs, state,
+			    &tc358743_status_fops);
+}
+
 static int tc358743_probe(struct i2c_client *client,
 			  const struct i2c_device_id *id)
 {
@@ -2295,6 +3813,7 @@ static int tc358743_probe(struct i2c_client *client,
 	struct tc358743_state *state;
 	struct tc358743_platform_data *pdata = client->dev.platform_data;
 	struct v4l2_subdev *sd;
+	unsigned int i;
 	int err;
 	u16 chip_id_val;
 
@@ -2317,11 +3836,23 @@ static int tc358743_probe(struct i2c_client *client,
     }
 
 	state->i2c_client = client;
+	spin_lock_init(&state->lat.lock);
+
+	state->regmap = devm_regmap_init(&client->dev, NULL, state,
+					 &sensor_regmap_config);
+	if (IS_ERR(state->regmap))
+		return PTR_ERR(state->regmap);
 
 	/* platform data */
 	if (pdata) {
 		state->pdata = *pdata;
-		pdata->endpoint.bus.mipi_csi2.flags = V4L2_MBUS_CSI2_CONTINUOUS_CLOCK;
+		/* Keep continuous clock unless asked for non-continuous */
+		if (!(pdata->endpoint.bus.mipi_csi2.flags &
+		      V4L2_MBUS_CSI2_NONCONTINUOUS_CLOCK))
+			state->pdata.endpoint.bus.mipi_csi2.flags |=
+				V4L2_MBUS_CSI2_CONTINUOUS_CLOCK;
+		state->csi_lanes_max =
+			pdata->endpoint.bus.mipi_csi2.num_data_lanes ?: 4;
 	} else {
 		err = tc358743_probe_of(state);
 		if (err == -ENODEV)
@@ -2329,6 +3860,8 @@ static int tc358743_probe(struct i2c_client *client,
 		if (err)
 			return err;
 	}
+	state->csi_continuous_clk = !!(state->pdata.endpoint.bus.mipi_csi2.flags &
+				       V4L2_MBUS_CSI2_CONTINUOUS_CLOCK);
 
 	sd = &state->sd;
 	v4l2_i2c_subdev_init(sd, client, &tc358743_ops);
@@ -2342,11 +3875,12 @@ static int tc358743_probe(struct i2c_client *client,
 	if ((chip_id_val & MASK_CHIPID) != 0 || chip_id_val == 99) {
         v4l2_info(sd,"tc358743: ERROR: not a TC358743 on address0x%x\n",
 			  client->addr);
-		return -ENODEV;
+		err = -ENODEV;
+		goto err_clk;
 	}
 	
 	/* control handlers */
-	v4l2_ctrl_handler_init(&state->hdl, 3);
+	v4l2_ctrl_handler_init(&state->hdl, 4);
 	v4l2_info(sd, "ctrl handler initied\n");
 
 	/* private controls */
@@ -2360,6 +3894,24 @@ static int tc358743_probe(struct i2c_client *client,
 	state->audio_present_ctrl = v4l2_ctrl_new_custom(&state->hdl,
 			&tc358743_ctrl_audio_present, NULL);
 
+	/* platform data carries a single fixed CSI setting */
+	if (state->link_frequencies_num) {
+		u64 skip = 0;
+
+		/* entries without valid timings can't be selected */
+		for (i = 0; i < state->link_frequencies_num && i < 64; i++)
+			if (!state->link_freq_settings[i].usable)
+				skip |= BIT_ULL(i);
+
+		state->link_freq = v4l2_ctrl_new_int_menu(&state->hdl,
+				&tc358743_ctrl_ops, V4L2_CID_LINK_FREQ,
+				state->link_frequencies_num - 1,
+				state->link_freq_def,
+				state->link_frequencies);
+		if (state->link_freq)
+			state->link_freq->menu_skip_mask = skip;
+	}
+
 	v4l2_info(sd, "A bunch of new cutoms done\n");
 
 	sd->ctrl_handler = &state->hdl;
@@ -2400,18 +3952,28 @@ static int tc358743_probe(struct i2c_client *client,
 
 	v4l2_info(sd, "Set mbus_fmt_code in probe to: %d\n", state->mbus_fmt_code);
 
+	/* callable as soon as the subdev and debugfs are registered */
+	mutex_init(&state->confctl_mutex);
+	mutex_init(&state->status_lock);
+	INIT_DELAYED_WORK(&state->delayed_work_enable_hotplug,
+			tc358743_delayed_work_enable_hotplug);
+
+	tc358743_debugfs_init(state);
+
+	/* awake and clocked, suspends once the autosuspend delay expired */
+	pm_runtime_set_active(&client->dev);
+	pm_runtime_enable(&client->dev);
+	pm_runtime_set_autosuspend_delay(&client->dev, autosuspend_delay_ms);
+	pm_runtime_use_autosuspend(&client->dev);
+
 	sd->dev = &client->dev;
 	v4l2_info(sd, "About to register subdev\n");
 	err = v4l2_async_register_subdev(sd);
 	v4l_dbg(1, debug, client, "Register subdev: %d\n", err);
 
 	if (err < 0)
-		goto err_hdl;
-
-	mutex_init(&state->confctl_mutex);
+		goto err_pm;
 
-	INIT_DELAYED_WORK(&state->delayed_work_enable_hotplug,
-			tc358743_delayed_work_enable_hotplug);
 	v4l2_info(sd,"before tc358743_initial_setup\r\n");
 	//tc358743_log_status(sd);
 	tc358743_initial_setup(sd);
@@ -2449,22 +4011,193 @@ static int tc358743_probe(struct i2c_client *client,
 	v4l2_info(sd, "%s found @0x%x (%s)\n", client->name,
 		  client->addr, client->adapter->name);
 	tc358743_s_edid(sd, &sd_edid);
-	tc358743_g_edid(sd, &sd_edid);
 
+	tc358743_refresh_status(sd);
 	tc358743_log_status(sd);
+
+	pm_runtime_mark_last_busy(&client->dev);
+	pm_runtime_idle(&client->dev);
+
 	v4l2_info(sd,"Probe complete\n");
 	return 0;
 
 err_work_queues:
 	cancel_delayed_work(&state->delayed_work_enable_hotplug);
 	destroy_workqueue(state->work_queues);
+err_pm:
+	pm_runtime_dont_use_autosuspend(&client->dev);
+	pm_runtime_disable(&client->dev);
+	pm_runtime_set_suspended(&client->dev);
+	debugfs_remove_recursive(state->debugfs);
 	mutex_destroy(&state->confctl_mutex);
+	mutex_destroy(&state->status_lock);
 err_hdl:
 	media_entity_cleanup(&sd->entity);
 	v4l2_ctrl_handler_free(&state->hdl);
+err_clk:
+	clk_disable_unprepare(state->refclk);
+	return err;
+}
+
+/* --------------- runtime PM --------------- */
+
+/*
+ * Sleep mode and the gated refclk keep the register contents. Writes while
+ * suspended only go to the cache and are written back on resume.
+ */
+static int __maybe_unused tc358743_runtime_suspend(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+	struct tc358743_state *state = to_state(sd);
+
+	tc358743_sleep_mode(sd, true);
+	regcache_cache_only(state->regmap, true);
+	clk_disable_unprepare(state->refclk);
+
+	return 0;
+}
+
+static int __maybe_unused tc358743_runtime_resume(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+	struct tc358743_state *state = to_state(sd);
+	int err;
+
+	err = clk_prepare_enable(state->refclk);
+	if (err)
+		return err;
+
+	/* SYSCTL is cached with the sleep bit set, the chip stays asleep */
+	err = tc358743_regcache_sync(sd);
+	if (err) {
+		regcache_cache_only(state->regmap, true);
+		clk_disable_unprepare(state->refclk);
+		return err;
+	}
+
+	/* let the PLL lock on the restored setting before waking up */
+	usleep_range(10, 20);
+	tc358743_sleep_mode(sd, false);
+
+	return 0;
+}
+
+/* --------------- system sleep --------------- */
+
+/*
+ * The supply may be cut during system sleep. Replay the whole register
+ * cache: the PLL gets its lock time before CKEN, everything else goes out
+ * in bursts and the EDID RAM is refilled before hotplug is enabled again.
+ */
+static int tc358743_replay(struct v4l2_subdev *sd)
+{
+	struct tc358743_state *state = to_state(sd);
+	struct tc358743_reg_batch batch;
+	unsigned int sysctl, pllctl0, pllctl1;
+	int err;
+
+	regcache_cache_only(state->regmap, false);
+	regcache_mark_dirty(state->regmap);
+
+	/* not volatile, these come from the cache */
+	regmap_read(state->regmap, SYSCTL, &sysctl);
+	regmap_read(state->regmap, PLLCTL0, &pllctl0);
+	regmap_read(state->regmap, PLLCTL1, &pllctl1);
+
+	i2c_batch_init(&batch);
+	i2c_batch_add(sd, &batch, SYSCTL, sysctl | MASK_SLEEP);
+	i2c_batch_add(sd, &batch, PLLCTL0, pllctl0);
+	i2c_batch_add(sd, &batch, PLLCTL1, pllctl1 & ~MASK_CKEN);
+	err = i2c_batch_flush(sd, &batch);
+	if (err)
+		return err;
+	usleep_range(10, 20); /* REF_02, Sheet "Source HDMI" */
+	i2c_wr16(sd, PLLCTL1, pllctl1);
+
+	/* SYSCTL is cached with the sleep bit set, the chip stays asleep */
+	err = tc358743_regcache_sync(sd);
+	if (err)
+		return err;
+
+	if (state->edid_blocks_written &&
+	    tc358743_write_edid(sd, state->edid,
+				state->edid_blocks_written * EDID_BLOCK_SIZE)) {
+		v4l2_err(sd, "%s: EDID replay failed, hotplug stays low\n",
+			 __func__);
+		state->edid_blocks_written = 0;
+		state->edid_crc_valid = false;
+	}
+
+	tc358743_init_interrupts(sd);
+	tc358743_sleep_mode(sd, false);
+	tc358743_enable_edid(sd);
+
+	return 0;
+}
+
+static int __maybe_unused tc358743_suspend(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+	struct tc358743_state *state = to_state(sd);
+
+	if (state->i2c_client->irq)
+		disable_irq(state->i2c_client->irq);
+
+	/* the source sees an unplug until the EDID is back */
+	if (state->streaming)
+		enable_stream(sd, false);
+	tc358743_disable_edid(sd);
+
+	pm_runtime_disable(dev);
+	if (!pm_runtime_status_suspended(dev)) {
+		tc358743_runtime_suspend(dev);
+		pm_runtime_set_suspended(dev);
+	}
+
+	return 0;
+}
+
+static int __maybe_unused tc358743_resume(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+	struct tc358743_state *state = to_state(sd);
+	int err;
+
+	tc358743_lat_start(state, &state->resume_mark);
+	state->resume_pending = true;
+
+	err = clk_prepare_enable(state->refclk);
+	if (err)
+		goto out;
+
+	err = tc358743_replay(sd);
+	if (err) {
+		regcache_cache_only(state->regmap, true);
+		clk_disable_unprepare(state->refclk);
+		goto out;
+	}
+
+	/* awake for the hotplug, autosuspends again unless powered */
+	pm_runtime_set_active(dev);
+	pm_runtime_mark_last_busy(dev);
+
+	if (state->streaming)
+		enable_stream(sd, true);
+
+out:
+	pm_runtime_enable(dev);
+	if (state->i2c_client->irq)
+		enable_irq(state->i2c_client->irq);
+
 	return err;
 }
 
+static const struct dev_pm_ops tc358743_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(tc358743_suspend, tc358743_resume)
+	SET_RUNTIME_PM_OPS(tc358743_runtime_suspend, tc358743_runtime_resume,
+			   NULL)
+};
+
 static int tc358743_remove(struct i2c_client *client)
 {
 	struct v4l2_subdev *sd = i2c_get_clientdata(client);
@@ -2474,7 +4207,16 @@ static int tc358743_remove(struct i2c_client *client)
 	destroy_workqueue(state->work_queues);
 	v4l2_async_unregister_subdev(sd);
 	v4l2_device_unregister_subdev(sd);
+
+	pm_runtime_dont_use_autosuspend(&client->dev);
+	pm_runtime_disable(&client->dev);
+	if (!pm_runtime_status_suspended(&client->dev))
+		tc358743_runtime_suspend(&client->dev);
+	pm_runtime_set_suspended(&client->dev);
+
+	debugfs_remove_recursive(state->debugfs);
 	mutex_destroy(&state->confctl_mutex);
+	mutex_destroy(&state->status_lock);
 	media_entity_cleanup(&sd->entity);
 	v4l2_ctrl_handler_free(&state->hdl);
 
@@ -2491,6 +4233,7 @@ MODULE_DEVICE_TABLE(i2c, tc358743_id);
 static struct i2c_driver tc358743_driver = {
 	.driver = {
 		.name = "tc358743",
+		.pm = &tc358743_pm_ops,
 	},
 	.probe = tc358743_probe,
 	.remove = tc358743_remove,
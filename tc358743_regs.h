@@ -129,8 +129,18 @@
 #define LINEINITCNT                           0x0210
 #define LPTXTIMECNT                           0x0214
 #define TCLK_HEADERCNT                        0x0218
+#define MASK_TCLK_ZEROCNT                     0xff00
+#define SET_TCLK_ZEROCNT(cnt)                 (((cnt) << 8) &\
+						MASK_TCLK_ZEROCNT)
+#define MASK_TCLK_PREPARECNT                  0x007f
+#define SET_TCLK_PREPARECNT(cnt)              ((cnt) & MASK_TCLK_PREPARECNT)
 #define TCLK_TRAILCNT                         0x021C
 #define THS_HEADERCNT                         0x0220
+#define MASK_THS_ZEROCNT                      0x7f00
+#define SET_THS_ZEROCNT(cnt)                  (((cnt) << 8) &\
+						MASK_THS_ZEROCNT)
+#define MASK_THS_PREPARECNT                   0x007f
+#define SET_THS_PREPARECNT(cnt)               ((cnt) & MASK_THS_PREPARECNT)
 #define TWAKEUP                               0x0224
 #define TCLK_POSTCNT                          0x0228
 #define THS_TRAILCNT                          0x022C
@@ -98,7 +98,7 @@ struct tc358746_csi_param {
 	unsigned int  unit_clk_hz;
 	unsigned char unit_clk_mul;
 	unsigned int speed_per_lane; /* bps / lane */
-	unsigned short lane_num;
+	unsigned short lane_num; /* lanes wired up in the DT */
 	bool is_continuous_clk;
 
 	/* CSI2-TX Parameters */
@@ -130,6 +130,8 @@ struct tc358746_state {
 	struct v4l2_ctrl_handler hdl;
 	bool fmt_changed;
 	bool test;
+	bool powered;		/* between s_power(1) and s_power(0) */
+	bool streaming;
 
 	/*
 	 * Chip Clocks
@@ -152,6 +154,7 @@ struct tc358746_state {
 	struct tc358746_csi_param *link_freq_settings;
 	u64			  *link_frequencies;
 	unsigned int		   link_frequencies_num;
+	unsigned int		   csi_lanes; /* lanes used by the active format */
 
 	/*
 	 * Parallel input
@@ -290,7 +293,7 @@ static int
 tc358746_adjust_fifo_size(struct tc358746_state *state,
 			  const struct tc358746_mbus_fmt *format,
 			  struct tc358746_csi_param *csi_settings,
-			  int width, u16 *fifo_size)
+			  unsigned int lanes, int width, u16 *fifo_size)
 {
 	struct device *dev = &state->i2c_client->dev;
 	int c_hactive_ps_diff, c_lp_active_ps_diff, c_fifo_delay_ps_diff;
@@ -302,7 +305,7 @@ tc358746_adjust_fifo_size(struct tc358746_state *state,
 	unsigned int _fifo_size;
 
 	pclk_period_ps = 1000000000 / (state->pclk / 1000);
-	csi_bps = csi_settings->speed_per_lane * csi_settings->lane_num;
+	csi_bps = csi_settings->speed_per_lane * lanes;
 	csi_bps_period_ps = 1000000000 / (csi_bps / 1000);
 	csi_hsclk = csi_settings->speed_per_lane >> 3;
 	csi_hsclk_period_ps = 1000000000 / (csi_hsclk / 1000);
@@ -370,16 +373,36 @@ tc358746_adjust_fifo_size(struct tc358746_state *state,
 	return _fifo_size == TC358746_MAX_FIFO_SIZE ? -EINVAL : 0;
 }
 
+/*
+ * Use as few lanes as possible, the unused ones stay powered down. Returns the
+ * lane count or -EINVAL if even all lanes can't carry the line.
+ */
+static int
+tc358746_adjust_lanes(struct tc358746_state *state,
+		      const struct tc358746_mbus_fmt *format,
+		      struct tc358746_csi_param *csi_settings,
+		      int width, u16 *fifo_size)
+{
+	unsigned int lanes;
+
+	for (lanes = 1; lanes <= csi_settings->lane_num; lanes++)
+		if (!tc358746_adjust_fifo_size(state, format, csi_settings,
+					       lanes, width, fifo_size))
+			return lanes;
+
+	return -EINVAL;
+}
+
 static int
 tc358746_adjust_timings(struct tc358746_state *state,
 			const struct tc358746_mbus_fmt *format,
-			int *width, u16 *fifo_size)
+			int *width, unsigned int *lanes, u16 *fifo_size)
 {
 
 	int cur_freq = v4l2_ctrl_g_ctrl(state->link_freq);
 	int freq = cur_freq;
 	struct tc358746_csi_param *csi_lane_setting;
-	int err;
+	int err = -EINVAL;
 	int _width;
 
 	/*
@@ -392,9 +415,9 @@ tc358746_adjust_timings(struct tc358746_state *state,
 	 */
 	for (_width = *width; _width > 0; _width -= 10) {
 		csi_lane_setting = &state->link_freq_settings[cur_freq];
-		err = tc358746_adjust_fifo_size(state, format, csi_lane_setting,
-						_width, fifo_size);
-		if (!err)
+		err = tc358746_adjust_lanes(state, format, csi_lane_setting,
+					    _width, fifo_size);
+		if (err > 0)
 			goto out;
 
 		for (freq = 0; freq < state->link_frequencies_num; freq++) {
@@ -402,16 +425,17 @@ tc358746_adjust_timings(struct tc358746_state *state,
 				continue;
 
 			csi_lane_setting = &state->link_freq_settings[freq];
-			err = tc358746_adjust_fifo_size(state, format,
-							csi_lane_setting,
-							_width, fifo_size);
-			if (!err)
+			err = tc358746_adjust_lanes(state, format,
+						    csi_lane_setting,
+						    _width, fifo_size);
+			if (err > 0)
 				goto out;
 		}
 	}
 
 out:
 	*width = _width;
+	*lanes = err > 0 ? err : state->link_freq_settings[cur_freq].lane_num;
 	return freq;
 }
 
@@ -907,14 +931,18 @@ static void tc358746_set_csi_color_space(struct v4l2_subdev *sd)
 	struct tc358746_state *state = to_state(sd);
 	const struct tc358746_mbus_fmt *tc358746_fmt =
 		tc358746_get_format(state->fmt.code);
+	/* CONFCTL_DATALANE_<n> is n - 1 */
+	u16 confctl = CONFCTL_PDATAF_SET(tc358746_fmt->pdataf) |
+		      ((state->csi_lanes - 1) & CONFCTL_DATALANE_MASK);
 
 	/* currently no self defined csi user data type id's are supported */
 	mutex_lock(&state->confctl_mutex);
 	i2c_wr16_and_or(sd, DATAFMT,
 			~(DATAFMT_PDFMT_MASK | DATAFMT_UDT_EN_MASK),
 			DATAFMT_PDFMT_SET(tc358746_fmt->pdformat));
-	i2c_wr16_and_or(sd, CONFCTL, ~CONFCTL_PDATAF_MASK,
-			CONFCTL_PDATAF_SET(tc358746_fmt->pdataf));
+	i2c_wr16_and_or(sd, CONFCTL,
+			~(CONFCTL_PDATAF_MASK | CONFCTL_DATALANE_MASK),
+			confctl);
 	mutex_unlock(&state->confctl_mutex);
 }
 
@@ -951,10 +979,7 @@ static void tc38764_debug_pattern_80(struct v4l2_subdev *sd)
 
 static void tc358746_enable_csi_lanes(struct v4l2_subdev *sd, int enable)
 {
-	struct tc358746_state *state = to_state(sd);
-	struct tc358746_csi_param *csi_setting =
-		tc358746_g_cur_csi_settings(state);
-	unsigned int lanes = csi_setting->lane_num;
+	unsigned int lanes = to_state(sd)->csi_lanes;
 	u32 val = 0;
 
 	if (lanes < 1 || !enable)
@@ -1012,10 +1037,7 @@ static void tc358746_set_csi(struct v4l2_subdev *sd)
 
 static void tc358746_enable_csi_module(struct v4l2_subdev *sd, int enable)
 {
-	struct tc358746_state *state = to_state(sd);
-	struct tc358746_csi_param *csi_setting =
-		tc358746_g_cur_csi_settings(state);
-	unsigned int lanes = csi_setting->lane_num;
+	unsigned int lanes = to_state(sd)->csi_lanes;
 	u32 val;
 
 	if (!enable)
@@ -1148,7 +1170,7 @@ static int tc358746_g_mbus_config(struct v4l2_subdev *sd,
 			V4L2_MBUS_CSI2_CONTINUOUS_CLOCK :
 			V4L2_MBUS_CSI2_NONCONTINUOUS_CLOCK;
 
-	switch (csi_setting->lane_num) {
+	switch (state->csi_lanes) {
 	case 1:
 		cfg->flags |= V4L2_MBUS_CSI2_1_LANE;
 		break;
@@ -1196,12 +1218,14 @@ static int tc358746_s_power(struct v4l2_subdev *sd, int on)
 	tc358746_enable_csi_lanes(sd, on);
 	tc358746_enable_csi_module(sd, on);
 	tc358746_sleep_mode(sd, !on);
+	state->powered = on;
 
 	return 0;
 }
 
 static int tc358746_s_stream(struct v4l2_subdev *sd, int enable)
 {
+	to_state(sd)->streaming = enable;
 	tc358746_enable_stream(sd, enable);
 
 	return 0;
@@ -1270,6 +1294,7 @@ static int tc358746_set_fmt(struct v4l2_subdev *sd,
 	struct v4l2_ctrl *ctrl;
 	unsigned int pclk, hblank;
 	int new_freq, cur_freq = v4l2_ctrl_g_ctrl(state->link_freq);
+	unsigned int lanes;
 	u16 vb_fifo;
 
 	if (pad->flags == MEDIA_PAD_FL_SOURCE)
@@ -1312,7 +1337,8 @@ static int tc358746_set_fmt(struct v4l2_subdev *sd,
 	 * other csi link frequency if it is possible.
 	 */
 	new_freq = tc358746_adjust_timings(state, tc358746_mbusformat,
-					   &format->format.width, &vb_fifo);
+					   &format->format.width, &lanes,
+					   &vb_fifo);
 
 	/* Currently only a few YUV based formats are supported */
 	if (tc358746_format_supported(format->format.code))
@@ -1326,6 +1352,7 @@ static int tc358746_set_fmt(struct v4l2_subdev *sd,
 	if (format->which == V4L2_SUBDEV_FORMAT_ACTIVE) {
 		state->fmt_changed = true;
 		state->vb_fifo = vb_fifo;
+		state->csi_lanes = lanes;
 		if (new_freq != cur_freq)
 			v4l2_ctrl_s_ctrl(state->link_freq, new_freq);
 	}
@@ -1345,6 +1372,7 @@ tc358746_link_validate(struct v4l2_subdev *sd, struct media_link *link,
 	struct v4l2_ctrl *ctrl;
 	unsigned int pclk, pclk_old = state->pclk;
 	unsigned int hblank, hblank_old = state->hblank;
+	unsigned int lanes;
 	int new_freq;
 	u16 vb_fifo;
 
@@ -1375,7 +1403,8 @@ tc358746_link_validate(struct v4l2_subdev *sd, struct media_link *link,
 	}
 
 	new_freq = tc358746_adjust_timings(state, tc358746_mbusformat,
-					   &source_fmt->format.width, &vb_fifo);
+					   &source_fmt->format.width, &lanes,
+					   &vb_fifo);
 
 	if (new_freq != v4l2_ctrl_g_ctrl(state->link_freq)) {
 		/*
@@ -1393,6 +1422,7 @@ tc358746_link_validate(struct v4l2_subdev *sd, struct media_link *link,
 
 	state->fmt_changed = true;
 	state->vb_fifo = vb_fifo;
+	state->csi_lanes = lanes;
 
 	return 0;
 }
@@ -1549,6 +1579,8 @@ static int tc358746_set_lane_settings(struct tc358746_state *state,
 	}
 
 	state->link_frequencies_num = fw->nr_of_link_frequencies;
+	/* all lanes until a format picks fewer */
+	state->csi_lanes = fw->bus.mipi_csi2.num_data_lanes;
 
 	return 0;
 }
@@ -1853,6 +1885,48 @@ static int tc358746_remove(struct i2c_client *client)
 	return 0;
 }
 
+/* --------------- system sleep --------------- */
+
+/*
+ * No register cache here: the configuration is rebuilt from the driver
+ * state by s_power(), which rewrites everything once fmt_changed is set.
+ */
+static int __maybe_unused tc358746_suspend(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+	struct tc358746_state *state = to_state(sd);
+
+	if (state->streaming)
+		tc358746_enable_stream(sd, 0);
+	tc358746_sleep_mode(sd, 1);
+	clk_disable_unprepare(state->refclk);
+	state->fmt_changed = true;
+
+	return 0;
+}
+
+static int __maybe_unused tc358746_resume(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+	struct tc358746_state *state = to_state(sd);
+	int err;
+
+	err = clk_prepare_enable(state->refclk);
+	if (err)
+		return err;
+
+	if (!state->powered)
+		return 0;
+
+	err = tc358746_s_power(sd, 1);
+	if (!err && state->streaming)
+		tc358746_enable_stream(sd, 1);
+
+	return err;
+}
+
+static SIMPLE_DEV_PM_OPS(tc358746_pm_ops, tc358746_suspend, tc358746_resume);
+
 static const struct i2c_device_id tc358746_id[] = {
 	{"tc358746", 0},
 	{}
@@ -1870,6 +1944,7 @@ static struct i2c_driver tc358746_driver = {
 	.driver = {
 		.name = "tc358746",
 		.of_match_table = of_match_ptr(tc358746_of_match),
+		.pm = &tc358746_pm_ops,
 	},
 	.probe = tc358746_probe,
 	.remove = tc358746_remove,
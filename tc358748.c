@@ -15,36 +15,53 @@
 #define DEBUG
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/bsearch.h>
 #include <linux/clk-provider.h>
 #include <linux/slab.h>
 #include <linux/i2c.h>
 #include <linux/clk.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/gpio/consumer.h>
 #include <linux/interrupt.h>
+#include <linux/math64.h>
+#include <linux/pm_runtime.h>
 #include <linux/timer.h>
 #include <linux/property.h>
+#include <linux/regmap.h>
+#include <linux/seq_file.h>
 #include <media/v4l2-device.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-fwnode.h>
 
 #include "tc358748_regs.h"
+#include "tc358xxx_debug.h"
 
 static int debug;
 module_param(debug, int, 0644);
 MODULE_PARM_DESC(debug, "debug level (0-3)");
 
+static int autosuspend_delay_ms = 1000;
+module_param(autosuspend_delay_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay_ms,
+		 "runtime PM autosuspend delay in ms, negative keeps the chip awake");
+
 MODULE_DESCRIPTION("Toshiba TC358748 Parallel to CSI-2 bridge driver");
 MODULE_AUTHOR("Marco Felsch <kernel@pengutronix.de>");
 MODULE_LICENSE("GPL");
 
 #define I2C_MAX_XFER_SIZE	(512 + 2)
+#define TC358748_BATCH_MAX_MSGS	16
+#define TC358748_I2C_RETRIES	3
+#define TC358748_I2C_BACKOFF_US	100
+#define TC358748_TIMING_CACHE_ENTRIES	8
 #define TC358748_MAX_FIFO_SIZE	512
 #define TC358748_DEF_LINK_FREQ	0
 
 #define TC358748_LINEINIT_MIN_US	110
 #define TC358748_TWAKEUP_MIN_US		1200
 #define TC358748_LPTXTIME_MIN_NS	55
+#define TC358748_TCLKPREPARE_MIN_NS	43
 #define TC358748_TCLKZERO_MIN_NS	305
 #define TC358748_TCLKTRAIL_MIN_NS	65
 #define TC358748_TCLKPOST_MIN_NS	65
@@ -52,6 +69,42 @@ MODULE_LICENSE("GPL");
 #define TC358748_THSTRAIL_MIN_NS	65
 #define TC358748_THSPREPARE_MIN_NS	45
 
+/* MIPI D-PHY limits verified by the solver, the targets above add margin */
+#define TC358748_DPHY_LINEINIT_MIN_US		100
+#define TC358748_DPHY_LPX_MIN_NS		50
+#define TC358748_DPHY_TCLKPREPARE_MIN_NS	38
+#define TC358748_DPHY_TCLKPREPARE_MAX_NS	95
+#define TC358748_DPHY_TCLKPREPZERO_MIN_NS	300
+#define TC358748_DPHY_TCLKTRAIL_MIN_NS		60
+#define TC358748_DPHY_TCLKTRAIL_MAX_NS		105	/* + 12 UI, TEOT */
+#define TC358748_DPHY_TCLKPOST_MIN_NS		60	/* + 52 UI */
+#define TC358748_DPHY_THSPREPARE_MIN_NS		40	/* + 4 UI */
+#define TC358748_DPHY_THSPREPARE_MAX_NS		85	/* + 6 UI */
+#define TC358748_DPHY_THSPREPZERO_MIN_NS	145	/* + 10 UI */
+#define TC358748_DPHY_THSTRAIL_MIN_NS		60	/* + 4 UI */
+#define TC358748_DPHY_THSTRAIL_MAX_NS		105	/* + 12 UI */
+#define TC358748_DPHY_TWAKEUP_MIN_US		1000
+
+/* PLL limits, bps per lane = refclk / prd * fbd / 2^frs */
+#define TC358748_PLL_PRD_MAX	16
+#define TC358748_PLL_FBD_MAX	(PLLCTL0_PLL_FBD_MASK + 1)
+#define TC358748_PLL_FRS_MAX	3
+#define TC358748_PLL_INCLK_MIN	4000000U
+#define TC358748_PLL_INCLK_MAX	40000000U
+#define TC358748_PLL_VCO_MIN	500000000U
+#define TC358748_PLL_VCO_MAX	1000000000U
+
+#define TC358748_FS_PER_NS	1000000ULL
+#define TC358748_FS_PER_US	1000000000ULL
+
+/* Power sequence delays, there is no PLL lock status bit to poll */
+#define TC358748_SRESET_US		10
+#define TC358748_PLL_LOCK_US		1000
+#define TC358748_CSI_START_POLL_US	10
+#define TC358748_CSI_START_TIMEOUT_US	1000
+#define TC358748_FRMSTOP_POLL_US	50
+#define TC358748_FRMSTOP_DEF_TIMEOUT_US	100000	/* input timing unknown */
+
 static const struct v4l2_mbus_framefmt tc358748_def_fmt = {
 	.width		= 640,
 	.height		= 480,
@@ -63,13 +116,52 @@ static const struct v4l2_mbus_framefmt tc358748_def_fmt = {
 	.xfer_func	= V4L2_XFER_FUNC_DEFAULT,
 };
 
+enum tc358748_dphy_param {
+	TC358748_DPHY_LINEINIT,
+	TC358748_DPHY_LPX,
+	TC358748_DPHY_TCLK_PREPARE,
+	TC358748_DPHY_TCLK_PREPARE_ZERO,
+	TC358748_DPHY_TCLK_TRAIL,
+	TC358748_DPHY_TCLK_POST,
+	TC358748_DPHY_THS_PREPARE,
+	TC358748_DPHY_THS_PREPARE_ZERO,
+	TC358748_DPHY_THS_TRAIL,
+	TC358748_DPHY_TWAKEUP,
+	TC358748_DPHY_NUM_PARAMS,
+};
+
+static const char * const tc358748_dphy_names[] = {
+	[TC358748_DPHY_LINEINIT] = "lineinit",
+	[TC358748_DPHY_LPX] = "lpx",
+	[TC358748_DPHY_TCLK_PREPARE] = "tclk_prepare",
+	[TC358748_DPHY_TCLK_PREPARE_ZERO] = "tclk_prepare+zero",
+	[TC358748_DPHY_TCLK_TRAIL] = "tclk_trail",
+	[TC358748_DPHY_TCLK_POST] = "tclk_post",
+	[TC358748_DPHY_THS_PREPARE] = "ths_prepare",
+	[TC358748_DPHY_THS_PREPARE_ZERO] = "ths_prepare+zero",
+	[TC358748_DPHY_THS_TRAIL] = "ths_trail",
+	[TC358748_DPHY_TWAKEUP] = "twakeup",
+};
+
+/* Resulting D-PHY timings and their limits in fs, a max of 0 is unlimited */
+struct tc358748_dphy_report {
+	struct {
+		s64 val;
+		s64 min;
+		s64 max;
+	} t[TC358748_DPHY_NUM_PARAMS];
+};
+
 struct tc358748_csi_param {
 	unsigned char speed_range;
 	unsigned int  unit_clk_hz;
 	unsigned char unit_clk_mul;
-	unsigned int speed_per_lane; /* bps / lane */
-	unsigned short lane_num;
+	u16 pll_prd;
+	u16 pll_fbd;
+	unsigned int speed_per_lane; /* bps / lane, as generated by the PLL */
+	unsigned short lane_num; /* lanes wired up in the DT */
 	bool is_continuous_clk;
+	bool usable; /* PLL and D-PHY timings in spec, offered by LINK_FREQ */
 
 	/* CSI2-TX Parameters */
 	u32 lineinitcnt;
@@ -84,6 +176,119 @@ struct tc358748_csi_param {
 	u32 ths_trailcnt;
 
 	unsigned int csi_hs_lp_hs_ps;
+
+	struct tc358748_dphy_report dphy;
+};
+
+/*
+ * Results of tc358748_adjust_timings(). The search only depends on the key,
+ * so repeated set_fmt/link_validate calls for the same mode reuse them.
+ */
+struct tc358748_timing_key {
+	u32 code;
+	int width;		/* requested width */
+	unsigned int pclk;
+	unsigned int hblank;
+	int freq;		/* link frequency index at the time of the search */
+};
+
+struct tc358748_timing_entry {
+	struct tc358748_timing_key key;
+	bool valid;
+	int freq;
+	int width;
+	unsigned int lanes;
+	u16 fifo_size;
+};
+
+struct tc358748_timing_cache {
+	spinlock_t lock;
+	unsigned int next;	/* round robin replacement */
+	unsigned long hits;
+	unsigned long misses;
+	struct tc358748_timing_entry entries[TC358748_TIMING_CACHE_ENTRIES];
+};
+
+/*
+ * Registers derived from the format and the link frequency. s_power() builds
+ * the image for the current configuration and only writes the entries that
+ * differ from what was last applied to the chip.
+ */
+enum tc358748_cfg_idx {
+	TC358748_CFG_FIFOCTL,
+	TC358748_CFG_WORDCNT,
+	TC358748_CFG_DATAFMT,		/* PDFMT and UDT_EN only */
+	TC358748_CFG_CONFCTL,		/* PDATAF and DATALANE only */
+	TC358748_CFG_PLLCTL0,
+	TC358748_CFG_PLLCTL1,		/* FRS, RESETB, PLL_EN and CKEN only */
+	TC358748_CFG_LINEINITCNT,
+	TC358748_CFG_LPTXTIMECNT,
+	TC358748_CFG_TCLK_HEADERCNT,
+	TC358748_CFG_TCLK_TRAILCNT,
+	TC358748_CFG_THS_HEADERCNT,
+	TC358748_CFG_TWAKEUP,
+	TC358748_CFG_TCLK_POSTCNT,
+	TC358748_CFG_THS_TRAILCNT,
+	TC358748_CFG_TXOPTIONCNTRL,
+	TC358748_CFG_NUM
+};
+
+#define TC358748_CFG_BUFFERS	(BIT(TC358748_CFG_FIFOCTL) | \
+				 BIT(TC358748_CFG_WORDCNT))
+#define TC358748_CFG_COLOR	(BIT(TC358748_CFG_DATAFMT) | \
+				 BIT(TC358748_CFG_CONFCTL))
+#define TC358748_CFG_PLL	(BIT(TC358748_CFG_PLLCTL0) | \
+				 BIT(TC358748_CFG_PLLCTL1))
+#define TC358748_CFG_CSI	GENMASK(TC358748_CFG_TXOPTIONCNTRL, \
+					TC358748_CFG_LINEINITCNT)
+
+/* Phases of tc358748_power_seq(), in order */
+enum tc358748_pwr_phase {
+	TC358748_PWR_SRESET,
+	TC358748_PWR_CONFIG,	/* registers from the register image */
+	TC358748_PWR_PLL,	/* program the PLL, only if it changed */
+	TC358748_PWR_PLL_LOCK,	/* wait for the PLL, enable the clocks */
+	TC358748_PWR_LANES,
+	TC358748_PWR_CSI_START,
+	TC358748_PWR_SLEEP,
+	TC358748_PWR_NUM
+};
+
+static const char * const tc358748_pwr_names[TC358748_PWR_NUM] = {
+	[TC358748_PWR_SRESET]		= "sreset",
+	[TC358748_PWR_CONFIG]		= "config",
+	[TC358748_PWR_PLL]		= "pll",
+	[TC358748_PWR_PLL_LOCK]		= "pll_lock",
+	[TC358748_PWR_LANES]		= "lanes",
+	[TC358748_PWR_CSI_START]	= "csi_start",
+	[TC358748_PWR_SLEEP]		= "sleep",
+};
+
+/* Latency histograms: the power-on phases, then whole operations */
+enum tc358748_lat_idx {
+	TC358748_LAT_POWER_ON = TC358748_PWR_NUM,
+	TC358748_LAT_STREAM_ON,
+	TC358748_LAT_RESUME,	/* system resume to the next stream on */
+	TC358748_LAT_NUM
+};
+
+static const char * const tc358748_lat_names[] = {
+	[TC358748_LAT_POWER_ON]		= "s_power",
+	[TC358748_LAT_STREAM_ON]	= "s_stream",
+	[TC358748_LAT_RESUME]		= "resume",
+};
+
+/*
+ * Time spent in each phase by the last power sequence, and histograms of
+ * everything that ran since the last reset.
+ */
+struct tc358748_pwr_stats {
+	spinlock_t lock;
+	bool on;
+	int err;
+	enum tc358748_pwr_phase last;	/* last phase run */
+	s64 ns[TC358748_PWR_NUM];
+	struct tc358xxx_lat_hist hist[TC358748_LAT_NUM];
 };
 
 struct tc358748_state {
@@ -98,14 +303,16 @@ struct tc358748_state {
 	struct mutex confctl_mutex;
 	struct v4l2_mbus_framefmt fmt;
 	struct v4l2_ctrl_handler hdl;
-	bool fmt_changed;
-	bool test;
+	unsigned int test_pattern;
+	bool powered;		/* between s_power(1) and s_power(0) */
+	bool streaming;
 
 	/*
 	 * Chip Clocks
 	 */
 	struct clk  *refclk;
-	/* internal pll */
+	unsigned int refclk_hz;
+	/* internal pll, as currently programmed */
 	unsigned int pllinclk_hz;
 	u16 pll_prd;
 	u16 pll_fbd;
@@ -122,12 +329,68 @@ struct tc358748_state {
 	struct tc358748_csi_param *link_freq_settings;
 	u64			  *link_frequencies;
 	unsigned int		   link_frequencies_num;
+	unsigned int		   csi_lanes; /* lanes used by the active format */
+	struct tc358748_timing_cache timing_cache;
+
+	/*
+	 * Register image last applied, see tc358748_pwr_config()
+	 */
+	u32 cfg[TC358748_CFG_NUM];
+	unsigned long cfg_valid; /* entries known to match the chip */
+	struct tc358748_pwr_stats pwr_stats;
+	ktime_t resume_start;
+	unsigned long resume_xfers;
+	bool resume_pending;	/* no stream on since the system resume */
 
 	/*
 	 * Parallel input
 	 */
 	unsigned int pclk;
 	unsigned int hblank;
+
+	/*
+	 * Register access. While a batch is flushed the regmap write callback
+	 * queues the writes on it instead of sending them one by one.
+	 */
+	struct regmap *regmap;
+	struct tc358748_reg_batch *batch;
+	bool sync_all;		/* the chip may differ from any cached value */
+
+	/*
+	 * Statistics
+	 */
+	unsigned long xfer_cnt; /* number of i2c_transfer() calls */
+	unsigned long retry_cnt; /* transfers repeated after a bus error */
+	unsigned long fail_cnt; /* transfers failed after all retries */
+	s64 max_xfer_ns; /* slowest transfer, retries included */
+
+	/*
+	 * Debug
+	 */
+	struct tc358xxx_trace trace;
+	struct dentry *debugfs;
+};
+
+/*
+ * Register write batch, flushed as one multi-message i2c_transfer(). Writes
+ * to adjacent registers are sent as one auto-incrementing burst, all other
+ * writes get their own message so the chip sees a repeated start instead of
+ * a full bus transaction. Queue registers in ascending address order to get
+ * the longest bursts.
+ */
+struct tc358748_reg_batch {
+	unsigned int num;
+	unsigned int writes; /* total queued writes, for statistics */
+	int err; /* first flush error, later writes are dropped */
+	struct reg_sequence seq[TC358748_BATCH_MAX_MSGS];
+
+	/* writes passed on by regmap, in bus order */
+	unsigned int num_regs;
+	struct {
+		u16 reg;
+		u8 len;
+		u32 val;
+	} regs[TC358748_BATCH_MAX_MSGS];
 };
 
 struct tc358748_mbus_fmt {
@@ -140,6 +403,14 @@ struct tc358748_mbus_fmt {
 	bool csitx_only; /* format only in csi-tx mode supported */
 };
 
+enum tc358748_test_pattern {
+	TC358748_PATTERN_DISABLED,
+	TC358748_PATTERN_COLOR_BARS,
+	TC358748_PATTERN_RAMP,
+	TC358748_PATTERN_STRIPES,
+	TC358748_PATTERN_SOLID,
+};
+
 /* TODO: Add other formats as required */
 static const struct tc358748_mbus_fmt tc358748_formats[] = {
 	{
@@ -183,6 +454,26 @@ static const struct tc358748_mbus_fmt tc358748_formats[] = {
 };
 
 /* --------------- HELPERS ------------ */
+/* Distance of each D-PHY timing to its limits */
+static void
+tc358748_dump_dphy(struct device *dev, const struct tc358748_dphy_report *r)
+{
+	unsigned int i;
+
+	for (i = 0; i < TC358748_DPHY_NUM_PARAMS; i++) {
+		s64 val = div_s64(r->t[i].val, 1000);
+		s64 min_margin = div_s64(r->t[i].val - r->t[i].min, 1000);
+
+		if (r->t[i].max)
+			dev_dbg(dev, "%s %lld ps: margin %lld ps to min, %lld ps to max\n",
+				tc358748_dphy_names[i], val, min_margin,
+				div_s64(r->t[i].max - r->t[i].val, 1000));
+		else
+			dev_dbg(dev, "%s %lld ps: margin %lld ps to min\n",
+				tc358748_dphy_names[i], val, min_margin);
+	}
+}
+
 static void
 tc358748_dump_csi(struct device *dev,
 		  struct tc358748_csi_param *csi_setting)
@@ -209,6 +500,8 @@ tc358748_dump_csi(struct device *dev,
 	dev_dbg(dev, "csi_hs_lp_hs_ps %u (%u us)\n",
 		csi_setting->csi_hs_lp_hs_ps,
 		csi_setting->csi_hs_lp_hs_ps / 1000);
+
+	tc358748_dump_dphy(dev, &csi_setting->dphy);
 }
 
 static void
@@ -256,288 +549,585 @@ static const struct tc358748_mbus_fmt *tc358748_get_format(u32 code)
 	return NULL;
 }
 
-static int
-tc358748_adjust_fifo_size(struct tc358748_state *state,
-			  const struct tc358748_mbus_fmt *format,
-			  struct tc358748_csi_param *csi_settings,
-			  int width, u16 *fifo_size)
+/*
+ * FIFO sizing, all times in fs:
+ *
+ * c_fifo_delay = fifo_size * 32 / parallel_bus_width * pclk_p + 4 * hsclk_p
+ * c_hactive = csi_bps_p * image_bpp * h_active_pixel + c_fifo_delay
+ *
+ * A fifo size fits if the CSI line ends after the parallel line
+ * (c_hactive > p_hactive) and there is still time to go to LP and back
+ * before the next parallel line starts (p_htotal - c_hactive > hs_lp_hs).
+ * Both conditions are linear in the fifo size and the width, so the range of
+ * valid fifo sizes and the widths each size carries follow directly.
+ */
+struct tc358748_fifo_fit {
+	s64 step;	/* c_fifo_delay per fifo entry */
+	s64 delay;	/* c_fifo_delay of an empty fifo */
+	s64 slope;	/* p_hactive - csi line time, per pixel */
+	s64 window;	/* p_hblank - hs_lp_hs */
+};
+
+static int tc358748_fifo_fit_init(struct tc358748_state *state,
+				  const struct tc358748_mbus_fmt *format,
+				  struct tc358748_csi_param *csi_settings,
+				  unsigned int lanes,
+				  struct tc358748_fifo_fit *fit)
 {
-	struct device *dev = &state->i2c_client->dev;
-	int c_hactive_ps_diff, c_lp_active_ps_diff, c_fifo_delay_ps_diff;
-	unsigned int p_hactive_ps, p_hblank_ps, p_htotal_ps;
-	unsigned int c_hactive_ps, c_lp_active_ps, c_fifo_delay_ps;
-	unsigned int csi_bps, csi_bps_period_ps;
-	unsigned int csi_hsclk, csi_hsclk_period_ps;
-	unsigned int pclk_period_ps;
-	unsigned int _fifo_size;
-
-	pclk_period_ps = 1000000000 / (state->pclk / 1000);
-	csi_bps = csi_settings->speed_per_lane * csi_settings->lane_num;
-	csi_bps_period_ps = 1000000000 / (csi_bps / 1000);
-	csi_hsclk = csi_settings->speed_per_lane >> 3;
-	csi_hsclk_period_ps = 1000000000 / (csi_hsclk / 1000);
+	u64 csi_bps = (u64)csi_settings->speed_per_lane * lanes;
+	s64 pclk_p, csi_bps_p, csi_hsclk_p;
 
-	/*
-	 * Calculation:
-	 * p_hactive_ps = pclk_period_ps * pclk_per_pixel * h_active_pixel
-	 */
-	p_hactive_ps = pclk_period_ps * format->ppp * width;
+	if (!state->pclk || !csi_bps)
+		return -EINVAL;
 
-	/*
-	 * Calculation:
-	 * p_hblank_ps = pclk_period_ps * h_blank_pixel
-	 */
-	p_hblank_ps = pclk_period_ps * state->hblank;
-	p_htotal_ps = p_hblank_ps + p_hactive_ps;
+	pclk_p = div_u64(FSEC_PER_SEC + state->pclk / 2, state->pclk);
+	csi_bps_p = div64_u64(FSEC_PER_SEC + csi_bps / 2, csi_bps);
+	csi_hsclk_p = div_u64(8 * FSEC_PER_SEC +
+			      csi_settings->speed_per_lane / 2,
+			      csi_settings->speed_per_lane);
+
+	fit->step = div_s64(32 * pclk_p, format->bus_width);
+	fit->delay = 4 * csi_hsclk_p;
+	fit->slope = pclk_p * format->ppp - csi_bps_p * format->bpp;
+	fit->window = pclk_p * state->hblank -
+		      (s64)csi_settings->csi_hs_lp_hs_ps * 1000;
+
+	return 0;
+}
+
+/* Smallest valid fifo size for width, 0 if there is none */
+static u16 tc358748_fifo_fit_size(const struct tc358748_fifo_fit *fit,
+				  int width)
+{
+	/* fifo_size * step must be above lo and below hi */
+	s64 lo = fit->slope * width - fit->delay;
+	s64 hi = lo + fit->window;
+	s64 min_size, max_size;
+
+	min_size = lo < 0 ? 1 : div64_s64(lo, fit->step) + 1;
+	max_size = hi <= 0 ? 0 : div64_s64(hi - 1, fit->step);
+	max_size = min_t(s64, max_size, TC358748_MAX_FIFO_SIZE - 1);
+
+	return min_size <= max_size ? min_size : 0;
+}
+
+/*
+ * Smallest x >= 0 with l <= a * x mod m <= r, for 0 < l <= r < m and a < m,
+ * or -1 if there is none. Each call either finds x directly or continues
+ * modulo a <= m / 2, so the recursion depth is logarithmic in m.
+ */
+static s64 tc358748_mod_first(u64 a, u64 m, u64 l, u64 r)
+{
+	u64 k, m_rem, l_rem;
+	s64 y;
+
+	if (!a)
+		return -1;
+
+	/* a * x mod m also moves down by m - a, keep the smaller stride */
+	if (2 * a > m)
+		return tc358748_mod_first(m - a, m, m - r, m - l);
+
+	/* first multiple of a from l on, if it is still below r */
+	k = div64_u64(l + a - 1, a);
+	if (a * k <= r)
+		return k;
 
 	/*
-	 * Adjust the fifo size to adjust the csi timing. Hopefully we can find
-	 * a fifo size where the parallel input timings and the csi tx timings
-	 * fit together.
+	 * Otherwise a * x has to wrap. Find the first wrap count y with a
+	 * multiple of a in [l + m * y, r + m * y], that is the y with
+	 * (l + m * y) mod a in [l mod a, l mod a + r - l] after going round
+	 * mod a. No multiple of a lies in [l, r], so l mod a is not 0 and
+	 * that range stays below a.
 	 */
-	for (_fifo_size = 1; _fifo_size < TC358748_MAX_FIFO_SIZE;
-	     _fifo_size++) {
-		/*
-		 * Calculation:
-		 * c_fifo_delay_ps = (fifo_size * 32) / parallel_bus_width *
-		 *		     pclk_period_ps + 4 * csi_hsclk_period_ps
-		 */
-		c_fifo_delay_ps = _fifo_size * 32 * pclk_period_ps;
-		c_fifo_delay_ps /= format->bus_width;
-		c_fifo_delay_ps += 4 * csi_hsclk_period_ps;
+	div64_u64_rem(m, a, &m_rem);
+	div64_u64_rem(l, a, &l_rem);
+	y = tc358748_mod_first(m_rem ? a - m_rem : 0, a, l_rem, l_rem + r - l);
+	if (y < 0)
+		return -1;
 
-		/*
-		 * Calculation:
-		 * c_hactive_ps = csi_bps_period_ps * image_bpp * h_active_pixel
-		 *		  + c_fifo_delay
-		 */
-		c_hactive_ps = csi_bps_period_ps * format->bpp * width;
-		c_hactive_ps += c_fifo_delay_ps;
+	return div64_u64(l + m * y + a - 1, a);
+}
+
+/*
+ * Widest line with a valid fifo size, up to width. A fifo size is valid for
+ * the widths with size * step - window < slope * width - delay < size * step,
+ * so each size covers an interval of widths.
+ */
+static int tc358748_fifo_fit_width(const struct tc358748_fifo_fit *fit,
+				   int width)
+{
+	s64 lo, lo_rem, pair_rem, max_width, pairs;
 
+	if (fit->slope <= 0) {
 		/*
-		 * Calculation:
-		 * c_lp_active_ps = p_htotal_ps - c_hactive_ps
+		 * lo stays negative, so the smallest fifo is the only one to
+		 * check: step < slope * width - delay + window
 		 */
-		c_lp_active_ps = p_htotal_ps - c_hactive_ps;
-
-		c_hactive_ps_diff = c_hactive_ps - p_hactive_ps;
-		c_fifo_delay_ps_diff = p_htotal_ps - c_hactive_ps;
-		c_lp_active_ps_diff =
-			c_lp_active_ps - csi_settings->csi_hs_lp_hs_ps;
+		max_width = fit->window - fit->delay - fit->step;
+		if (max_width <= 0)
+			return 0;
+		if (fit->slope)
+			max_width = min_t(s64, width,
+					  div64_s64(max_width - 1, -fit->slope));
+		else
+			max_width = width;
 
-		if (c_hactive_ps_diff > 0 &&
-		    c_fifo_delay_ps_diff > 0 &&
-		    c_lp_active_ps_diff > 0)
-			break;
+		/* keep 4:2:2 pixel pairs together */
+		return max_width & ~1;
 	}
+
+	/* the intervals move up with the size, the largest fifo ends them */
+	max_width = div64_s64((TC358748_MAX_FIFO_SIZE - 1) * fit->step +
+			      fit->delay - 1, fit->slope);
+	max_width = min_t(s64, width, max_width) & ~1;
+	if (max_width <= 0)
+		return 0;
+
+	lo = fit->slope * max_width - fit->delay;
+
+	/*
+	 * If the window is wider than a fifo step the intervals overlap and
+	 * cover everything from the smallest fifo up.
+	 */
+	if (fit->window > fit->step)
+		return lo > fit->step - fit->window ? max_width : 0;
+	if (fit->window <= 1)
+		return 0;
+
 	/*
-	 * If we can't transfer the image using this csi link frequency try to
-	 * use another link freq.
+	 * Otherwise there are gaps between them. A width is valid when
+	 * lo >= 0 and lo mod step is in [step - window + 1, step - 1], and
+	 * every pixel pair less takes 2 * slope off lo. Solve for the first
+	 * pair count that lands lo mod step in that range.
 	 */
+	lo_rem = lo - div64_s64(lo, fit->step) * fit->step;
+	if (lo_rem < 0)
+		lo_rem += fit->step;
+	pair_rem = 2 * fit->slope - div64_s64(2 * fit->slope, fit->step) *
+				    fit->step;
+
+	if (lo_rem > fit->step - fit->window)
+		pairs = 0;
+	else
+		pairs = tc358748_mod_first(pair_rem ? fit->step - pair_rem : 0,
+					   fit->step,
+					   fit->step - fit->window + 1 - lo_rem,
+					   fit->step - 1 - lo_rem);
+	if (pairs < 0 || pairs >= max_width / 2)
+		return 0;
+
+	max_width -= 2 * pairs;
+	if (fit->slope * max_width - fit->delay < 0)
+		return 0;
 
-	dev_dbg(dev, "%s: found fifo-size %u\n", __func__, _fifo_size);
-	*fifo_size = _fifo_size;
-	return _fifo_size == TC358748_MAX_FIFO_SIZE ? -EINVAL : 0;
+	return max_width;
 }
 
 static int
-tc358748_adjust_timings(struct tc358748_state *state,
-			const struct tc358748_mbus_fmt *format,
-			int *width, u16 *fifo_size)
+tc358748_adjust_fifo_size(struct tc358748_state *state,
+			  const struct tc358748_mbus_fmt *format,
+			  struct tc358748_csi_param *csi_settings,
+			  unsigned int lanes, int width, u16 *fifo_size)
 {
+	struct device *dev = &state->i2c_client->dev;
+	struct tc358748_fifo_fit fit;
+	int err;
+
+	err = tc358748_fifo_fit_init(state, format, csi_settings, lanes, &fit);
+	if (err)
+		return err;
+
+	*fifo_size = tc358748_fifo_fit_size(&fit, width);
+	if (!*fifo_size)
+		return -EINVAL;
+
+	dev_dbg(dev, "%s: found fifo-size %u\n", __func__, *fifo_size);
+	return 0;
+}
 
+static int
+tc358748_search_timings(struct tc358748_state *state,
+			const struct tc358748_mbus_fmt *format,
+			int *width, unsigned int *lanes, u16 *fifo_size)
+{
 	int cur_freq = v4l2_ctrl_g_ctrl(state->link_freq);
-	int freq = cur_freq;
-	struct tc358748_csi_param *csi_lane_setting;
-	int err;
-	int _width;
+	struct tc358748_csi_param *csi_settings;
+	struct tc358748_fifo_fit fit;
+	int best_freq = cur_freq, best_width = 0;
+	int freq, i, max_width;
+	unsigned int l;
 
 	/*
 	 * Adjust timing:
 	 * 1) Try to use the desired width and the current csi-link-frequency
 	 * 2) If this doesn't fit try other csi-link-frequencies
-	 * 3) If this doesn't fit too, reducing the desired width and test
-	 *    it again width the current csi-link-frequency
-	 * 4) Goto step 2 if it doesn't fit at all
+	 * 3) If this doesn't fit too, use the widest line any link frequency
+	 *    can carry, the current one wins a tie
+	 * For each link frequency the fewest lanes that carry the line are
+	 * used, the unused lanes stay powered down.
 	 */
-	for (_width = *width; _width > 0; _width -= 10) {
-		csi_lane_setting = &state->link_freq_settings[cur_freq];
-		err = tc358748_adjust_fifo_size(state, format, csi_lane_setting,
-						_width, fifo_size);
-		if (!err)
-			goto out;
+	for (i = 0; i < state->link_frequencies_num; i++) {
+		/* start with the current link frequency */
+		freq = i ? (i <= cur_freq ? i - 1 : i) : cur_freq;
+		csi_settings = &state->link_freq_settings[freq];
+		if (!csi_settings->usable)
+			continue;
+
+		for (l = 1; l <= csi_settings->lane_num; l++) {
+			if (tc358748_fifo_fit_init(state, format, csi_settings,
+						   l, &fit))
+				break;
+
+			*fifo_size = tc358748_fifo_fit_size(&fit, *width);
+			if (*fifo_size) {
+				*lanes = l;
+				return freq;
+			}
+		}
 
-		for (freq = 0; freq < state->link_frequencies_num; freq++) {
-			if (freq == cur_freq)
-				continue;
+		/* no usable pixel clock or link rate */
+		if (l <= csi_settings->lane_num)
+			continue;
 
-			csi_lane_setting = &state->link_freq_settings[freq];
-			err = tc358748_adjust_fifo_size(state, format,
-							csi_lane_setting,
-							_width, fifo_size);
-			if (!err)
-				goto out;
+		/* fit still holds all lanes, they give the widest line */
+		max_width = tc358748_fifo_fit_width(&fit, *width);
+		if (max_width > best_width) {
+			best_width = max_width;
+			best_freq = freq;
 		}
 	}
 
-out:
-	*width = _width;
+	csi_settings = &state->link_freq_settings[best_freq];
+	*lanes = csi_settings->lane_num;
+
+	if (!best_width) {
+		dev_warn(&state->i2c_client->dev,
+			 "no fifo size fits a %d pixel line\n", *width);
+		*fifo_size = TC358748_MAX_FIFO_SIZE - 1;
+		return cur_freq;
+	}
+
+	tc358748_adjust_fifo_size(state, format, csi_settings, *lanes,
+				  best_width, fifo_size);
+	*width = best_width;
+	return best_freq;
+}
+
+static void tc358748_timing_cache_flush(struct tc358748_state *state)
+{
+	struct tc358748_timing_cache *cache = &state->timing_cache;
+	unsigned int i;
+
+	spin_lock(&cache->lock);
+	for (i = 0; i < TC358748_TIMING_CACHE_ENTRIES; i++)
+		cache->entries[i].valid = false;
+	spin_unlock(&cache->lock);
+}
+
+static bool tc358748_timing_key_eq(const struct tc358748_timing_key *a,
+				   const struct tc358748_timing_key *b)
+{
+	return a->code == b->code && a->width == b->width &&
+	       a->pclk == b->pclk && a->hblank == b->hblank &&
+	       a->freq == b->freq;
+}
+
+static int
+tc358748_adjust_timings(struct tc358748_state *state,
+			const struct tc358748_mbus_fmt *format,
+			int *width, unsigned int *lanes, u16 *fifo_size)
+{
+	struct tc358748_timing_cache *cache = &state->timing_cache;
+	struct tc358748_timing_entry *e;
+	struct tc358748_timing_key key = {
+		.code = format->code,
+		.width = *width,
+		.pclk = state->pclk,
+		.hblank = state->hblank,
+		.freq = v4l2_ctrl_g_ctrl(state->link_freq),
+	};
+	unsigned int i;
+	int freq;
+
+	spin_lock(&cache->lock);
+	for (i = 0; i < TC358748_TIMING_CACHE_ENTRIES; i++) {
+		e = &cache->entries[i];
+		if (!e->valid || !tc358748_timing_key_eq(&e->key, &key))
+			continue;
+
+		cache->hits++;
+		*width = e->width;
+		*lanes = e->lanes;
+		*fifo_size = e->fifo_size;
+		freq = e->freq;
+		spin_unlock(&cache->lock);
+		return freq;
+	}
+	cache->misses++;
+	spin_unlock(&cache->lock);
+
+	freq = tc358748_search_timings(state, format, width, lanes, fifo_size);
+
+	spin_lock(&cache->lock);
+	e = &cache->entries[cache->next++ % TC358748_TIMING_CACHE_ENTRIES];
+	e->key = key;
+	e->freq = freq;
+	e->width = *width;
+	e->lanes = *lanes;
+	e->fifo_size = *fifo_size;
+	e->valid = true;
+	spin_unlock(&cache->lock);
+
 	return freq;
 }
 
+/* Smallest count of period_fs long cycles that lasts at least t_fs */
+static u32 tc358748_fs_to_cnt(s64 t_fs, u64 period_fs)
+{
+	if (t_fs <= 0)
+		return 0;
+
+	return div64_u64(t_fs + period_fs - 1, period_fs);
+}
+
+static void tc358748_dphy_limit(struct tc358748_dphy_report *r,
+				enum tc358748_dphy_param param,
+				s64 val, s64 min, s64 max)
+{
+	r->t[param].val = val;
+	r->t[param].min = min;
+	r->t[param].max = max;
+}
+
 static int
 tc358748_calculate_csi_txtimings(struct tc358748_state *state,
 				 struct tc358748_csi_param *csi_setting)
 {
 	struct device *dev = &state->i2c_client->dev;
-	unsigned int spl;
-	unsigned int spl_p_ps, hsclk_p_ps, hfclk_p_ns;
-	unsigned int hfclk, hsclk; /* SYSCLK */
-	unsigned int tmp;
-	unsigned int lptxtime_ps, tclk_post_ps, tclk_trail_ps, tclk_zero_ps,
-		     ths_trail_ps, ths_zero_ps;
-
-	spl = csi_setting->speed_per_lane;
-	hsclk = spl >> 3; /* spl in bit-per-second, hsclk in byte-per-sercond */
-	hfclk = hsclk >> 1; /* HFCLK = SYSCLK / 2 */
-
-	if (hsclk > 125000000U) {
-		dev_err(dev, "unsupported HS byte clock %d, must <= 125 MHz\n",
-			hsclk);
+	struct tc358748_dphy_report *r = &csi_setting->dphy;
+	u32 spl = csi_setting->speed_per_lane;
+	u64 ui, hsclk_p, hfclk_p, lptx, tclk_prepare, ths_prepare;
+	s64 tclk_post, tclk_trail, tclk_zero, ths_trail, ths_zero, hs_lp_hs;
+	unsigned int i;
+	u32 tmp;
+
+	if (spl / 8 > 125000000U) {
+		dev_err(dev, "unsupported HS byte clock %u, must <= 125 MHz\n",
+			spl / 8);
 		return -EINVAL;
 	}
 
-	hfclk_p_ns = DIV_ROUND_CLOSEST(1000000000, hfclk);
-	hsclk_p_ps = 1000000000 / (hsclk / 1000);
-	spl_p_ps   = 1000000000 / (spl / 1000);
-
 	/*
-	 * Calculation:
-	 * hfclk_p_ns * lineinitcnt > 100us
-	 * lineinitcnt > 100 * 10^-6s / hfclk_p_ns * 10^-9
-	 *
+	 * All times are in femtoseconds. The HS byte clock (HSCLK) and HFCLK
+	 * periods are derived from the rounded UI so all three stay exact
+	 * multiples of each other.
 	 */
-	csi_setting->lineinitcnt = DIV_ROUND_UP(TC358748_LINEINIT_MIN_US * 1000,
-					  hfclk_p_ns);
+	ui = div_u64(FSEC_PER_SEC + spl / 2, spl);
+	hsclk_p = 8 * ui;
+	hfclk_p = 2 * hsclk_p; /* HFCLK = SYSCLK / 2 */
+
+	/* hfclk_p * lineinitcnt > 100us */
+	csi_setting->lineinitcnt =
+		tc358748_fs_to_cnt(TC358748_LINEINIT_MIN_US * TC358748_FS_PER_US,
+				   hfclk_p);
+
+	/* (lptxtimecnt + 1) * hsclk_p > 50ns */
+	csi_setting->lptxtimecnt =
+		tc358748_fs_to_cnt(TC358748_LPTXTIME_MIN_NS * TC358748_FS_PER_NS,
+				   hsclk_p) - 1;
 
 	/*
-	 * Calculation:
-	 * (lptxtimecnt + 1) * hsclk_p_ps > 50ns
-	 * 38ns < (tclk_preparecnt + 1) * hsclk_p_ps < 95ns
+	 * 38ns < (tclk_preparecnt + 1) * hsclk_p < 95ns
+	 *
+	 * The window is narrow compared to hsclk_p at low rates. If the
+	 * margin pushes the period past the maximum, go for the bare minimum.
 	 */
-	csi_setting->lptxtimecnt = csi_setting->tclk_preparecnt =
-		DIV_ROUND_UP(TC358748_LPTXTIME_MIN_NS * 1000, hsclk_p_ps) - 1;
+	tmp = tc358748_fs_to_cnt(TC358748_TCLKPREPARE_MIN_NS * TC358748_FS_PER_NS,
+				 hsclk_p);
+	if (tmp * hsclk_p >= TC358748_DPHY_TCLKPREPARE_MAX_NS * TC358748_FS_PER_NS)
+		tmp = tc358748_fs_to_cnt(TC358748_DPHY_TCLKPREPARE_MIN_NS *
+					 TC358748_FS_PER_NS, hsclk_p);
+	csi_setting->tclk_preparecnt = tmp - 1;
 
 	/*
 	 * Limit:
-	 * (tclk_zero + tclk_prepar) period > 300ns.
+	 * (tclk_zero + tclk_prepare) period > 300ns.
 	 * Since we have no upper limit and for simplicity:
 	 * tclk_zero > 300ns.
 	 *
 	 * Calculation:
-	 * tclk_zero = ([2,3] + tclk_zerocnt) * hsclk_p_ps + ([2,3] * spl_p_ps)
+	 * tclk_zero = ([2,3] + tclk_zerocnt) * hsclk_p + ([2,3] * ui)
 	 *
 	 * Note: REF_02 uses
-	 * tclk_zero = (2.5 + tclk_zerocnt) * hsclk_p_ps + (3.5 * spl_p_ps)
+	 * tclk_zero = (2.5 + tclk_zerocnt) * hsclk_p + (3.5 * ui)
 	 */
-	tmp = TC358748_TCLKZERO_MIN_NS * 1000 - 3 * spl_p_ps;
-	tmp = DIV_ROUND_UP(tmp, hsclk_p_ps);
-	csi_setting->tclk_zerocnt = tmp - 2;
+	tmp = tc358748_fs_to_cnt(TC358748_TCLKZERO_MIN_NS * TC358748_FS_PER_NS -
+				 3 * ui, hsclk_p);
+	csi_setting->tclk_zerocnt = tmp < 2 ? 0 : tmp - 2;
 
-	/*
-	 * Limit:
-	 * 40ns + 4 * spl_p_ps < (ths_preparecnt + 1) * hsclk_p_ps
-	 *		       < 85ns + 6 * spl_p_ps
-	 */
-	tmp = TC358748_THSPREPARE_MIN_NS * 1000 + 4 * spl_p_ps;
-	tmp = DIV_ROUND_UP(tmp, hsclk_p_ps);
+	/* 40ns + 4 * ui < (ths_preparecnt + 1) * hsclk_p < 85ns + 6 * ui */
+	tmp = tc358748_fs_to_cnt(TC358748_THSPREPARE_MIN_NS * TC358748_FS_PER_NS +
+				 4 * ui, hsclk_p);
 	csi_setting->ths_preparecnt = tmp - 1;
 
 	/*
 	 * Limit:
-	 * (ths_zero + ths_prepare) period > 145ns + 10 * spl_p_ps.
+	 * (ths_zero + ths_prepare) period > 145ns + 10 * ui.
 	 * Since we have no upper limit and for simplicity:
-	 * ths_zero period > 145ns + 10 * spl_p_ps.
+	 * ths_zero period > 145ns + 10 * ui.
 	 *
 	 * Calculation:
-	 * ths_zero = ([6,8] + ths_zerocnt) * hsclk_p_ps + [3,4] * hsclk_p_ps +
-	 *	      [13,14] * spl_p_ps
+	 * ths_zero = ([6,8] + ths_zerocnt) * hsclk_p + [3,4] * hsclk_p +
+	 *	      [13,14] * ui
 	 *
 	 * Note: REF_02 uses
-	 * ths_zero = (7 + ths_zerocnt) * hsclk_p_ps + 4 * hsclk_p_ps +
-	 *	      11 * spl_p_ps
+	 * ths_zero = (7 + ths_zerocnt) * hsclk_p + 4 * hsclk_p + 11 * ui
 	 */
-	tmp = TC358748_THSZERO_MIN_NS * 1000 - spl_p_ps;
-	tmp = DIV_ROUND_UP(tmp, hsclk_p_ps);
+	tmp = tc358748_fs_to_cnt(TC358748_THSZERO_MIN_NS * TC358748_FS_PER_NS - ui,
+				 hsclk_p);
 	csi_setting->ths_zerocnt = tmp < 11 ? 0 : tmp - 11;
 
 	/*
 	 * Limit:
-	 * hsclk_p_ps * (lptxtimecnt + 1) * (twakeupcnt + 1) > 1ms
+	 * hsclk_p * (lptxtimecnt + 1) * (twakeupcnt + 1) > 1ms
 	 *
 	 * Since we have no upper limit use 1.2ms as lower limit to
 	 * surley meet the spec limit.
 	 */
-	tmp = hsclk_p_ps / 1000; /* tmp = hsclk_p_ns */
+	lptx = (csi_setting->lptxtimecnt + 1) * hsclk_p;
 	csi_setting->twakeupcnt =
-		DIV_ROUND_UP(TC358748_TWAKEUP_MIN_US * 1000,
-			     tmp * (csi_setting->lptxtimecnt + 1)) - 1;
+		tc358748_fs_to_cnt(TC358748_TWAKEUP_MIN_US * TC358748_FS_PER_US,
+				   lptx) - 1;
 
 	/*
 	 * Limit:
-	 * 60ns + 4 * spl_p_ps < thstrail < 105ns + 12 * spl_p_ps
+	 * 60ns + 4 * ui < thstrail < 105ns + 12 * ui
 	 *
 	 * Calculation:
-	 * thstrail = (1 + ths_trailcnt) * hsclk_p_ps + [3,4] * hsclk_p_ps -
-	 *	      [13,14] * spl_p_ps
+	 * thstrail = (1 + ths_trailcnt) * hsclk_p + [3,4] * hsclk_p -
+	 *	      [13,14] * ui
 	 *
 	 * [2] set formula to:
-	 * thstrail = (1 + ths_trailcnt) * hsclk_p_ps + 4 * hsclk_p_ps -
-	 *	      11 * spl_p_ps
+	 * thstrail = (1 + ths_trailcnt) * hsclk_p + 4 * hsclk_p - 11 * ui
 	 */
-	tmp = TC358748_THSTRAIL_MIN_NS * 1000 + 15 * spl_p_ps;
-	tmp = DIV_ROUND_UP(tmp, hsclk_p_ps);
-	csi_setting->ths_trailcnt = tmp - 5;
+	tmp = tc358748_fs_to_cnt(TC358748_THSTRAIL_MIN_NS * TC358748_FS_PER_NS +
+				 15 * ui, hsclk_p);
+	csi_setting->ths_trailcnt = tmp < 5 ? 0 : tmp - 5;
 
 	/*
 	 * Limit:
-	 * 60ns < tclk_trail < 105ns + 12 * spl_p_ps
+	 * 60ns < tclk_trail < 105ns + 12 * ui
 	 *
 	 * Limit used by REF_02:
-	 * 60ns < tclk_trail < 105ns + 12 * spl_p_ps - 30
+	 * 60ns < tclk_trail < 105ns + 12 * ui - 30
 	 *
 	 * Calculation:
-	 * tclk_trail = ([1,2] + tclk_trailcnt) * hsclk_p_ps +
-	 *		(2 + [1,2]) * hsclk_p_ps - [2,3] * spl_p_ps
+	 * tclk_trail = ([1,2] + tclk_trailcnt) * hsclk_p +
+	 *		(2 + [1,2]) * hsclk_p - [2,3] * ui
 	 *
 	 * Calculation used by REF_02:
-	 * tclk_trail = (1 + tclk_trailcnt) * hsclk_p_ps +
-	 *		4 * hsclk_p_ps - 3 * spl_p_ps
+	 * tclk_trail = (1 + tclk_trailcnt) * hsclk_p + 4 * hsclk_p - 3 * ui
 	 */
-	tmp = TC358748_TCLKTRAIL_MIN_NS * 1000 + 3 * spl_p_ps;
-	tmp = DIV_ROUND_UP(tmp, hsclk_p_ps);
+	tmp = tc358748_fs_to_cnt(TC358748_TCLKTRAIL_MIN_NS * TC358748_FS_PER_NS +
+				 3 * ui, hsclk_p);
 	csi_setting->tclk_trailcnt = tmp < 5 ? 0 : tmp - 5;
 
 	/*
 	 * Limit:
-	 * tclk_post > 60ns + 52 * spl_p_ps
-	 *
-	 * Limit used by REF_02:
-	 * tclk_post > 60ns + 52 * spl_p_ps
+	 * tclk_post > 60ns + 52 * ui
 	 *
 	 * Calculation:
-	 * tclk_post = ([1,2] + (tclk_postcnt + 1)) * hsclk_p_ps + hsclk_p_ps
+	 * tclk_post = ([1,2] + (tclk_postcnt + 1)) * hsclk_p + hsclk_p
 	 *
 	 * Note REF_02 uses:
-	 * tclk_post = (2.5 + tclk_postcnt) * hsclk_p_ps + hsclk_p_ps +
-	 *		2.5 * spl_p_ps
+	 * tclk_post = (2.5 + tclk_postcnt) * hsclk_p + hsclk_p + 2.5 * ui
 	 * To meet the REF_02 validation limits following equation is used:
-	 * tclk_post = (2 + tclk_postcnt) * hsclk_p_ps + hsclk_p_ps +
-	 *		3 * spl_p_ps
+	 * tclk_post = (2 + tclk_postcnt) * hsclk_p + hsclk_p + 3 * ui
+	 */
+	tmp = tc358748_fs_to_cnt(TC358748_TCLKPOST_MIN_NS * TC358748_FS_PER_NS +
+				 49 * ui, hsclk_p);
+	csi_setting->tclk_postcnt = tmp < 3 ? 0 : tmp - 3;
+
+	/* The resulting periods, with the REF_02 equations from above */
+	tclk_prepare = (csi_setting->tclk_preparecnt + 1) * hsclk_p;
+	ths_prepare = (csi_setting->ths_preparecnt + 1) * hsclk_p;
+	tclk_post = (4 + csi_setting->tclk_postcnt) * hsclk_p + 3 * ui;
+	tclk_trail = (5 + csi_setting->tclk_trailcnt) * hsclk_p - 3 * ui;
+	tclk_zero = (2 + csi_setting->tclk_zerocnt) * hsclk_p + 3 * ui;
+	ths_trail = (5 + csi_setting->ths_trailcnt) * hsclk_p - 11 * ui;
+	ths_zero = (7 + csi_setting->ths_zerocnt) * hsclk_p + 4 * hsclk_p +
+		   11 * ui;
+
+	/* Verify everything against the MIPI D-PHY limits */
+	memset(r, 0, sizeof(*r));
+	tc358748_dphy_limit(r, TC358748_DPHY_LINEINIT,
+			    (u64)csi_setting->lineinitcnt * hfclk_p,
+			    TC358748_DPHY_LINEINIT_MIN_US * TC358748_FS_PER_US, 0);
+	tc358748_dphy_limit(r, TC358748_DPHY_LPX, lptx,
+			    TC358748_DPHY_LPX_MIN_NS * TC358748_FS_PER_NS, 0);
+	tc358748_dphy_limit(r, TC358748_DPHY_TCLK_PREPARE, tclk_prepare,
+			    TC358748_DPHY_TCLKPREPARE_MIN_NS * TC358748_FS_PER_NS,
+			    TC358748_DPHY_TCLKPREPARE_MAX_NS * TC358748_FS_PER_NS);
+	tc358748_dphy_limit(r, TC358748_DPHY_TCLK_PREPARE_ZERO,
+			    tclk_prepare + tclk_zero,
+			    TC358748_DPHY_TCLKPREPZERO_MIN_NS * TC358748_FS_PER_NS,
+			    0);
+	tc358748_dphy_limit(r, TC358748_DPHY_TCLK_TRAIL, tclk_trail,
+			    TC358748_DPHY_TCLKTRAIL_MIN_NS * TC358748_FS_PER_NS,
+			    TC358748_DPHY_TCLKTRAIL_MAX_NS * TC358748_FS_PER_NS +
+			    12 * ui);
+	tc358748_dphy_limit(r, TC358748_DPHY_TCLK_POST, tclk_post,
+			    TC358748_DPHY_TCLKPOST_MIN_NS * TC358748_FS_PER_NS +
+			    52 * ui, 0);
+	tc358748_dphy_limit(r, TC358748_DPHY_THS_PREPARE, ths_prepare,
+			    TC358748_DPHY_THSPREPARE_MIN_NS * TC358748_FS_PER_NS +
+			    4 * ui,
+			    TC358748_DPHY_THSPREPARE_MAX_NS * TC358748_FS_PER_NS +
+			    6 * ui);
+	tc358748_dphy_limit(r, TC358748_DPHY_THS_PREPARE_ZERO,
+			    ths_prepare + ths_zero,
+			    TC358748_DPHY_THSPREPZERO_MIN_NS * TC358748_FS_PER_NS +
+			    10 * ui, 0);
+	tc358748_dphy_limit(r, TC358748_DPHY_THS_TRAIL, ths_trail,
+			    TC358748_DPHY_THSTRAIL_MIN_NS * TC358748_FS_PER_NS +
+			    4 * ui,
+			    TC358748_DPHY_THSTRAIL_MAX_NS * TC358748_FS_PER_NS +
+			    12 * ui);
+	tc358748_dphy_limit(r, TC358748_DPHY_TWAKEUP,
+			    lptx * (csi_setting->twakeupcnt + 1),
+			    TC358748_DPHY_TWAKEUP_MIN_US * TC358748_FS_PER_US, 0);
+
+	if (csi_setting->tclk_preparecnt > TCLK_HEADERCNT_TCLK_PREPARECNT_MASK ||
+	    csi_setting->tclk_zerocnt > (TCLK_HEADERCNT_TCLK_ZEROCNT_MASK >> 8) ||
+	    csi_setting->ths_preparecnt > THS_HEADERCNT_THS_PREPARECNT_MASK ||
+	    csi_setting->ths_zerocnt > (THS_HEADERCNT_THS_ZEROCNT_MASK >> 8)) {
+		dev_err(dev, "%u bps/lane: header counters out of range\n", spl);
+		return -ERANGE;
+	}
+
+	/*
+	 * Out of spec timings are never programmed. At the lowest lane rates
+	 * the fixed part of some periods alone can exceed the maximum with the
+	 * counters at 0, such a link frequency can't be used.
 	 */
-	tmp = TC358748_TCLKPOST_MIN_NS * 1000 + 49 * spl_p_ps;
-	tmp = DIV_ROUND_UP(tmp, hsclk_p_ps);
-	csi_setting->tclk_postcnt = tmp - 3;
+	for (i = 0; i < TC358748_DPHY_NUM_PARAMS; i++) {
+		if (r->t[i].val < r->t[i].min) {
+			dev_err(dev, "%u bps/lane: %s %lld ps below %lld ps\n",
+				spl, tc358748_dphy_names[i],
+				div_s64(r->t[i].val, 1000),
+				div_s64(r->t[i].min, 1000));
+			return -ERANGE;
+		}
+
+		if (r->t[i].max && r->t[i].val > r->t[i].max) {
+			dev_err(dev, "%u bps/lane: %s %lld ps above %lld ps\n",
+				spl, tc358748_dphy_names[i],
+				div_s64(r->t[i].val, 1000),
+				div_s64(r->t[i].max, 1000));
+			return -ERANGE;
+		}
+	}
 
 	/*
 	 * Last calculate the csi hs->lp->hs transistion time in ns. Note REF_02
@@ -545,111 +1135,317 @@ tc358748_calculate_csi_txtimings(struct tc358748_state *state,
 	 * this was the intention. The driver drops the last 'multiply all by
 	 * two' to get nearly the same results.
 	 */
-	lptxtime_ps = (csi_setting->lptxtimecnt + 1) * hsclk_p_ps;
-	tclk_post_ps =
-		(4 + csi_setting->tclk_postcnt) * hsclk_p_ps + 3 * spl_p_ps;
-	tclk_trail_ps =
-		(5 + csi_setting->tclk_trailcnt) * hsclk_p_ps - 3 * spl_p_ps;
-	tclk_zero_ps =
-		(2 + csi_setting->tclk_zerocnt) * hsclk_p_ps + 3 * spl_p_ps;
-	ths_trail_ps =
-		(5 + csi_setting->ths_trailcnt) * hsclk_p_ps - 11 * spl_p_ps;
-	ths_zero_ps =
-		(7 + csi_setting->ths_zerocnt) * hsclk_p_ps + 4 * hsclk_p_ps +
-		11 * spl_p_ps;
-
 	if (csi_setting->is_continuous_clk) {
-		tmp = 2 * lptxtime_ps;
-		tmp += 25 * hsclk_p_ps;
-		tmp += ths_trail_ps;
-		tmp += ths_zero_ps;
+		hs_lp_hs = 2 * lptx;
+		hs_lp_hs += 25 * hsclk_p;
+		hs_lp_hs += ths_trail;
+		hs_lp_hs += ths_zero;
 	} else {
-		tmp = 4 * lptxtime_ps;
-		tmp += ths_trail_ps + tclk_post_ps + tclk_trail_ps +
-			tclk_zero_ps + ths_zero_ps;
-		tmp += (13 + csi_setting->lptxtimecnt * 8) * hsclk_p_ps;
-		tmp += 22 * hsclk_p_ps;
-		tmp *= 3;
-		tmp = DIV_ROUND_CLOSEST(tmp, 2);
+		hs_lp_hs = 4 * lptx;
+		hs_lp_hs += ths_trail + tclk_post + tclk_trail + tclk_zero +
+			    ths_zero;
+		hs_lp_hs += (13 + csi_setting->lptxtimecnt * 8) * hsclk_p;
+		hs_lp_hs += 22 * hsclk_p;
+		hs_lp_hs = div_s64(hs_lp_hs * 3 + 1, 2);
 	}
-	csi_setting->csi_hs_lp_hs_ps = tmp;
+	csi_setting->csi_hs_lp_hs_ps = div_s64(hs_lp_hs + 500, 1000);
 
 	return 0;
 }
 
-/* --------------- i2c helper ------------ */
+/* --------------- register trace --------------- */
 
-static void i2c_rd(struct v4l2_subdev *sd, u16 reg, u8 *values, u32 n)
+static void tc358748_trace(struct tc358748_state *state, char dir, u16 reg,
+			   u32 val, u32 len, int ret)
 {
-	struct tc358748_state *state = to_state(sd);
-	struct i2c_client *client = state->i2c_client;
-	int err;
-	u8 buf[2] = { reg >> 8, reg & 0xff };
-	u8 data[I2C_MAX_XFER_SIZE];
+	tc358xxx_trace_add(&state->trace, dir, reg, val, len, ret);
 
-	struct i2c_msg msgs[] = {
-		{
-			.addr = client->addr,
-			.flags = 0,
-			.len = 2,
-			.buf = buf,
-		},
-		{
-			.addr = client->addr,
-			.flags = I2C_M_RD,
-			.len = n,
-			.buf = data,
-		},
-	};
+	if (debug >= 3)
+		v4l2_info(&state->sd, "I2C %s 0x%04x = 0x%08x (%u)%s\n",
+			  dir == 'R' ? "read" : "write", reg, val, len,
+			  ret ? " failed" : "");
+}
 
-	err = i2c_transfer(client->adapter, msgs, ARRAY_SIZE(msgs));
-	if (err != ARRAY_SIZE(msgs)) {
-		v4l2_err(sd, "%s: reading register 0x%x from 0x%x failed\n",
-			 __func__, reg, client->addr);
-	}
+static int tc358748_trace_show(struct seq_file *m, void *unused)
+{
+	struct tc358748_state *state = m->private;
 
-	switch (n) {
-	case 1:
-		values[0] = data[0];
-		break;
-	case 2:
-		values[0] = data[1];
-		values[1] = data[0];
-		break;
-	case 4:
-		values[0] = data[1];
-		values[1] = data[0];
-		values[2] = data[3];
-		values[3] = data[2];
-		break;
-	default:
-		v4l2_info(sd, "unsupported I2C read %d bytes from address 0x%04x\n",
-			  n, reg);
+	return tc358xxx_trace_show(m, &state->trace);
+}
+
+static int tc358748_trace_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tc358748_trace_show, inode->i_private);
+}
+
+static const struct file_operations tc358748_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = tc358748_trace_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int tc358748_timing_cache_show(struct seq_file *m, void *unused)
+{
+	struct tc358748_state *state = m->private;
+	struct tc358748_timing_cache *cache = &state->timing_cache;
+	struct tc358748_timing_entry entries[TC358748_TIMING_CACHE_ENTRIES];
+	unsigned long hits, misses;
+	unsigned int i;
+
+	spin_lock(&cache->lock);
+	hits = cache->hits;
+	misses = cache->misses;
+	memcpy(entries, cache->entries, sizeof(entries));
+	spin_unlock(&cache->lock);
+
+	seq_printf(m, "hits: %lu\nmisses: %lu\n", hits, misses);
+	seq_puts(m, "# code width pclk hblank freq -> freq width lanes fifo\n");
+
+	for (i = 0; i < TC358748_TIMING_CACHE_ENTRIES; i++) {
+		const struct tc358748_timing_entry *e = &entries[i];
+
+		if (!e->valid)
+			continue;
+
+		seq_printf(m, "0x%04x %d %u %u %d -> %d %d %u %u\n",
+			   e->key.code, e->key.width, e->key.pclk,
+			   e->key.hblank, e->key.freq, e->freq, e->width,
+			   e->lanes, e->fifo_size);
 	}
 
-	if (debug < 3)
-		return;
+	return 0;
+}
 
-	switch (n) {
+static int tc358748_timing_cache_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tc358748_timing_cache_show, inode->i_private);
+}
+
+static const struct file_operations tc358748_timing_cache_fops = {
+	.owner = THIS_MODULE,
+	.open = tc358748_timing_cache_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int tc358748_power_show(struct seq_file *m, void *unused)
+{
+	struct tc358748_state *state = m->private;
+	struct tc358748_pwr_stats *stats = &state->pwr_stats;
+	s64 ns[TC358748_PWR_NUM], total = 0;
+	enum tc358748_pwr_phase last;
+	bool on;
+	int err;
+	unsigned int i;
+
+	spin_lock(&stats->lock);
+	on = stats->on;
+	err = stats->err;
+	last = stats->last;
+	memcpy(ns, stats->ns, sizeof(ns));
+	spin_unlock(&stats->lock);
+
+	seq_printf(m, "power %s: %d\n", on ? "on" : "off", err);
+	seq_puts(m, "# phase us\n");
+	for (i = 0; i <= last; i++) {
+		seq_printf(m, "%s %lld\n", tc358748_pwr_names[i],
+			   div_s64(ns[i], NSEC_PER_USEC));
+		total += ns[i];
+	}
+	seq_printf(m, "total %lld\n", div_s64(total, NSEC_PER_USEC));
+
+	return 0;
+}
+
+static int tc358748_power_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tc358748_power_show, inode->i_private);
+}
+
+static const struct file_operations tc358748_power_fops = {
+	.owner = THIS_MODULE,
+	.open = tc358748_power_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * One line per power-on phase, then s_power and s_stream as a whole:
+ * samples, bus transactions, worst case and the log2 histogram.
+ */
+static int tc358748_latency_show(struct seq_file *m, void *unused)
+{
+	struct tc358748_state *state = m->private;
+	struct tc358748_pwr_stats *stats = &state->pwr_stats;
+	struct tc358xxx_lat_hist *hist;
+	unsigned int i;
+
+	hist = kmalloc_array(TC358748_LAT_NUM, sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	spin_lock(&stats->lock);
+	memcpy(hist, stats->hist, TC358748_LAT_NUM * sizeof(*hist));
+	spin_unlock(&stats->lock);
+
+	tc358xxx_lat_show_header(m);
+	for (i = 0; i < TC358748_LAT_NUM; i++)
+		tc358xxx_lat_show(m, i < TC358748_PWR_NUM ?
+				  tc358748_pwr_names[i] :
+				  tc358748_lat_names[i], &hist[i]);
+
+	kfree(hist);
+	return 0;
+}
+
+static int tc358748_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tc358748_latency_show, inode->i_private);
+}
+
+/* Any write clears the histograms */
+static ssize_t tc358748_latency_write(struct file *file,
+				      const char __user *buf, size_t count,
+				      loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct tc358748_state *state = m->private;
+	struct tc358748_pwr_stats *stats = &state->pwr_stats;
+
+	spin_lock(&stats->lock);
+	memset(stats->hist, 0, sizeof(stats->hist));
+	spin_unlock(&stats->lock);
+
+	return count;
+}
+
+static const struct file_operations tc358748_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = tc358748_latency_open,
+	.read = seq_read,
+	.write = tc358748_latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* --------------- i2c helper ------------ */
+
+/* NAKs, lost arbitration and timeouts are worth another try */
+static bool tc358748_i2c_transient(int err)
+{
+	switch (err) {
+	case -EAGAIN:
+	case -EIO:
+	case -ENXIO:
+	case -EREMOTEIO:
+	case -ETIMEDOUT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * i2c_transfer() with a bounded number of retries and exponential backoff
+ * on transient bus errors. Returns 0 or a negative error code.
+ */
+static int tc358748_i2c_transfer(struct tc358748_state *state,
+				 struct i2c_msg *msgs, int num)
+{
+	struct i2c_client *client = state->i2c_client;
+	ktime_t start = ktime_get();
+	unsigned int retry;
+	s64 elapsed;
+	int err;
+
+	for (retry = 0; ; retry++) {
+		err = i2c_transfer(client->adapter, msgs, num);
+		state->xfer_cnt++;
+		if (err == num) {
+			err = 0;
+			break;
+		}
+		if (err >= 0)
+			err = -EIO;
+
+		if (!tc358748_i2c_transient(err) ||
+		    retry == TC358748_I2C_RETRIES) {
+			state->fail_cnt++;
+			break;
+		}
+
+		state->retry_cnt++;
+		usleep_range(TC358748_I2C_BACKOFF_US << retry,
+			     TC358748_I2C_BACKOFF_US << (retry + 1));
+	}
+
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (elapsed > state->max_xfer_ns)
+		state->max_xfer_ns = elapsed;
+
+	return err;
+}
+
+static int i2c_rd(struct v4l2_subdev *sd, u16 reg, u8 *values, u32 n)
+{
+	struct tc358748_state *state = to_state(sd);
+	struct i2c_client *client = state->i2c_client;
+	int err;
+	u8 buf[2] = { reg >> 8, reg & 0xff };
+	u8 data[I2C_MAX_XFER_SIZE];
+
+	struct i2c_msg msgs[] = {
+		{
+			.addr = client->addr,
+			.flags = 0,
+			.len = 2,
+			.buf = buf,
+		},
+		{
+			.addr = client->addr,
+			.flags = I2C_M_RD,
+			.len = n,
+			.buf = data,
+		},
+	};
+
+	err = tc358748_i2c_transfer(state, msgs, ARRAY_SIZE(msgs));
+	if (err) {
+		tc358748_trace(state, 'R', reg, 0, n, err);
+		v4l2_err(sd, "%s: reading register 0x%x from 0x%x failed\n",
+			 __func__, reg, client->addr);
+		return err;
+	}
+
+	switch (n) {
 	case 1:
-		v4l2_info(sd, "I2C read 0x%04x = 0x%02x",
-			  reg, data[0]);
+		values[0] = data[0];
 		break;
 	case 2:
-		v4l2_info(sd, "I2C read 0x%04x = 0x%02x%02x",
-			  reg, data[0], data[1]);
+		values[0] = data[1];
+		values[1] = data[0];
 		break;
 	case 4:
-		v4l2_info(sd, "I2C read 0x%04x = 0x%02x%02x%02x%02x",
-			  reg, data[2], data[3], data[0], data[1]);
+		values[0] = data[1];
+		values[1] = data[0];
+		values[2] = data[3];
+		values[3] = data[2];
 		break;
 	default:
-		v4l2_info(sd, "I2C unsupported read %d bytes from address 0x%04x\n",
+		v4l2_info(sd, "unsupported I2C read %d bytes from address 0x%04x\n",
 			  n, reg);
 	}
+
+	tc358748_trace(state, 'R', reg, tc358xxx_trace_val(values, n), n, 0);
+
+	return 0;
 }
 
-static void i2c_wr(struct v4l2_subdev *sd, u16 reg, u8 *values, u32 n)
+static int i2c_wr(struct v4l2_subdev *sd, u16 reg, u8 *values, u32 n)
 {
 	struct tc358748_state *state = to_state(sd);
 	struct i2c_client *client = state->i2c_client;
@@ -690,90 +1486,677 @@ static void i2c_wr(struct v4l2_subdev *sd, u16 reg, u8 *values, u32 n)
 			  n, reg);
 	}
 
-	err = i2c_transfer(client->adapter, &msg, 1);
-	if (err != 1) {
+	err = tc358748_i2c_transfer(state, &msg, 1);
+	tc358748_trace(state, 'W', reg, tc358xxx_trace_val(values, n), n, err);
+	if (err) {
 		v4l2_err(sd, "%s: writing register 0x%x from 0x%x failed\n",
 			 __func__, reg, client->addr);
-		return;
+		return err;
 	}
 
-	if (debug < 3)
-		return;
+	return 0;
+}
+
+/* --------------- regmap ------------ */
+
+/*
+ * Register descriptors, REF_01 chapter 6. The table is sorted by address.
+ * def is the power-on value the cache starts out with. The chip isn't
+ * necessarily reset before probe and a soft reset keeps the configuration
+ * (REF_01), so without a reset line probe writes the whole cache out once.
+ */
+#define TC358748_REG_RD		BIT(0)
+#define TC358748_REG_WR		BIT(1)
+#define TC358748_REG_RW		(TC358748_REG_RD | TC358748_REG_WR)
+#define TC358748_REG_VOLATILE	BIT(2)	/* changed by the hardware */
+#define TC358748_REG_PRECIOUS	BIT(3)	/* reads have side effects */
+
+struct tc358748_reg_desc {
+	u16 reg;
+	u8 width;	/* bytes on the bus */
+	u8 flags;
+	u32 def;
+};
+
+/* Global and Rx registers are 16 bit wide, the CSI-TX block is 32 bit wide */
+#define TC358748_BLOCK_WIDTH(reg)	((reg) <= 0x00ff ? 2 : 4)
+
+/* A width that doesn't match the block or the reset value breaks the build */
+#define TC358748_REG(_reg, _width, _flags, _def)			\
+	{								\
+		.reg = (_reg) + BUILD_BUG_ON_ZERO((_reg) % (_width)),	\
+		.width = (_width) +					\
+			BUILD_BUG_ON_ZERO(TC358748_BLOCK_WIDTH(_reg) !=	\
+					  (_width)) +			\
+			BUILD_BUG_ON_ZERO((u64)(_def) >> (8 * (_width))), \
+		.flags = (_flags),					\
+		.def = (_def),						\
+	}
+
+static const struct tc358748_reg_desc tc358748_regs[] = {
+	/* Global */
+	TC358748_REG(CHIPID, 2, TC358748_REG_RD, 0x4400),
+	TC358748_REG(SYSCTL, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(CONFCTL, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(FIFOCTL, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(DATAFMT, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(MCLKCTL, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(PLLCTL0, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(PLLCTL1, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(CLKCTL, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(WORDCNT, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(PP_MISC, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(CSI2TX_DATA_TYPE, 2, TC358748_REG_RW, 0x0000),
+	/* Rx control and status */
+	TC358748_REG(MIPI_PHY_STATUS, 2,
+		     TC358748_REG_RD | TC358748_REG_VOLATILE, 0x0000),
+	TC358748_REG(CSI2_ERROR_STATUS, 2,
+		     TC358748_REG_RW | TC358748_REG_VOLATILE, 0x0000),
+	TC358748_REG(CSI2_ERR_EN, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(CSI2_IDID_ERROR, 2,
+		     TC358748_REG_RW | TC358748_REG_VOLATILE, 0x0000),
+	TC358748_REG(DBG_ACT_LINE_CNT, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(DBG_LINE_WIDTH, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(DBG_VERT_BLANK_LINE_CNT, 2, TC358748_REG_RW, 0x0000),
+	TC358748_REG(DBG_VIDEO_DATA, 2, TC358748_REG_RW |
+		     TC358748_REG_VOLATILE | TC358748_REG_PRECIOUS, 0x0000),
+	TC358748_REG(FIFOSTATUS, 2,
+		     TC358748_REG_RD | TC358748_REG_VOLATILE, 0x0000),
+	/* Tx D-PHY */
+	TC358748_REG(CLW_CNTRL, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(D0W_CNTRL, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(D1W_CNTRL, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(D2W_CNTRL, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(D3W_CNTRL, 4, TC358748_REG_RW, 0x00000000),
+	/* Tx PPI */
+	TC358748_REG(STARTCNTRL, 4,
+		     TC358748_REG_RW | TC358748_REG_VOLATILE, 0x00000000),
+	TC358748_REG(LINEINITCNT, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(LPTXTIMECNT, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(TCLK_HEADERCNT, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(TCLK_TRAILCNT, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(THS_HEADERCNT, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(TWAKEUP, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(TCLK_POSTCNT, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(THS_TRAILCNT, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(HSTXVREGCNT, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(HSTXVREGEN, 4, TC358748_REG_RW, 0x00000000),
+	TC358748_REG(TXOPTIONCNTRL, 4, TC358748_REG_RW, 0x00000000),
+	/*
+	 * Tx control. CSI_CONTROL and the interrupt enables are only
+	 * written indirectly through CSI_CONFW.
+	 */
+	TC358748_REG(CSI_CONTROL, 4,
+		     TC358748_REG_RD | TC358748_REG_VOLATILE, 0x00000000),
+	TC358748_REG(CSI_STATUS, 4,
+		     TC358748_REG_RD | TC358748_REG_VOLATILE, 0x00000000),
+	TC358748_REG(CSI_INT, 4,
+		     TC358748_REG_RD | TC358748_REG_VOLATILE, 0x00000000),
+	TC358748_REG(CSI_INT_ENA, 4,
+		     TC358748_REG_RD | TC358748_REG_VOLATILE, 0x00000000),
+	TC358748_REG(CSI_ERR, 4,
+		     TC358748_REG_RD | TC358748_REG_VOLATILE, 0x00000000),
+	TC358748_REG(CSI_ERR_INTENA, 4,
+		     TC358748_REG_RD | TC358748_REG_VOLATILE, 0x00000000),
+	TC358748_REG(CSI_ERR_HALT, 4,
+		     TC358748_REG_RD | TC358748_REG_VOLATILE, 0x00000000),
+	TC358748_REG(CSI_CONFW, 4,
+		     TC358748_REG_WR | TC358748_REG_VOLATILE, 0x00000000),
+	TC358748_REG(CSIRESET, 4,
+		     TC358748_REG_RW | TC358748_REG_VOLATILE, 0x00000000),
+	TC358748_REG(CSI_INT_CLR, 4,
+		     TC358748_REG_WR | TC358748_REG_VOLATILE, 0x00000000),
+	TC358748_REG(CSI_START, 4,
+		     TC358748_REG_RW | TC358748_REG_VOLATILE, 0x00000000),
+};
+
+static int tc358748_reg_desc_cmp(const void *key, const void *elt)
+{
+	const struct tc358748_reg_desc *desc = elt;
+	unsigned int reg = *(const unsigned int *)key;
+
+	if (reg < desc->reg)
+		return -1;
+	return reg > desc->reg;
+}
+
+/* Returns NULL for addresses without a documented register */
+static const struct tc358748_reg_desc *tc358748_reg_desc(unsigned int reg)
+{
+	return bsearch(&reg, tc358748_regs, ARRAY_SIZE(tc358748_regs),
+		       sizeof(tc358748_regs[0]), tc358748_reg_desc_cmp);
+}
+
+static bool tc358748_reg_is(unsigned int reg, u8 flags)
+{
+	const struct tc358748_reg_desc *desc = tc358748_reg_desc(reg);
+
+	return desc && (desc->flags & flags);
+}
+
+/* Registers the cache holds: read back and written, not changed by the chip */
+static bool tc358748_reg_cached(const struct tc358748_reg_desc *desc)
+{
+	return (desc->flags & TC358748_REG_RW) == TC358748_REG_RW &&
+	       !(desc->flags & TC358748_REG_VOLATILE);
+}
+
+static bool tc358748_readable_reg(struct device *dev, unsigned int reg)
+{
+	return tc358748_reg_is(reg, TC358748_REG_RD);
+}
+
+static bool tc358748_writeable_reg(struct device *dev, unsigned int reg)
+{
+	return tc358748_reg_is(reg, TC358748_REG_WR);
+}
+
+static bool tc358748_volatile_reg(struct device *dev, unsigned int reg)
+{
+	return tc358748_reg_is(reg, TC358748_REG_VOLATILE);
+}
+
+static bool tc358748_precious_reg(struct device *dev, unsigned int reg)
+{
+	return tc358748_reg_is(reg, TC358748_REG_PRECIOUS);
+}
+
+/* Bus width of a register known to regmap */
+static u8 tc358748_reg_width(unsigned int reg)
+{
+	return tc358748_reg_desc(reg)->width;
+}
+
+/*
+ * The register width depends on the address, so regmap uses the widest one
+ * and the bus callbacks pick the right width for each register.
+ */
+static int tc358748_regmap_reg_read(void *context, unsigned int reg,
+				    unsigned int *val)
+{
+	struct tc358748_state *state = context;
+	__le32 raw = 0;
+	int err;
+
+	err = i2c_rd(&state->sd, reg, (u8 __force *)&raw,
+		     tc358748_reg_width(reg));
+	if (err)
+		return err;
+
+	*val = le32_to_cpu(raw);
+	return 0;
+}
+
+static int tc358748_batch_xfer(struct v4l2_subdev *sd,
+			       struct tc358748_reg_batch *batch);
+
+static int tc358748_regmap_reg_write(void *context, unsigned int reg,
+				     unsigned int val)
+{
+	struct tc358748_state *state = context;
+	struct tc358748_reg_batch *batch = state->batch;
+	__le32 raw = cpu_to_le32(val);
+	int err;
+
+	/* a batch is being flushed, the bus transfer is done by the batch */
+	if (batch) {
+		/* regcache_sync() passes on more writes than a batch holds */
+		if (batch->num_regs == ARRAY_SIZE(batch->regs)) {
+			err = tc358748_batch_xfer(&state->sd, batch);
+			if (err)
+				return err;
+		}
+		batch->regs[batch->num_regs].reg = reg;
+		batch->regs[batch->num_regs].val = val;
+		batch->regs[batch->num_regs].len = tc358748_reg_width(reg);
+		batch->num_regs++;
+		return 0;
+	}
+
+	return i2c_wr(&state->sd, reg, (u8 __force *)&raw,
+		      tc358748_reg_width(reg));
+}
+
+static const struct regmap_config tc358748_regmap_config = {
+	.reg_bits = 16,
+	.val_bits = 32,
+	.max_register = CSI_START,
+	.reg_read = tc358748_regmap_reg_read,
+	.reg_write = tc358748_regmap_reg_write,
+	.readable_reg = tc358748_readable_reg,
+	.writeable_reg = tc358748_writeable_reg,
+	.volatile_reg = tc358748_volatile_reg,
+	.precious_reg = tc358748_precious_reg,
+	.cache_type = REGCACHE_RBTREE,
+};
+
+/*
+ * The cache starts out with the power-on values, so a write can be compared
+ * with it without reading the register first.
+ */
+static int tc358748_regmap_init(struct tc358748_state *state)
+{
+	struct device *dev = &state->i2c_client->dev;
+	struct regmap_config config = tc358748_regmap_config;
+	struct reg_default *defaults;
+	unsigned int i, num = 0;
+
+	defaults = kcalloc(ARRAY_SIZE(tc358748_regs), sizeof(*defaults),
+			   GFP_KERNEL);
+	if (!defaults)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(tc358748_regs); i++) {
+		if (!tc358748_reg_cached(&tc358748_regs[i]))
+			continue;
+		defaults[num].reg = tc358748_regs[i].reg;
+		defaults[num].def = tc358748_regs[i].def;
+		num++;
+	}
+
+	/* regmap keeps its own copy */
+	config.reg_defaults = defaults;
+	config.num_reg_defaults = num;
+	state->regmap = devm_regmap_init(dev, NULL, state, &config);
+	kfree(defaults);
+
+	return PTR_ERR_OR_ZERO(state->regmap);
+}
+
+/*
+ * Put the power-on values of the cached registers in [min, max] back after
+ * the chip reset them. Only the cache is written, which marks it dirty: the
+ * next sync writes all of it back.
+ */
+static void tc358748_regcache_reset(struct tc358748_state *state,
+				    unsigned int min, unsigned int max)
+{
+	const struct tc358748_reg_desc *desc;
+	unsigned int i;
+
+	regcache_cache_only(state->regmap, true);
+	for (i = 0; i < ARRAY_SIZE(tc358748_regs); i++) {
+		desc = &tc358748_regs[i];
+		if (desc->reg >= min && desc->reg <= max &&
+		    tc358748_reg_cached(desc))
+			regmap_write(state->regmap, desc->reg, desc->def);
+	}
+	regcache_cache_only(state->regmap, false);
+}
+
+static noinline int i2c_rdreg(struct v4l2_subdev *sd, u16 reg, u32 *val)
+{
+	struct tc358748_state *state = to_state(sd);
+	unsigned int tmp;
+	int err;
+
+	err = regmap_read(state->regmap, reg, &tmp);
+	if (err)
+		return err;
+
+	*val = tmp;
+	return 0;
+}
+
+/*
+ * Writes that wouldn't change a cached register are dropped. The cache holds
+ * the register from probe on, it is only read back from the chip after a
+ * failure dropped it. Volatile and write-only registers are triggers or not
+ * cached, they always go out.
+ */
+static noinline int i2c_wrreg(struct v4l2_subdev *sd, u16 reg, u32 val)
+{
+	struct tc358748_state *state = to_state(sd);
+	unsigned int cur;
+
+	if (tc358748_reg_is(reg, TC358748_REG_RD) &&
+	    !tc358748_reg_is(reg, TC358748_REG_VOLATILE) &&
+	    !regmap_read(state->regmap, reg, &cur) && cur == val)
+		return 0;
+
+	return regmap_write(state->regmap, reg, val);
+}
+
+/*
+ * Value returning reads are only used for status reporting, they read 0
+ * on bus errors. Use i2c_rdreg() where the error matters.
+ */
+static u16 __maybe_unused i2c_rd8(struct v4l2_subdev *sd, u16 reg)
+{
+	u32 val = 0;
+
+	i2c_rdreg(sd, reg, &val);
+
+	return val & 0xff;
+}
+
+static u16 __maybe_unused i2c_rd16(struct v4l2_subdev *sd, u16 reg)
+{
+	u32 val = 0;
+
+	i2c_rdreg(sd, reg, &val);
+
+	return val;
+}
+
+static u32 __maybe_unused i2c_rd32(struct v4l2_subdev *sd, u16 reg)
+{
+	u32 val = 0;
 
+	i2c_rdreg(sd, reg, &val);
+
+	return val;
+}
+
+static int __maybe_unused i2c_wr8(struct v4l2_subdev *sd, u16 reg, u16 val)
+{
+	return i2c_wrreg(sd, reg, val);
+}
+
+static int i2c_wr16(struct v4l2_subdev *sd, u16 reg, u16 val)
+{
+	return i2c_wrreg(sd, reg, val);
+}
+
+/* Bits cleared in mask are replaced by val, skipped if nothing changes */
+static int i2c_wr16_and_or(struct v4l2_subdev *sd, u16 reg, u32 mask, u16 val)
+{
+	struct tc358748_state *state = to_state(sd);
+	u16 m = (u16) mask;
+
+	return regmap_update_bits(state->regmap, reg, (u16)(~m | val), val);
+}
+
+static int i2c_wr32(struct v4l2_subdev *sd, u16 reg, u32 val)
+{
+	return i2c_wrreg(sd, reg, val);
+}
+
+/* --------------- register batch --------------- */
+
+static void tc358748_batch_init(struct tc358748_reg_batch *batch)
+{
+	batch->num = 0;
+	batch->num_regs = 0;
+	batch->writes = 0;
+	batch->err = 0;
+}
+
+/* Pack a register value into the chip's on-wire byte order */
+static void tc358748_pack_val(u8 *buf, u32 val, u32 n)
+{
 	switch (n) {
 	case 1:
-		v4l2_info(sd, "I2C write 0x%04x = 0x%02x", reg, data[2 + 0]);
+		buf[0] = val & 0xff;
 		break;
 	case 2:
-		v4l2_info(sd, "I2C write 0x%04x = 0x%02x%02x", reg, data[2 + 0],
-			  data[2 + 1]);
+		buf[0] = (val >> 8) & 0xff;
+		buf[1] = val & 0xff;
 		break;
 	case 4:
-		v4l2_info(sd, "I2C write 0x%04x = 0x%02x%02x%02x%02x", reg,
-			  data[2 + 2], data[2 + 3], data[2 + 0], data[2 + 1]);
+		buf[0] = (val >> 8) & 0xff;
+		buf[1] = val & 0xff;
+		buf[2] = (val >> 24) & 0xff;
+		buf[3] = (val >> 16) & 0xff;
 		break;
-	default:
-		v4l2_info(sd, "I2C unsupported write %d bytes from address 0x%04x\n",
-			  n, reg);
 	}
 }
 
-static noinline u32 i2c_rdreg(struct v4l2_subdev *sd, u16 reg, u32 n)
+/*
+ * Send the writes regmap passed on. Runs of registers at adjacent addresses
+ * are merged into a single auto-incrementing write, each run is sent as its
+ * own message of one multi-message i2c_transfer().
+ */
+static int tc358748_batch_xfer(struct v4l2_subdev *sd,
+			       struct tc358748_reg_batch *batch)
+{
+	struct tc358748_state *state = to_state(sd);
+	struct i2c_client *client = state->i2c_client;
+	struct i2c_msg msgs[TC358748_BATCH_MAX_MSGS];
+	u8 data[TC358748_BATCH_MAX_MSGS * (2 + 4)];
+	unsigned int i, num_msgs = 0;
+	u8 *buf = data;
+	int err;
+
+	if (!batch->num_regs)
+		return 0;
+
+	for (i = 0; i < batch->num_regs; i++) {
+		u16 reg = batch->regs[i].reg;
+		u8 len = batch->regs[i].len;
+
+		/* continue the current burst if this register is adjacent */
+		if (i && reg == batch->regs[i - 1].reg +
+			       batch->regs[i - 1].len) {
+			tc358748_pack_val(buf, batch->regs[i].val, len);
+			msgs[num_msgs - 1].len += len;
+		} else {
+			buf[0] = reg >> 8;
+			buf[1] = reg & 0xff;
+			tc358748_pack_val(&buf[2], batch->regs[i].val, len);
+
+			msgs[num_msgs].addr = client->addr;
+			msgs[num_msgs].flags = 0;
+			msgs[num_msgs].len = 2 + len;
+			msgs[num_msgs].buf = buf;
+			num_msgs++;
+			buf += 2;
+		}
+		buf += len;
+	}
+
+	err = tc358748_i2c_transfer(state, msgs, num_msgs);
+	for (i = 0; i < batch->num_regs; i++)
+		tc358748_trace(state, 'W', batch->regs[i].reg,
+			       batch->regs[i].val, batch->regs[i].len, err);
+	if (err) {
+		v4l2_err(sd, "%s: writing %u registers from 0x%04x failed\n",
+			 __func__, batch->num_regs, batch->regs[0].reg);
+		batch->num_regs = 0;
+		return err;
+	}
+
+	batch->num_regs = 0;
+	return 0;
+}
+
+/*
+ * Flush the batch. The writes go through regmap, which updates the cache
+ * and hands them back to tc358748_batch_xfer() for the bus transfer.
+ */
+static int tc358748_batch_flush(struct v4l2_subdev *sd,
+				struct tc358748_reg_batch *batch)
 {
-	__le32 val = 0;
+	struct tc358748_state *state = to_state(sd);
+	unsigned int i;
+	int err;
 
-	i2c_rd(sd, reg, (u8 __force *)&val, n);
+	if (batch->err || !batch->num)
+		return batch->err;
+
+	state->batch = batch;
+	err = regmap_multi_reg_write(state->regmap, batch->seq, batch->num);
+	state->batch = NULL;
+	if (!err)
+		err = tc358748_batch_xfer(sd, batch);
+
+	/* the cache doesn't match the hardware anymore */
+	if (err)
+		for (i = 0; i < batch->num; i++)
+			regcache_drop_region(state->regmap, batch->seq[i].reg,
+					     batch->seq[i].reg);
 
-	return le32_to_cpu(val);
+	batch->num = 0;
+	batch->num_regs = 0;
+	batch->err = err;
+	return err;
 }
 
-static noinline void i2c_wrreg(struct v4l2_subdev *sd, u16 reg, u32 val, u32 n)
+static void tc358748_batch_add(struct v4l2_subdev *sd,
+			       struct tc358748_reg_batch *batch,
+			       u16 reg, u32 val)
 {
-	__le32 raw = cpu_to_le32(val);
+	if (batch->num == TC358748_BATCH_MAX_MSGS)
+		tc358748_batch_flush(sd, batch);
+
+	/* the sequence is aborted, drop the remaining writes */
+	if (batch->err)
+		return;
 
-	i2c_wr(sd, reg, (u8 __force *)&raw, n);
+	batch->seq[batch->num].reg = reg;
+	batch->seq[batch->num].def = val;
+	batch->seq[batch->num].delay_us = 0;
+	batch->num++;
+	batch->writes++;
 }
 
-static u16 __maybe_unused i2c_rd8(struct v4l2_subdev *sd, u16 reg)
+static inline void tc358748_batch_wr16(struct v4l2_subdev *sd,
+				       struct tc358748_reg_batch *batch,
+				       u16 reg, u16 val)
 {
-	return i2c_rdreg(sd, reg, 1);
+	tc358748_batch_add(sd, batch, reg, val);
 }
 
-static u16 __maybe_unused i2c_rd16(struct v4l2_subdev *sd, u16 reg)
+static inline void tc358748_batch_wr32(struct v4l2_subdev *sd,
+				       struct tc358748_reg_batch *batch,
+				       u16 reg, u32 val)
 {
-	return i2c_rdreg(sd, reg, 2);
+	tc358748_batch_add(sd, batch, reg, val);
 }
 
-static u32 __maybe_unused i2c_rd32(struct v4l2_subdev *sd, u16 reg)
+/* Report how many bus transactions an operation needed */
+static void tc358748_batch_stats(struct v4l2_subdev *sd, const char *op,
+				 struct tc358748_reg_batch *batch,
+				 unsigned long xfer_start)
 {
-	return i2c_rdreg(sd, reg, 4);
+	struct tc358748_state *state = to_state(sd);
+
+	dev_dbg(&state->i2c_client->dev,
+		"%s: %u register writes in %lu bus transactions\n", op,
+		batch->writes, state->xfer_cnt - xfer_start);
 }
 
-static void __maybe_unused i2c_wr8(struct v4l2_subdev *sd, u16 reg, u16 val)
+/* --------------- register image --------------- */
+
+static const u16 tc358748_cfg_regs[TC358748_CFG_NUM] = {
+	[TC358748_CFG_FIFOCTL]		= FIFOCTL,
+	[TC358748_CFG_WORDCNT]		= WORDCNT,
+	[TC358748_CFG_DATAFMT]		= DATAFMT,
+	[TC358748_CFG_CONFCTL]		= CONFCTL,
+	[TC358748_CFG_PLLCTL0]		= PLLCTL0,
+	[TC358748_CFG_PLLCTL1]		= PLLCTL1,
+	[TC358748_CFG_LINEINITCNT]	= LINEINITCNT,
+	[TC358748_CFG_LPTXTIMECNT]	= LPTXTIMECNT,
+	[TC358748_CFG_TCLK_HEADERCNT]	= TCLK_HEADERCNT,
+	[TC358748_CFG_TCLK_TRAILCNT]	= TCLK_TRAILCNT,
+	[TC358748_CFG_THS_HEADERCNT]	= THS_HEADERCNT,
+	[TC358748_CFG_TWAKEUP]		= TWAKEUP,
+	[TC358748_CFG_TCLK_POSTCNT]	= TCLK_POSTCNT,
+	[TC358748_CFG_THS_TRAILCNT]	= THS_TRAILCNT,
+	[TC358748_CFG_TXOPTIONCNTRL]	= TXOPTIONCNTRL,
+};
+
+static void tc358748_build_cfg(struct tc358748_state *state, u32 *cfg)
 {
-	i2c_wrreg(sd, reg, val, 1);
+	const struct tc358748_mbus_fmt *fmt =
+		tc358748_get_format(state->fmt.code);
+	struct tc358748_csi_param *csi = tc358748_g_cur_csi_settings(state);
+
+	cfg[TC358748_CFG_FIFOCTL] = state->vb_fifo;
+	cfg[TC358748_CFG_WORDCNT] = (state->fmt.width * fmt->bpp) / 8;
+
+	cfg[TC358748_CFG_DATAFMT] = DATAFMT_PDFMT_SET(fmt->pdformat);
+	/* CONFCTL_DATALANE_<n> is n - 1 */
+	cfg[TC358748_CFG_CONFCTL] = CONFCTL_PDATAF_SET(fmt->pdataf) |
+		((state->csi_lanes - 1) & CONFCTL_DATALANE_MASK);
+
+	cfg[TC358748_CFG_PLLCTL0] = PLLCTL0_PLL_PRD_SET(csi->pll_prd) |
+				    PLLCTL0_PLL_FBD_SET(csi->pll_fbd);
+	cfg[TC358748_CFG_PLLCTL1] = PLLCTL1_PLL_FRS_SET(csi->speed_range) |
+				    PLLCTL1_RESETB_MASK | PLLCTL1_PLL_EN_MASK |
+				    PLLCTL1_CKEN_MASK;
+
+	cfg[TC358748_CFG_LINEINITCNT] = csi->lineinitcnt;
+	cfg[TC358748_CFG_LPTXTIMECNT] = csi->lptxtimecnt;
+	cfg[TC358748_CFG_TCLK_HEADERCNT] =
+		TCLK_HEADERCNT_TCLK_ZEROCNT_SET(csi->tclk_zerocnt) |
+		TCLK_HEADERCNT_TCLK_PREPARECNT_SET(csi->tclk_preparecnt);
+	cfg[TC358748_CFG_TCLK_TRAILCNT] = csi->tclk_trailcnt;
+	cfg[TC358748_CFG_THS_HEADERCNT] =
+		THS_HEADERCNT_THS_ZEROCNT_SET(csi->ths_zerocnt) |
+		THS_HEADERCNT_THS_PREPARECNT_SET(csi->ths_preparecnt);
+	cfg[TC358748_CFG_TWAKEUP] = csi->twakeupcnt;
+	cfg[TC358748_CFG_TCLK_POSTCNT] = csi->tclk_postcnt;
+	cfg[TC358748_CFG_THS_TRAILCNT] = csi->ths_trailcnt;
+	cfg[TC358748_CFG_TXOPTIONCNTRL] = csi->is_continuous_clk ?
+					  TXOPTIONCNTRL_CONTCLKMODE_MASK : 0;
 }
 
-static void i2c_wr16(struct v4l2_subdev *sd, u16 reg, u16 val)
+/* Entries of cfg the chip doesn't have yet */
+static unsigned long tc358748_cfg_dirty(struct tc358748_state *state,
+					const u32 *cfg)
 {
-	i2c_wrreg(sd, reg, val, 2);
+	unsigned long dirty = ~state->cfg_valid &
+			      GENMASK(TC358748_CFG_NUM - 1, 0);
+	unsigned int i;
+
+	for (i = 0; i < TC358748_CFG_NUM; i++)
+		if (state->cfg[i] != cfg[i])
+			dirty |= BIT(i);
+
+	return dirty;
 }
 
-static void i2c_wr16_and_or(struct v4l2_subdev *sd, u16 reg, u32 mask, u16 val)
+/* Record the entries in mask as written */
+static void tc358748_cfg_commit(struct tc358748_state *state, const u32 *cfg,
+				unsigned long mask)
 {
-	u16 m = (u16) mask;
+	unsigned int i;
 
-	i2c_wrreg(sd, reg, (i2c_rd16(sd, reg) & m) | val, 2);
+	for_each_set_bit(i, &mask, TC358748_CFG_NUM)
+		state->cfg[i] = cfg[i];
+	state->cfg_valid |= mask;
 }
 
-static void i2c_wr32(struct v4l2_subdev *sd, u16 reg, u32 val)
+/*
+ * Write back the registers changed while the cache was cache-only, merged
+ * into bursts the same way as a batch. With sync_all set the whole cache
+ * goes out, the power-on values included.
+ */
+static int tc358748_regcache_sync(struct v4l2_subdev *sd)
 {
-	i2c_wrreg(sd, reg, val, 4);
+	struct tc358748_state *state = to_state(sd);
+	unsigned long xfers = state->xfer_cnt;
+	struct tc358748_reg_batch batch;
+	int err;
+
+	tc358748_batch_init(&batch);
+	regcache_cache_only(state->regmap, false);
+
+	state->batch = &batch;
+	if (state->sync_all)
+		err = regcache_sync_region(state->regmap, 0, CSI_START);
+	else
+		err = regcache_sync(state->regmap);
+	state->batch = NULL;
+	if (!err)
+		err = tc358748_batch_xfer(sd, &batch);
+
+	/*
+	 * Retry the whole cache next time. regcache_mark_dirty() would skip
+	 * the registers at their power-on value, which may not be on the chip.
+	 */
+	state->sync_all = err;
+
+	dev_dbg(&state->i2c_client->dev, "%s: %lu bus transactions: %d\n",
+		__func__, state->xfer_cnt - xfers, err);
+
+	return err;
 }
 
 /* --------------- init --------------- */
 
-static void
+static int
 tc358748_wr_csi_control(struct v4l2_subdev *sd, int val)
 {
 	struct tc358748_state *state = to_state(sd);
@@ -784,159 +2167,446 @@ tc358748_wr_csi_control(struct v4l2_subdev *sd, int val)
 		val;
 
 	dev_dbg(&state->i2c_client->dev, "CSI_CONFW 0x%04x\n", _val);
-	i2c_wr32(sd, CSI_CONFW, _val);
+	return i2c_wr32(sd, CSI_CONFW, _val);
+}
+
+static inline int tc358748_sleep_mode(struct v4l2_subdev *sd, int enable)
+{
+	return i2c_wr16_and_or(sd, SYSCTL, ~SYSCTL_SLEEP_MASK,
+			       enable ? SYSCTL_SLEEP_MASK : 0);
 }
 
-static inline void tc358748_sleep_mode(struct v4l2_subdev *sd, int enable)
+static inline int tc358748_sreset(struct v4l2_subdev *sd)
 {
-	i2c_wr16_and_or(sd, SYSCTL, ~SYSCTL_SLEEP_MASK,
-			enable ? SYSCTL_SLEEP_MASK : 0);
+	int err;
+
+	err = i2c_wr16(sd, SYSCTL, SYSCTL_SRESET_MASK);
+	if (err)
+		return err;
+	usleep_range(TC358748_SRESET_US, 2 * TC358748_SRESET_US);
+	return i2c_wr16(sd, SYSCTL, 0);
 }
 
-static inline void tc358748_sreset(struct v4l2_subdev *sd)
+/*
+ * With FRMSTOP set the parallel port stops at the end of the current frame
+ * and the CSI-TX goes idle once the FIFO has drained. TXACT also drops
+ * between packets, so it only counts once it stayed low for two line times.
+ * The vertical blanking isn't known, allow for two active frame times.
+ * A stream that doesn't stop in time is torn down anyway.
+ */
+static void tc358748_wait_frame_end(struct v4l2_subdev *sd)
 {
-	i2c_wr16(sd, SYSCTL, SYSCTL_SRESET_MASK);
-	udelay(10);
-	i2c_wr16(sd, SYSCTL, 0);
+	struct tc358748_state *state = to_state(sd);
+	struct device *dev = &state->i2c_client->dev;
+	const struct tc358748_mbus_fmt *format =
+		tc358748_get_format(state->fmt.code);
+	u64 timeout_us = TC358748_FRMSTOP_DEF_TIMEOUT_US;
+	u64 line_ns = 0;
+	ktime_t start, now, idle = 0;
+	u32 csi_status;
+	int err;
+
+	/* a pixel takes ppp parallel clocks, as in the FIFO sizing */
+	if (state->pclk && format) {
+		line_ns = div_u64((u64)(state->fmt.width * format->ppp +
+					state->hblank) * NSEC_PER_SEC,
+				  state->pclk);
+		timeout_us = 2 * div_u64(line_ns * state->fmt.height,
+					 NSEC_PER_USEC) +
+			     TC358748_FRMSTOP_POLL_US;
+	}
+
+	start = ktime_get();
+	for (;;) {
+		err = i2c_rdreg(sd, CSI_STATUS, &csi_status);
+		if (err)
+			return;
+
+		now = ktime_get();
+		if (csi_status & CSI_STATUS_S_TXACT_MASK)
+			idle = 0;
+		else if (!idle)
+			idle = now;
+		else if (ktime_to_ns(ktime_sub(now, idle)) >= 2 * line_ns)
+			break;
+
+		if (ktime_us_delta(now, start) > timeout_us) {
+			dev_warn(dev, "no frame end after %llu us, CSI_STATUS 0x%04x FIFOSTATUS 0x%04x\n",
+				 timeout_us, csi_status,
+				 i2c_rd16(sd, FIFOSTATUS));
+			return;
+		}
+
+		usleep_range(TC358748_FRMSTOP_POLL_US,
+			     2 * TC358748_FRMSTOP_POLL_US);
+	}
+
+	dev_dbg(dev, "frame end after %lld us\n", ktime_us_delta(now, start));
 }
 
-static inline void tc358748_enable_stream(struct v4l2_subdev *sd, int enable)
+static int tc358748_set_test_pattern(struct v4l2_subdev *sd);
+
+static int tc358748_enable_stream(struct v4l2_subdev *sd, int enable)
 {
 	struct tc358748_state *state = to_state(sd);
+	int err;
 
 	dev_dbg(&state->i2c_client->dev, "%sable\n", enable ? "en" : "dis");
 
-	mutex_lock(&state->confctl_mutex);
+	/* stream off stopped the generator, restart it with a fresh line */
+	if (enable && state->test_pattern) {
+		err = tc358748_set_test_pattern(sd);
+		if (err)
+			return err;
+	}
+
+	/* let the current frame finish before the teardown */
 	if (!enable) {
-		i2c_wr16_and_or(sd, PP_MISC, ~PP_MISC_FRMSTOP_MASK,
-				PP_MISC_FRMSTOP_MASK);
-		i2c_wr16_and_or(sd, CONFCTL, ~CONFCTL_PPEN_MASK, 0);
-		i2c_wr16_and_or(sd, PP_MISC, ~PP_MISC_RSTPTR_MASK,
-				PP_MISC_RSTPTR_MASK);
+		err = i2c_wr16_and_or(sd, PP_MISC, ~PP_MISC_FRMSTOP_MASK,
+				      PP_MISC_FRMSTOP_MASK);
+		if (err)
+			return err;
+		tc358748_wait_frame_end(sd);
+	}
 
-		i2c_wr32(sd, CSIRESET, (CSIRESET_RESET_CNF_MASK |
+	mutex_lock(&state->confctl_mutex);
+	if (!enable) {
+		err = i2c_wr16_and_or(sd, CONFCTL, ~CONFCTL_PPEN_MASK, 0);
+		if (!err)
+			err = i2c_wr16_and_or(sd, PP_MISC, ~PP_MISC_RSTPTR_MASK,
+					      PP_MISC_RSTPTR_MASK);
+		if (!err)
+			err = i2c_wr32(sd, CSIRESET,
+				       (CSIRESET_RESET_CNF_MASK |
 					CSIRESET_RESET_MODULE_MASK));
-		i2c_wr16(sd, DBG_ACT_LINE_CNT, 0);
+		/*
+		 * The CSI-TX configuration is back at its reset values. If
+		 * the teardown failed that isn't known, read it back instead.
+		 */
+		if (!err)
+			tc358748_regcache_reset(state, 0x0100, 0x05ff);
+		else
+			regcache_drop_region(state->regmap, 0x0100, 0x05ff);
+		state->cfg_valid &= ~TC358748_CFG_CSI;
+		if (!err)
+			err = i2c_wr16(sd, DBG_ACT_LINE_CNT, 0);
 	} else {
-		i2c_wr16(sd, PP_MISC, 0);
-		i2c_wr16_and_or(sd, CONFCTL, ~CONFCTL_PPEN_MASK,
-				CONFCTL_PPEN_MASK);
+		err = i2c_wr16(sd, PP_MISC, 0);
+		if (!err)
+			err = i2c_wr16_and_or(sd, CONFCTL, ~CONFCTL_PPEN_MASK,
+					      CONFCTL_PPEN_MASK);
 	}
 	mutex_unlock(&state->confctl_mutex);
+
+	return err;
 }
 
-static void tc358748_set_pll(struct v4l2_subdev *sd)
+/* Program the PLL, the clocks stay off until tc358748_pll_lock() */
+static int tc358748_set_pll(struct v4l2_subdev *sd, const u32 *cfg)
 {
 	struct tc358748_state *state = to_state(sd);
 	struct tc358748_csi_param *csi_setting =
 		tc358748_g_cur_csi_settings(state);
-	struct device *dev = &state->i2c_client->dev;
-	u16 pllctl0 = i2c_rd16(sd, PLLCTL0);
-	u16 pllctl1 = i2c_rd16(sd, PLLCTL1);
-	u16 pll_frs = csi_setting->speed_range;
-	u16 pllctl0_new;
+	u16 pllctl1_mask = (u16) ~(PLLCTL1_PLL_FRS_MASK | PLLCTL1_RESETB_MASK |
+				   PLLCTL1_PLL_EN_MASK | PLLCTL1_CKEN_MASK);
+	int err;
 
-	/*
-	 * Calculation:
-	 * speed_per_lane = (pllinclk_hz * (fbd + 1)) / 2^frs
-	 *
-	 * Calculation used by REF_02:
-	 * speed_per_lane = (pllinclk_hz * fbd) / 2^frs
-	 */
-	state->pll_fbd = csi_setting->speed_per_lane / state->pllinclk_hz;
-	state->pll_fbd <<= pll_frs;
+	/* solved by tc358748_solve_pll() for this link frequency */
+	state->pll_prd = csi_setting->pll_prd;
+	state->pll_fbd = csi_setting->pll_fbd;
+	state->pllinclk_hz = state->refclk_hz / state->pll_prd;
 
-	pllctl0_new = PLLCTL0_PLL_PRD_SET(state->pll_prd) |
-		      PLLCTL0_PLL_FBD_SET(state->pll_fbd);
+	dev_dbg(&state->i2c_client->dev, "updating PLL clock\n");
+	err = i2c_wr16(sd, PLLCTL0, cfg[TC358748_CFG_PLLCTL0]);
+	if (!err)
+		err = i2c_wr16_and_or(sd, PLLCTL1, pllctl1_mask,
+				      cfg[TC358748_CFG_PLLCTL1] &
+				      ~PLLCTL1_CKEN_MASK);
 
-	/*
-	 * Only rewrite when needed (new value or disabled), since rewriting
-	 * triggers another format change event.
-	 */
-	if ((pllctl0 != pllctl0_new) ||
-	    ((pllctl1 & PLLCTL1_PLL_EN_MASK) == 0)) {
-		u16 pllctl1_mask = (u16) ~(PLLCTL1_PLL_FRS_MASK |
-					   PLLCTL1_RESETB_MASK  |
-					   PLLCTL1_PLL_EN_MASK);
-		u16 pllctl1_val = PLLCTL1_PLL_FRS_SET(pll_frs) |
-				  PLLCTL1_RESETB_MASK | PLLCTL1_PLL_EN_MASK;
+	return err;
+}
 
-		dev_dbg(dev, "updating PLL clock\n");
-		i2c_wr16(sd, PLLCTL0, pllctl0_new);
-		i2c_wr16_and_or(sd, PLLCTL1, pllctl1_mask, pllctl1_val);
-		udelay(1000);
-		i2c_wr16_and_or(sd, PLLCTL1, ~PLLCTL1_CKEN_MASK,
-				PLLCTL1_CKEN_MASK);
-	}
+/*
+ * The chip has no PLL lock status, so sleep for the lock time instead of
+ * polling. The clock output is only enabled once the PLL has settled.
+ */
+static int tc358748_pll_lock(struct v4l2_subdev *sd, const u32 *cfg)
+{
+	struct tc358748_state *state = to_state(sd);
+	int err;
 
-	tc358748_dump_pll(dev, state);
+	usleep_range(TC358748_PLL_LOCK_US, TC358748_PLL_LOCK_US +
+		     TC358748_PLL_LOCK_US / 4);
+	err = i2c_wr16_and_or(sd, PLLCTL1, ~PLLCTL1_CKEN_MASK,
+			      PLLCTL1_CKEN_MASK);
+	if (err)
+		return err;
+
+	tc358748_cfg_commit(state, cfg, TC358748_CFG_PLL);
+	tc358748_dump_pll(&state->i2c_client->dev, state);
+
+	return 0;
 }
 
-static void tc358748_set_csi_color_space(struct v4l2_subdev *sd)
+static int tc358748_set_csi_color_space(struct v4l2_subdev *sd,
+					const u32 *cfg, unsigned long dirty)
 {
 	struct tc358748_state *state = to_state(sd);
-	const struct tc358748_mbus_fmt *tc358748_fmt =
-		tc358748_get_format(state->fmt.code);
+	int err = 0;
 
 	/* currently no self defined csi user data type id's are supported */
 	mutex_lock(&state->confctl_mutex);
-	i2c_wr16_and_or(sd, DATAFMT,
-			~(DATAFMT_PDFMT_MASK | DATAFMT_UDT_EN_MASK),
-			DATAFMT_PDFMT_SET(tc358748_fmt->pdformat));
-	i2c_wr16_and_or(sd, CONFCTL, ~CONFCTL_PDATAF_MASK,
-			CONFCTL_PDATAF_SET(tc358748_fmt->pdataf));
+	if (dirty & BIT(TC358748_CFG_DATAFMT))
+		err = i2c_wr16_and_or(sd, DATAFMT,
+				      ~(DATAFMT_PDFMT_MASK |
+					DATAFMT_UDT_EN_MASK),
+				      cfg[TC358748_CFG_DATAFMT]);
+	if (!err && (dirty & BIT(TC358748_CFG_CONFCTL)))
+		err = i2c_wr16_and_or(sd, CONFCTL,
+				      ~(CONFCTL_PDATAF_MASK |
+					CONFCTL_DATALANE_MASK),
+				      cfg[TC358748_CFG_CONFCTL]);
 	mutex_unlock(&state->confctl_mutex);
+	if (!err)
+		tc358748_cfg_commit(state, cfg, dirty & TC358748_CFG_COLOR);
+
+	return err;
 }
 
-static void tc38764_debug_pattern_80(struct v4l2_subdev *sd)
+static const u32 tc358748_color_bars[] = {
+	0xffffff, 0xffff00, 0x00ffff, 0x00ff00,
+	0xff00ff, 0xff0000, 0x0000ff, 0x000000,
+};
+
+/* Color of pixel x as 0xRRGGBB */
+static u32 tc358748_pattern_rgb(unsigned int pattern, unsigned int x,
+				unsigned int width)
 {
-	int i;
+	u32 level;
+
+	switch (pattern) {
+	case TC358748_PATTERN_COLOR_BARS:
+		return tc358748_color_bars[x * ARRAY_SIZE(tc358748_color_bars) /
+					   width];
+	case TC358748_PATTERN_RAMP:
+		level = x * 256 / width;
+		return level << 16 | level << 8 | level;
+	case TC358748_PATTERN_STRIPES:
+		return (x / 8) & 1 ? 0x000000 : 0xffffff;
+	case TC358748_PATTERN_SOLID:
+	default:
+		return 0x0000ff;
+	}
+}
 
-	i2c_wr16(sd, DBG_ACT_LINE_CNT, 0x8000);
-	i2c_wr16(sd, DBG_LINE_WIDTH, 0x0396);
-	i2c_wr16(sd, DBG_VERT_BLANK_LINE_CNT, 0x0000);
-
-	for (i = 0; i < 80; i++)
-		i2c_wr16(sd, DBG_VIDEO_DATA, 0xff7f);
-	i2c_wr16(sd, DBG_VIDEO_DATA, 0xff00);
-	for (i = 0; i < 40; i++)
-		i2c_wr16(sd, DBG_VIDEO_DATA, 0xffff);
-	i2c_wr16(sd, DBG_VIDEO_DATA, 0xc0ff);
-	for (i = 0; i < 40; i++)
-		i2c_wr16(sd, DBG_VIDEO_DATA, 0xc000);
-	for (i = 0; i < 80; i++)
-		i2c_wr16(sd, DBG_VIDEO_DATA, 0x7f00);
-	for (i = 0; i < 80; i++)
-		i2c_wr16(sd, DBG_VIDEO_DATA, 0x7fff);
-	i2c_wr16(sd, DBG_VIDEO_DATA, 0x0000);
-	for (i = 0; i < 40; i++)
-		i2c_wr16(sd, DBG_VIDEO_DATA, 0x00ff);
-	i2c_wr16(sd, DBG_VIDEO_DATA, 0x00ff);
-	for (i = 0; i < 40; i++)
-		i2c_wr16(sd, DBG_VIDEO_DATA, 0x0000);
-	i2c_wr16(sd, DBG_VIDEO_DATA, 0x007f);
-
-	i2c_wr16(sd, DBG_ACT_LINE_CNT, 0xC1DF);
-}
-
-static void tc358748_enable_csi_lanes(struct v4l2_subdev *sd, int enable)
+/* BT.601 limited range */
+static void tc358748_rgb_to_yuv(u32 rgb, u8 *y, u8 *u, u8 *v)
+{
+	int r = (rgb >> 16) & 0xff, g = (rgb >> 8) & 0xff, b = rgb & 0xff;
+
+	*y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+	*u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+	*v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+static unsigned int
+tc358748_pattern_line_len(const struct tc358748_mbus_fmt *fmt,
+			  unsigned int width)
+{
+	return width * fmt->bpp / 8;
+}
+
+/*
+ * Generate one line of the pattern in CSI-2 byte order. Returns the line
+ * length in bytes, 0 if the format isn't supported.
+ */
+static unsigned int tc358748_pattern_line(u8 *buf, unsigned int pattern,
+					  const struct tc358748_mbus_fmt *fmt,
+					  unsigned int width)
+{
+	u8 y0, y1, u, v, dummy;
+	unsigned int x;
+	u32 rgb;
+	u8 *p = buf;
+
+	switch (fmt->bpp) {
+	case 16:
+	case 20:
+		/* YUV422: U Y0 V Y1, 10 bit packs the 2 LSBs in a 5th byte */
+		for (x = 0; x + 1 < width; x += 2) {
+			tc358748_rgb_to_yuv(tc358748_pattern_rgb(pattern, x,
+								 width),
+					    &y0, &u, &v);
+			tc358748_rgb_to_yuv(tc358748_pattern_rgb(pattern, x + 1,
+								 width),
+					    &y1, &dummy, &dummy);
+			*p++ = u;
+			*p++ = y0;
+			*p++ = v;
+			*p++ = y1;
+			if (fmt->bpp == 20)
+				*p++ = 0;
+		}
+		break;
+	case 24:
+		/* GBR888 */
+		for (x = 0; x < width; x++) {
+			rgb = tc358748_pattern_rgb(pattern, x, width);
+			*p++ = (rgb >> 8) & 0xff;
+			*p++ = rgb & 0xff;
+			*p++ = (rgb >> 16) & 0xff;
+		}
+		break;
+	default:
+		return 0;
+	}
+
+	return p - buf;
+}
+
+/*
+ * Stream data into a FIFO port. The register address doesn't increment, so
+ * the data goes out in bursts to the same address, as large as the adapter
+ * allows. The port takes 16-bit words, the first byte of each pair is the
+ * low byte.
+ */
+static int tc358748_write_fifo(struct v4l2_subdev *sd, u16 reg,
+			       const u8 *data, unsigned int len)
 {
 	struct tc358748_state *state = to_state(sd);
-	struct tc358748_csi_param *csi_setting =
-		tc358748_g_cur_csi_settings(state);
-	unsigned int lanes = csi_setting->lane_num;
+	struct i2c_client *client = state->i2c_client;
+	const struct i2c_adapter_quirks *quirks = client->adapter->quirks;
+	unsigned int chunk = I2C_MAX_XFER_SIZE - 2;
+	unsigned int i, n;
+	struct i2c_msg msg;
+	u8 *buf;
+	int err = 0;
+
+	if (quirks && quirks->max_write_len)
+		chunk = min_t(unsigned int, chunk, quirks->max_write_len - 2);
+	chunk &= ~1;
+
+	buf = kmalloc(2 + chunk, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	buf[0] = reg >> 8;
+	buf[1] = reg & 0xff;
+
+	msg.addr = client->addr;
+	msg.flags = 0;
+	msg.buf = buf;
+
+	while (len) {
+		n = min(len, chunk);
+		for (i = 0; i < n; i += 2) {
+			buf[2 + i] = data[i + 1];
+			buf[2 + i + 1] = data[i];
+		}
+		msg.len = 2 + n;
+
+		err = tc358748_i2c_transfer(state, &msg, 1);
+		tc358748_trace(state, 'W', reg, tc358xxx_trace_val(data, n), n,
+			       err);
+		if (err) {
+			v4l2_err(sd, "%s: writing %u bytes to 0x%04x failed\n",
+				 __func__, n, reg);
+			break;
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	kfree(buf);
+	return err;
+}
+
+/*
+ * Program the debug video generator: the line held in the video buffer is
+ * sent for every line of the active format.
+ */
+static int tc358748_set_test_pattern(struct v4l2_subdev *sd)
+{
+	struct tc358748_state *state = to_state(sd);
+	struct device *dev = &state->i2c_client->dev;
+	const struct tc358748_mbus_fmt *fmt =
+		tc358748_get_format(state->fmt.code);
+	unsigned long xfers = state->xfer_cnt;
+	unsigned int len;
+	u8 *line;
+	int err = 0;
+
+	if (!fmt || !state->fmt.width || !state->fmt.height)
+		return 0;
+
+	/* one extra pixel pair, the 10 bit packing rounds up */
+	line = kmalloc(tc358748_pattern_line_len(fmt, state->fmt.width + 2),
+		       GFP_KERNEL);
+	if (!line)
+		return -ENOMEM;
+
+	len = tc358748_pattern_line(line, state->test_pattern, fmt,
+				    state->fmt.width);
+	if (!len) {
+		dev_warn(dev, "test pattern not supported for format 0x%04x\n",
+			 state->fmt.code);
+		goto out;
+	}
+
+	/* stop the generator while the line is loaded */
+	err = i2c_wr16(sd, DBG_ACT_LINE_CNT, 0x8000);
+	if (!err)
+		err = i2c_wr16(sd, DBG_LINE_WIDTH, len);
+	if (!err)
+		err = i2c_wr16(sd, DBG_VERT_BLANK_LINE_CNT, 0x0000);
+	if (err)
+		goto out;
+
+	/* the port takes whole words */
+	if (len & 1)
+		line[len++] = 0;
+
+	err = tc358748_write_fifo(sd, DBG_VIDEO_DATA, line, len);
+	if (err)
+		goto out;
+
+	err = i2c_wr16(sd, DBG_ACT_LINE_CNT,
+		       0xc000 | ((state->fmt.height - 1) & 0x3fff));
+
+	dev_dbg(dev, "test pattern %u: %u bytes/line in %lu bus transactions\n",
+		state->test_pattern, len, state->xfer_cnt - xfers);
+out:
+	kfree(line);
+	return err;
+}
+
+static int tc358748_enable_csi_lanes(struct v4l2_subdev *sd, int enable)
+{
+	struct tc358748_state *state = to_state(sd);
+	unsigned int lanes = state->csi_lanes;
+	unsigned long xfers = state->xfer_cnt;
+	struct tc358748_reg_batch batch;
 	u32 val = 0;
+	int err;
+
+	tc358748_batch_init(&batch);
 
 	if (lanes < 1 || !enable)
-		i2c_wr32(sd, CLW_CNTRL, CLW_CNTRL_CLW_LANEDISABLE_MASK);
+		tc358748_batch_wr32(sd, &batch, CLW_CNTRL,
+				    CLW_CNTRL_CLW_LANEDISABLE_MASK);
 	if (lanes < 1 || !enable)
-		i2c_wr32(sd, D0W_CNTRL, D0W_CNTRL_D0W_LANEDISABLE_MASK);
+		tc358748_batch_wr32(sd, &batch, D0W_CNTRL,
+				    D0W_CNTRL_D0W_LANEDISABLE_MASK);
 	if (lanes < 2 || !enable)
-		i2c_wr32(sd, D1W_CNTRL, D1W_CNTRL_D1W_LANEDISABLE_MASK);
+		tc358748_batch_wr32(sd, &batch, D1W_CNTRL,
+				    D1W_CNTRL_D1W_LANEDISABLE_MASK);
 	if (lanes < 3 || !enable)
-		i2c_wr32(sd, D2W_CNTRL, D2W_CNTRL_D2W_LANEDISABLE_MASK);
+		tc358748_batch_wr32(sd, &batch, D2W_CNTRL,
+				    D2W_CNTRL_D2W_LANEDISABLE_MASK);
 	if (lanes < 4 || !enable)
-		i2c_wr32(sd, D3W_CNTRL, D2W_CNTRL_D3W_LANEDISABLE_MASK);
+		tc358748_batch_wr32(sd, &batch, D3W_CNTRL,
+				    D2W_CNTRL_D3W_LANEDISABLE_MASK);
 
 	if (lanes > 0 && enable)
 		val |= HSTXVREGEN_CLM_HSTXVREGEN_MASK |
@@ -948,51 +2618,56 @@ static void tc358748_enable_csi_lanes(struct v4l2_subdev *sd, int enable)
 	if (lanes > 3 && enable)
 		val |= HSTXVREGEN_D3M_HSTXVREGEN_MASK;
 
-	i2c_wr32(sd, HSTXVREGEN, val);
+	tc358748_batch_wr32(sd, &batch, HSTXVREGEN, val);
+	err = tc358748_batch_flush(sd, &batch);
+	tc358748_batch_stats(sd, __func__, &batch, xfers);
+
+	return err;
 }
 
-static void tc358748_set_csi(struct v4l2_subdev *sd)
+static int tc358748_set_csi(struct v4l2_subdev *sd, const u32 *cfg,
+			    unsigned long dirty)
 {
 	struct tc358748_state *state = to_state(sd);
-	struct tc358748_csi_param *csi_setting =
-		tc358748_g_cur_csi_settings(state);
-	bool en_continuous_clk = csi_setting->is_continuous_clk;
-	u32 val;
+	unsigned long xfers = state->xfer_cnt;
+	unsigned long csi = dirty & TC358748_CFG_CSI;
+	struct tc358748_reg_batch batch;
+	unsigned int i;
+	int err;
 
-	val = TCLK_HEADERCNT_TCLK_ZEROCNT_SET(csi_setting->tclk_zerocnt) |
-	      TCLK_HEADERCNT_TCLK_PREPARECNT_SET(csi_setting->tclk_preparecnt);
-	i2c_wr32(sd, TCLK_HEADERCNT, val);
-	val = THS_HEADERCNT_THS_ZEROCNT_SET(csi_setting->ths_zerocnt) |
-	      THS_HEADERCNT_THS_PREPARECNT_SET(csi_setting->ths_preparecnt);
-	i2c_wr32(sd, THS_HEADERCNT, val);
-	i2c_wr32(sd, TWAKEUP, csi_setting->twakeupcnt);
-	i2c_wr32(sd, TCLK_POSTCNT, csi_setting->tclk_postcnt);
-	i2c_wr32(sd, THS_TRAILCNT, csi_setting->ths_trailcnt);
-	i2c_wr32(sd, LINEINITCNT, csi_setting->lineinitcnt);
-	i2c_wr32(sd, LPTXTIMECNT, csi_setting->lptxtimecnt);
-	i2c_wr32(sd, TCLK_TRAILCNT, csi_setting->tclk_trailcnt);
-	i2c_wr32(sd, TXOPTIONCNTRL,
-		 en_continuous_clk ? TXOPTIONCNTRL_CONTCLKMODE_MASK : 0);
+	/*
+	 * LINEINITCNT..TXOPTIONCNTRL are in ascending address order, runs of
+	 * changed registers are sent as one burst.
+	 */
+	tc358748_batch_init(&batch);
+	for_each_set_bit(i, &csi, TC358748_CFG_NUM)
+		tc358748_batch_wr32(sd, &batch, tc358748_cfg_regs[i], cfg[i]);
+	err = tc358748_batch_flush(sd, &batch);
+	tc358748_batch_stats(sd, __func__, &batch, xfers);
+	if (err)
+		return err;
 
-	if (state->test)
-		tc38764_debug_pattern_80(sd);
+	tc358748_cfg_commit(state, cfg, csi);
+	tc358748_dump_csi(&state->i2c_client->dev,
+			  tc358748_g_cur_csi_settings(state));
 
-	tc358748_dump_csi(&state->i2c_client->dev, csi_setting);
+	return 0;
 }
 
-static void tc358748_enable_csi_module(struct v4l2_subdev *sd, int enable)
+static int tc358748_enable_csi_module(struct v4l2_subdev *sd, int enable)
 {
-	struct tc358748_state *state = to_state(sd);
-	struct tc358748_csi_param *csi_setting =
-		tc358748_g_cur_csi_settings(state);
-	unsigned int lanes = csi_setting->lane_num;
+	unsigned int lanes = to_state(sd)->csi_lanes;
 	u32 val;
+	int err;
 
 	if (!enable)
-		return;
+		return 0;
 
-	i2c_wr32(sd, STARTCNTRL, STARTCNTRL_START_MASK);
-	i2c_wr32(sd, CSI_START, CSI_START_STRT_MASK);
+	err = i2c_wr32(sd, STARTCNTRL, STARTCNTRL_START_MASK);
+	if (!err)
+		err = i2c_wr32(sd, CSI_START, CSI_START_STRT_MASK);
+	if (err)
+		return err;
 
 	val = CSI_CONTROL_NOL_1_MASK;
 	if (lanes == 2)
@@ -1003,22 +2678,193 @@ static void tc358748_enable_csi_module(struct v4l2_subdev *sd, int enable)
 		val = CSI_CONTROL_NOL_4_MASK;
 
 	val |= CSI_CONTROL_CSI_MODE_MASK | CSI_CONTROL_TXHSMD_MASK;
-	tc358748_wr_csi_control(sd, val);
+	return tc358748_wr_csi_control(sd, val);
+}
+
+/*
+ * The CSI-TX leaves the halt state once it runs on the PLL clock. Report
+ * a chip that doesn't get there, the stream start is left to decide.
+ */
+static void tc358748_wait_csi_start(struct v4l2_subdev *sd)
+{
+	struct tc358748_state *state = to_state(sd);
+	unsigned int val;
+	int err;
+
+	err = regmap_read_poll_timeout(state->regmap, CSI_STATUS, val,
+				       !(val & CSI_STATUS_S_HLT_MASK),
+				       TC358748_CSI_START_POLL_US,
+				       TC358748_CSI_START_TIMEOUT_US);
+	if (err)
+		dev_warn(&state->i2c_client->dev,
+			 "CSI-TX still halted (0x%04x): %d\n", val, err);
 }
 
-static void tc358748_set_buffers(struct v4l2_subdev *sd)
+static int tc358748_set_buffers(struct v4l2_subdev *sd, const u32 *cfg,
+				unsigned long dirty)
 {
 	struct tc358748_state *state = to_state(sd);
 	struct device *dev = &state->i2c_client->dev;
-	const struct tc358748_mbus_fmt *tc358748_mbusfmt =
-		tc358748_get_format(state->fmt.code);
-	unsigned int byte_per_line =
-		(state->fmt.width * tc358748_mbusfmt->bpp) / 8;
+	unsigned long xfers = state->xfer_cnt;
+	struct tc358748_reg_batch batch;
+	int err;
+
+	tc358748_batch_init(&batch);
+	if (dirty & BIT(TC358748_CFG_FIFOCTL))
+		tc358748_batch_wr16(sd, &batch, FIFOCTL,
+				    cfg[TC358748_CFG_FIFOCTL]);
+	if (dirty & BIT(TC358748_CFG_WORDCNT))
+		tc358748_batch_wr16(sd, &batch, WORDCNT,
+				    cfg[TC358748_CFG_WORDCNT]);
+	err = tc358748_batch_flush(sd, &batch);
+	tc358748_batch_stats(sd, __func__, &batch, xfers);
+	if (err)
+		return err;
 
-	i2c_wr16(sd, FIFOCTL, state->vb_fifo);
-	i2c_wr16(sd, WORDCNT, byte_per_line);
+	tc358748_cfg_commit(state, cfg, dirty & TC358748_CFG_BUFFERS);
 	dev_dbg(dev, "FIFOCTL 0x%02x: WORDCNT 0x%02x\n",
-		state->vb_fifo, byte_per_line);
+		cfg[TC358748_CFG_FIFOCTL], cfg[TC358748_CFG_WORDCNT]);
+
+	return 0;
+}
+
+/* --------------- power sequence --------------- */
+
+/* Record the latency of a whole operation */
+static void tc358748_lat_record(struct tc358748_state *state,
+				enum tc358748_lat_idx idx, ktime_t start,
+				unsigned long xfer_start)
+{
+	struct tc358748_pwr_stats *stats = &state->pwr_stats;
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&stats->lock);
+	tc358xxx_lat_add(&stats->hist[idx], ns, state->xfer_cnt - xfer_start);
+	spin_unlock(&stats->lock);
+}
+
+/*
+ * State carried between the phases of one power sequence. The register
+ * image is built by the config phase, the PLL phases only run if it
+ * changed PLLCTL0/PLLCTL1.
+ */
+struct tc358748_pwr_seq {
+	int on;
+	u32 cfg[TC358748_CFG_NUM];
+	unsigned long dirty;
+};
+
+static int tc358748_pwr_config(struct v4l2_subdev *sd,
+			       struct tc358748_pwr_seq *seq)
+{
+	struct tc358748_state *state = to_state(sd);
+	int err = 0;
+
+	tc358748_build_cfg(state, seq->cfg);
+	seq->dirty = tc358748_cfg_dirty(state, seq->cfg);
+
+	dev_dbg(&state->i2c_client->dev, "%s: dirty 0x%04lx\n", __func__,
+		seq->dirty);
+
+	/* only what differs from the last applied image is written */
+	if (seq->dirty & TC358748_CFG_BUFFERS)
+		err = tc358748_set_buffers(sd, seq->cfg, seq->dirty);
+	if (!err && (seq->dirty & TC358748_CFG_CSI))
+		err = tc358748_set_csi(sd, seq->cfg, seq->dirty);
+	if (!err && (seq->dirty & TC358748_CFG_COLOR))
+		err = tc358748_set_csi_color_space(sd, seq->cfg, seq->dirty);
+
+	return err;
+}
+
+/* Run one phase. Phases that don't apply to this sequence do nothing. */
+static int tc358748_pwr_step(struct v4l2_subdev *sd,
+			     struct tc358748_pwr_seq *seq,
+			     enum tc358748_pwr_phase phase)
+{
+	bool pll = seq->on && (seq->dirty & TC358748_CFG_PLL);
+	int err;
+
+	switch (phase) {
+	case TC358748_PWR_SRESET:
+		/*
+		 * REF_01:
+		 * Softreset don't reset configuration registers content but
+		 * is needed during power-on to trigger a csi LP-11 state
+		 * change and during power-off to disable the csi-module.
+		 */
+		return tc358748_sreset(sd);
+	case TC358748_PWR_CONFIG:
+		/*
+		 * Also needed without a format change: stream off resets the
+		 * CSI-TX timings.
+		 */
+		return seq->on ? tc358748_pwr_config(sd, seq) : 0;
+	case TC358748_PWR_PLL:
+		/* as recommend in REF_01 */
+		if (!pll)
+			return 0;
+		err = tc358748_sleep_mode(sd, 1);
+		return err ? err : tc358748_set_pll(sd, seq->cfg);
+	case TC358748_PWR_PLL_LOCK:
+		if (!pll)
+			return 0;
+		err = tc358748_pll_lock(sd, seq->cfg);
+		return err ? err : tc358748_sleep_mode(sd, 0);
+	case TC358748_PWR_LANES:
+		return tc358748_enable_csi_lanes(sd, seq->on);
+	case TC358748_PWR_CSI_START:
+		err = tc358748_enable_csi_module(sd, seq->on);
+		if (!err && seq->on)
+			tc358748_wait_csi_start(sd);
+		return err;
+	case TC358748_PWR_SLEEP:
+		return tc358748_sleep_mode(sd, !seq->on);
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Run the power sequence up to and including phase last. The time spent in
+ * each phase is kept for the "power" debugfs file.
+ */
+static int tc358748_power_seq(struct v4l2_subdev *sd, int on,
+			      enum tc358748_pwr_phase last)
+{
+	struct tc358748_state *state = to_state(sd);
+	struct tc358748_pwr_stats *stats = &state->pwr_stats;
+	struct tc358748_pwr_seq seq = { .on = on };
+	s64 ns[TC358748_PWR_NUM] = { 0 };
+	unsigned long xfers[TC358748_PWR_NUM] = { 0 };
+	enum tc358748_pwr_phase phase;
+	unsigned long xfer_start;
+	ktime_t start;
+	int err = 0;
+
+	for (phase = 0; phase <= last; phase++) {
+		xfer_start = state->xfer_cnt;
+		start = ktime_get();
+		err = tc358748_pwr_step(sd, &seq, phase);
+		ns[phase] = ktime_to_ns(ktime_sub(ktime_get(), start));
+		xfers[phase] = state->xfer_cnt - xfer_start;
+		if (err)
+			break;
+	}
+
+	spin_lock(&stats->lock);
+	stats->on = on;
+	stats->err = err;
+	stats->last = min(phase, last);
+	memcpy(stats->ns, ns, sizeof(ns));
+	/* only successful power-ups count towards the start-up latency */
+	if (on && !err)
+		for (phase = 0; phase <= last; phase++)
+			tc358xxx_lat_add(&stats->hist[phase], ns[phase],
+					 xfers[phase]);
+	spin_unlock(&stats->lock);
+
+	return err;
 }
 
 /* --------------- CORE OPS --------------- */
@@ -1026,7 +2872,18 @@ static void tc358748_set_buffers(struct v4l2_subdev *sd)
 static int tc358748_log_status(struct v4l2_subdev *sd)
 {
 	struct tc358748_state *state = to_state(sd);
-	uint16_t sysctl = i2c_rd16(sd, SYSCTL);
+	struct device *dev = &state->i2c_client->dev;
+	uint16_t sysctl;
+	int err;
+
+	/* the status registers are volatile, they can't come from the cache */
+	err = pm_runtime_get_sync(dev);
+	if (err < 0) {
+		pm_runtime_put_noidle(dev);
+		return err;
+	}
+
+	sysctl = i2c_rd16(sd, SYSCTL);
 
 	v4l2_info(sd, "-----Chip status-----\n");
 	v4l2_info(sd, "Chip ID: 0x%02lx\n",
@@ -1050,6 +2907,15 @@ static int tc358748_log_status(struct v4l2_subdev *sd)
 			state->fmt.code == MEDIA_BUS_FMT_UYVY8_2X8 ?
 			"YCbCr 422 8-bit" : "Unsupported");
 
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_put_autosuspend(dev);
+
+	v4l2_info(sd, "-----I2C status-----\n");
+	v4l2_info(sd, "Transfers: %lu, retried: %lu, failed: %lu\n",
+		  state->xfer_cnt, state->retry_cnt, state->fail_cnt);
+	v4l2_info(sd, "Worst transfer latency: %lld us\n",
+		  div_s64(state->max_xfer_ns, NSEC_PER_USEC));
+
 	return 0;
 }
 
@@ -1064,27 +2930,40 @@ static void tc358748_print_register_map(struct v4l2_subdev *sd)
 	v4l2_info(sd, "0x040c-0x0518: Tx Control Register\n");
 }
 
-static int tc358748_get_reg_size(u16 address)
-{
-	if (address <= 0x00ff)
-		return 2;
-	else if ((address >= 0x0100) && (address <= 0x05FF))
-		return 4;
-	else
-		return 1;
-}
-
 static int tc358748_g_register(struct v4l2_subdev *sd,
 			       struct v4l2_dbg_register *reg)
 {
-	if (reg->reg > 0xffff) {
+	struct tc358748_state *state = to_state(sd);
+	struct device *dev = &state->i2c_client->dev;
+	const struct tc358748_reg_desc *desc = tc358748_reg_desc(reg->reg);
+	unsigned int val;
+	int err;
+
+	if (!desc || !(desc->flags & TC358748_REG_RD)) {
 		tc358748_print_register_map(sd);
 		return -EINVAL;
 	}
 
-	reg->size = tc358748_get_reg_size(reg->reg);
+	reg->size = desc->width;
+
+	/* a suspended regmap is cache-only, wake the chip for the read */
+	err = pm_runtime_get_sync(dev);
+	if (err < 0) {
+		pm_runtime_put_noidle(dev);
+		return err;
+	}
+
+	/* always read the hardware, regmap refills the cache */
+	regcache_drop_region(state->regmap, reg->reg, reg->reg);
+	err = regmap_read(state->regmap, reg->reg, &val);
+
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_put_autosuspend(dev);
 
-	reg->val = i2c_rdreg(sd, reg->reg, reg->size);
+	if (err)
+		return err;
+
+	reg->val = val;
 
 	return 0;
 }
@@ -1092,15 +2971,14 @@ static int tc358748_g_register(struct v4l2_subdev *sd,
 static int tc358748_s_register(struct v4l2_subdev *sd,
 			       const struct v4l2_dbg_register *reg)
 {
-	if (reg->reg > 0xffff) {
+	const struct tc358748_reg_desc *desc = tc358748_reg_desc(reg->reg);
+
+	if (!desc || !(desc->flags & TC358748_REG_WR)) {
 		tc358748_print_register_map(sd);
 		return -EINVAL;
 	}
 
-	i2c_wrreg(sd, (u16)reg->reg, reg->val,
-			tc358748_get_reg_size(reg->reg));
-
-	return 0;
+	return regmap_write(to_state(sd)->regmap, reg->reg, reg->val);
 }
 #endif
 
@@ -1118,7 +2996,7 @@ static int tc358748_g_mbus_config(struct v4l2_subdev *sd,
 			V4L2_MBUS_CSI2_CONTINUOUS_CLOCK :
 			V4L2_MBUS_CSI2_NONCONTINUOUS_CLOCK;
 
-	switch (csi_setting->lane_num) {
+	switch (state->csi_lanes) {
 	case 1:
 		cfg->flags |= V4L2_MBUS_CSI2_1_LANE;
 		break;
@@ -1141,38 +3019,75 @@ static int tc358748_g_mbus_config(struct v4l2_subdev *sd,
 static int tc358748_s_power(struct v4l2_subdev *sd, int on)
 {
 	struct tc358748_state *state = to_state(sd);
+	struct device *dev = &state->i2c_client->dev;
+	unsigned long xfers = state->xfer_cnt;
+	ktime_t start = ktime_get();
+	int err;
 
-	/*
-	 * REF_01:
-	 * Softreset don't reset configuration registers content but is needed
-	 * during power-on to trigger a csi LP-11 state change and during
-	 * power-off to disable the csi-module.
-	 */
-	tc358748_sreset(sd);
-
-	if (state->fmt_changed) {
-		tc358748_set_buffers(sd);
-		tc358748_set_csi(sd);
-		tc358748_set_csi_color_space(sd);
+	/* held from power on to power off */
+	if (on) {
+		err = pm_runtime_get_sync(dev);
+		if (err < 0) {
+			pm_runtime_put_noidle(dev);
+			return err;
+		}
+	}
 
-		/* as recommend in REF_01 */
-		tc358748_sleep_mode(sd, 1);
-		tc358748_set_pll(sd);
-		tc358748_sleep_mode(sd, 0);
+	err = tc358748_power_seq(sd, on, TC358748_PWR_SLEEP);
+	if (err)
+		goto err;
 
-		state->fmt_changed = false;
+	state->powered = on;
+	if (on) {
+		tc358748_lat_record(state, TC358748_LAT_POWER_ON, start, xfers);
+	} else {
+		pm_runtime_mark_last_busy(dev);
+		pm_runtime_put_autosuspend(dev);
 	}
 
-	tc358748_enable_csi_lanes(sd, on);
-	tc358748_enable_csi_module(sd, on);
-	tc358748_sleep_mode(sd, !on);
+	dev_dbg(dev, "%s: %lu bus transactions\n", __func__,
+		state->xfer_cnt - xfers);
 
 	return 0;
+
+err:
+	/*
+	 * The chip is left half configured: forget what the cache believes
+	 * and redo the full sequence on the next power-up.
+	 */
+	dev_err(&state->i2c_client->dev, "power %s failed: %d\n",
+		on ? "on" : "off", err);
+	regcache_drop_region(state->regmap, 0, CSI_START);
+	state->cfg_valid = 0;
+	state->powered = false;
+
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_put_autosuspend(dev);
+
+	return err;
 }
 
 static int tc358748_s_stream(struct v4l2_subdev *sd, int enable)
 {
-	tc358748_enable_stream(sd, enable);
+	struct tc358748_state *state = to_state(sd);
+	unsigned long xfers = state->xfer_cnt;
+	ktime_t start = ktime_get();
+	int err;
+
+	err = tc358748_enable_stream(sd, enable);
+	if (err)
+		return err;
+
+	state->streaming = enable;
+	if (!enable)
+		return 0;
+
+	tc358748_lat_record(state, TC358748_LAT_STREAM_ON, start, xfers);
+	if (state->resume_pending) {
+		tc358748_lat_record(state, TC358748_LAT_RESUME,
+				    state->resume_start, state->resume_xfers);
+		state->resume_pending = false;
+	}
 
 	return 0;
 }
@@ -1240,6 +3155,7 @@ static int tc358748_set_fmt(struct v4l2_subdev *sd,
 	struct v4l2_ctrl *ctrl;
 	unsigned int pclk, hblank;
 	int new_freq, cur_freq = v4l2_ctrl_g_ctrl(state->link_freq);
+	unsigned int lanes;
 	u16 vb_fifo;
 
 	if (pad->flags == MEDIA_PAD_FL_SOURCE)
@@ -1282,7 +3198,8 @@ static int tc358748_set_fmt(struct v4l2_subdev *sd,
 	 * other csi link frequency if it is possible.
 	 */
 	new_freq = tc358748_adjust_timings(state, tc358748_mbusformat,
-					   &format->format.width, &vb_fifo);
+					   &format->format.width, &lanes,
+					   &vb_fifo);
 
 	/* Currently only a few YUV based formats are supported */
 	if (tc358748_format_supported(format->format.code))
@@ -1294,8 +3211,8 @@ static int tc358748_set_fmt(struct v4l2_subdev *sd,
 	*mbusformat = format->format;
 
 	if (format->which == V4L2_SUBDEV_FORMAT_ACTIVE) {
-		state->fmt_changed = true;
 		state->vb_fifo = vb_fifo;
+		state->csi_lanes = lanes;
 		if (new_freq != cur_freq)
 			v4l2_ctrl_s_ctrl(state->link_freq, new_freq);
 	}
@@ -1315,6 +3232,7 @@ tc358748_link_validate(struct v4l2_subdev *sd, struct media_link *link,
 	struct v4l2_ctrl *ctrl;
 	unsigned int pclk, pclk_old = state->pclk;
 	unsigned int hblank, hblank_old = state->hblank;
+	unsigned int lanes;
 	int new_freq;
 	u16 vb_fifo;
 
@@ -1345,7 +3263,8 @@ tc358748_link_validate(struct v4l2_subdev *sd, struct media_link *link,
 	}
 
 	new_freq = tc358748_adjust_timings(state, tc358748_mbusformat,
-					   &source_fmt->format.width, &vb_fifo);
+					   &source_fmt->format.width, &lanes,
+					   &vb_fifo);
 
 	if (new_freq != v4l2_ctrl_g_ctrl(state->link_freq)) {
 		/*
@@ -1361,8 +3280,8 @@ tc358748_link_validate(struct v4l2_subdev *sd, struct media_link *link,
 		return -EINVAL;
 	}
 
-	state->fmt_changed = true;
 	state->vb_fifo = vb_fifo;
+	state->csi_lanes = lanes;
 
 	return 0;
 }
@@ -1378,11 +3297,18 @@ static int tc358764_s_ctrl(struct v4l2_ctrl *ctrl)
 		dev_info(dev, "Update link-frequency %llu -> %llu\n",
 			 state->link_frequencies[ctrl->cur.val],
 			 state->link_frequencies[ctrl->val]);
+		tc358748_timing_cache_flush(state);
 
 		return 0;
 	case V4L2_CID_TEST_PATTERN:
-		state->test = ctrl->val;
-		return 0;
+		state->test_pattern = ctrl->val;
+		/* loaded on stream on, a running stream switches right away */
+		if (!state->powered)
+			return 0;
+		if (!ctrl->val)
+			return i2c_wr16(&state->sd, DBG_ACT_LINE_CNT, 0);
+		return state->streaming ?
+		       tc358748_set_test_pattern(&state->sd) : 0;
 	}
 
 	return -EINVAL;
@@ -1467,6 +3393,69 @@ static const struct media_entity_operations tc358748_entity_ops = {
 
 /* --------------- PROBE / REMOVE --------------- */
 
+/*
+ * Search the legal PLL settings for the one closest to bps:
+ *   pllinclk = refclk / prd,	4 MHz .. 40 MHz
+ *   vco = pllinclk * fbd,	500 MHz .. 1 GHz
+ *   bps = vco / 2^frs
+ * For each prd and frs only the two fbd around the target can be closest. On
+ * a tie the lower PLL input clock wins, as recommended by REF_01.
+ */
+static int tc358748_solve_pll(struct tc358748_state *state, u32 bps,
+			      struct tc358748_csi_param *csi)
+{
+	struct device *dev = &state->i2c_client->dev;
+	u64 refclk = state->refclk_hz;
+	u64 best_err = U64_MAX;
+	unsigned int prd, frs;
+	u64 fbd, fbd0, vco, rate, err;
+
+	for (prd = 1; prd <= TC358748_PLL_PRD_MAX; prd++) {
+		if (refclk < (u64)prd * TC358748_PLL_INCLK_MIN ||
+		    refclk > (u64)prd * TC358748_PLL_INCLK_MAX)
+			continue;
+
+		for (frs = 0; frs <= TC358748_PLL_FRS_MAX; frs++) {
+			fbd0 = div64_u64((u64)bps * (prd << frs), refclk);
+
+			for (fbd = fbd0; fbd <= fbd0 + 1; fbd++) {
+				if (fbd < 1 || fbd > TC358748_PLL_FBD_MAX)
+					continue;
+
+				vco = div_u64(refclk * fbd, prd);
+				if (vco < TC358748_PLL_VCO_MIN ||
+				    vco > TC358748_PLL_VCO_MAX)
+					continue;
+
+				rate = div_u64(refclk * fbd, prd << frs);
+				err = rate > bps ? rate - bps : bps - rate;
+				if (err > best_err)
+					continue;
+
+				best_err = err;
+				csi->pll_prd = prd;
+				csi->pll_fbd = fbd;
+				csi->speed_range = frs;
+				csi->speed_per_lane = rate;
+			}
+		}
+	}
+
+	if (best_err == U64_MAX) {
+		dev_warn(dev, "no PLL setting for %u bps per lane\n", bps);
+		return -EINVAL;
+	}
+
+	csi->unit_clk_hz = (state->refclk_hz / csi->pll_prd) >> csi->speed_range;
+	csi->unit_clk_mul = csi->speed_per_lane / csi->unit_clk_hz;
+
+	dev_dbg(dev, "%u bps per lane: prd %u fbd %u frs %u gives %u bps\n",
+		bps, csi->pll_prd, csi->pll_fbd, csi->speed_range,
+		csi->speed_per_lane);
+
+	return 0;
+}
+
 static int tc358748_set_lane_settings(struct tc358748_state *state,
 				      struct v4l2_fwnode_endpoint *fw)
 {
@@ -1476,37 +3465,40 @@ static int tc358748_set_lane_settings(struct tc358748_state *state,
 	for (i = 0; i < fw->nr_of_link_frequencies; i++) {
 		struct tc358748_csi_param *s =
 			&state->link_freq_settings[i];
-		u32 bps_pr_lane;
+		u64 bps_pr_lane;
+		int err;
 
+		/* the menu lists every DT entry, unusable ones are skipped */
 		state->link_frequencies[i] = fw->link_frequencies[i];
 
 		/*
-		 * The CSI bps per lane must be between 62.5 Mbps and 1 Gbps.
 		 * bps_pr_lane = 2 * link_freq, because MIPI data lane is double
-		 * data rate.
+		 * data rate. The PLL generates the VCO range divided by up to
+		 * 2^TC358748_PLL_FRS_MAX.
 		 */
 		bps_pr_lane = 2 * fw->link_frequencies[i];
-		if (bps_pr_lane < 62500000U || bps_pr_lane > 1000000000U) {
-			dev_err(dev, "unsupported bps per lane: %u bps\n",
-				bps_pr_lane);
-			return -EINVAL;
+		if (bps_pr_lane < TC358748_PLL_VCO_MIN >> TC358748_PLL_FRS_MAX ||
+		    bps_pr_lane > TC358748_PLL_VCO_MAX) {
+			dev_warn(dev, "link frequency %llu Hz: unsupported bps per lane, skipped\n",
+				 fw->link_frequencies[i]);
+			continue;
 		}
 
-		if (bps_pr_lane > 500000000)
-			s->speed_range = 0;
-		else if (bps_pr_lane > 250000000)
-			s->speed_range = 1;
-		else if (bps_pr_lane > 125000000)
-			s->speed_range = 2;
-		else
-			s->speed_range = 3;
+		err = tc358748_solve_pll(state, bps_pr_lane, s);
+		if (err)
+			continue;
+
+		/* the LINK_FREQ menu shows what the PLL really generates */
+		state->link_frequencies[i] = s->speed_per_lane / 2;
+		if (s->speed_per_lane != bps_pr_lane)
+			dev_warn(dev, "link frequency %llu Hz: using %llu Hz\n",
+				 fw->link_frequencies[i],
+				 state->link_frequencies[i]);
 
-		s->unit_clk_hz = state->pllinclk_hz >> s->speed_range;
-		s->unit_clk_mul = bps_pr_lane / s->unit_clk_hz;
-		s->speed_per_lane = bps_pr_lane;
 		s->lane_num = fw->bus.mipi_csi2.num_data_lanes;
 		s->is_continuous_clk = fw->bus.mipi_csi2.flags &
 			V4L2_MBUS_CSI2_CONTINUOUS_CLOCK;
+		s->usable = true;
 
 		if (s->speed_per_lane != 432000000U)
 			dev_warn(dev, "untested bps per lane: %u bps\n",
@@ -1519,6 +3511,9 @@ static int tc358748_set_lane_settings(struct tc358748_state *state,
 	}
 
 	state->link_frequencies_num = fw->nr_of_link_frequencies;
+	/* all lanes until a format picks fewer */
+	state->csi_lanes = fw->bus.mipi_csi2.num_data_lanes;
+	tc358748_timing_cache_flush(state);
 
 	return 0;
 }
@@ -1534,18 +3529,34 @@ static void tc358748_gpio_reset(struct tc358748_state *state)
 
 static int tc358748_apply_fw(struct tc358748_state *state)
 {
+	struct device *dev = &state->i2c_client->dev;
 	struct tc358748_csi_param *csi_setting;
+	unsigned int usable = 0;
 	int err, i;
 
+	/*
+	 * At low rates the fixed parts of some D-PHY periods alone exceed
+	 * their maximum. Such a link frequency is dropped from the LINK_FREQ
+	 * menu, the driver only fails if none is left.
+	 */
 	for (i = 0; i < state->link_frequencies_num; i++) {
 		csi_setting = &state->link_freq_settings[i];
+		if (!csi_setting->usable)
+			continue;
 
 		err = tc358748_calculate_csi_txtimings(state, csi_setting);
 		if (err) {
-			dev_err(&state->i2c_client->dev,
-				"Failed to calc csi-tx tminings\n");
-			return err;
+			dev_warn(dev, "link frequency %llu Hz: no valid csi-tx timings, skipped\n",
+				 state->link_frequencies[i]);
+			csi_setting->usable = false;
+			continue;
 		}
+		usable++;
+	}
+
+	if (!usable) {
+		dev_err(dev, "no usable link frequency\n");
+		return -EINVAL;
 	}
 
 	/*
@@ -1556,7 +3567,7 @@ static int tc358748_apply_fw(struct tc358748_state *state)
 
 	err = clk_prepare_enable(state->refclk);
 	if (err) {
-		dev_err(&state->i2c_client->dev, "Failed to enable clock\n");
+		dev_err(dev, "Failed to enable clock\n");
 		return err;
 	}
 
@@ -1573,8 +3584,7 @@ static int tc358748_probe_fw(struct tc358748_state *state)
 		.bus_type = V4L2_MBUS_CSI2,
 	};
 	struct fwnode_handle *fw_node;
-	unsigned int refclk, pllinclk;
-	unsigned char pll_prediv;
+	unsigned int refclk;
 	int ret = -EINVAL;
 
 	/* Parse all clocks */
@@ -1592,23 +3602,8 @@ static int tc358748_probe_fw(struct tc358748_state *state)
 		return -EINVAL;
 	}
 
-	/*
-	 * The PLL input clock is obtained by dividing refclk by pll_prd.
-	 * It must be between 4 MHz and 40 MHz, lower frequency is better.
-	 */
-	pll_prediv = DIV_ROUND_CLOSEST(refclk, 4000000);
-	if (pll_prediv < 1 || pll_prediv > 16) {
-		dev_err(dev, "invalid pll pre-divider value: %d\n", pll_prediv);
-		return -EINVAL;
-	}
-	state->pll_prd = pll_prediv;
-
-	pllinclk = DIV_ROUND_CLOSEST(refclk, pll_prediv);
-	if (pllinclk < 4000000 || pllinclk > 40000000) {
-		dev_err(dev, "invalid pll input clock: %d Hz\n", pllinclk);
-		return -EINVAL;
-	}
-	state->pllinclk_hz = pllinclk;
+	/* the PLL dividers are solved per link frequency */
+	state->refclk_hz = refclk;
 
 	/* Now parse the fw-node */
 	fwnode_graph_for_each_endpoint(dev_fwnode(dev), fw_node) {
@@ -1687,6 +3682,9 @@ static int tc358748_parse_endpoint(struct device *dev,
 {
 	struct v4l2_subdev *sd = dev_get_drvdata(dev);
 
+	/* a new parallel source, forget the results for the previous one */
+	tc358748_timing_cache_flush(to_state(sd));
+
 	if (!fwnode_device_is_available(asd->match.fwnode)) {
 		v4l2_err(sd, "remote is not available\n");
 		return -ENOTCONN;
@@ -1700,6 +3698,29 @@ static int tc358748_parse_endpoint(struct device *dev,
 	return 0;
 };
 
+/* Debug files are optional, failures are ignored */
+static void tc358748_debugfs_init(struct tc358748_state *state)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "tc358748-%s",
+		 dev_name(&state->i2c_client->dev));
+	state->debugfs = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(state->debugfs)) {
+		state->debugfs = NULL;
+		return;
+	}
+
+	debugfs_create_file("trace", 0444, state->debugfs, state,
+			    &tc358748_trace_fops);
+	debugfs_create_file("timing_cache", 0444, state->debugfs, state,
+			    &tc358748_timing_cache_fops);
+	debugfs_create_file("power", 0444, state->debugfs, state,
+			    &tc358748_power_fops);
+	debugfs_create_file("latency", 0644, state->debugfs, state,
+			    &tc358748_latency_fops);
+}
+
 static int tc358748_async_register(struct v4l2_subdev *sd)
 {
 	unsigned int port = 0;
@@ -1711,15 +3732,21 @@ static int tc358748_async_register(struct v4l2_subdev *sd)
 }
 
 static const char * const tc358764_test_pattern_menu[] = {
-	"Disabled",
-	"colorbar 80px",
+	[TC358748_PATTERN_DISABLED] = "Disabled",
+	[TC358748_PATTERN_COLOR_BARS] = "Color bars",
+	[TC358748_PATTERN_RAMP] = "Gray ramp",
+	[TC358748_PATTERN_STRIPES] = "Vertical stripes",
+	[TC358748_PATTERN_SOLID] = "Solid blue",
 };
 
 static int tc358748_probe(struct i2c_client *client,
 			  const struct i2c_device_id *id)
 {
+	unsigned int i, link_freq_def = TC358748_DEF_LINK_FREQ;
 	struct tc358748_state *state;
 	struct v4l2_subdev *sd;
+	u64 link_freq_skip = 0;
+	u32 chipid;
 	int err;
 
 	if (!i2c_check_functionality(client->adapter, I2C_FUNC_SMBUS_BYTE_DATA))
@@ -1730,6 +3757,12 @@ static int tc358748_probe(struct i2c_client *client,
 		return -ENOMEM;
 
 	state->i2c_client = client;
+	spin_lock_init(&state->timing_cache.lock);
+	spin_lock_init(&state->pwr_stats.lock);
+
+	err = tc358748_regmap_init(state);
+	if (err)
+		return err;
 
 	/* platform data */
 	err = tc358748_probe_fw(state);
@@ -1745,12 +3778,23 @@ static int tc358748_probe(struct i2c_client *client,
 	sd->flags |= V4L2_SUBDEV_FL_HAS_DEVNODE;
 
 	/* i2c access */
-	if (((i2c_rd16(sd, CHIPID) & CHIPID_CHIPID_MASK) >> 8) != 0x44) {
+	err = i2c_rdreg(sd, CHIPID, &chipid);
+	if (err)
+		return err;
+	if (((chipid & CHIPID_CHIPID_MASK) >> 8) != 0x44) {
 		v4l2_info(sd, "not a TC358748 on address 0x%x\n",
 			  client->addr << 1);
 		return -ENODEV;
 	}
 
+	/* without a reset line the chip may still hold a boot loader setup */
+	if (!state->reset_gpio) {
+		state->sync_all = true;
+		err = tc358748_regcache_sync(sd);
+		if (err)
+			return err;
+	}
+
 	/* control handlers */
 	v4l2_ctrl_handler_init(&state->hdl, 1);
 
@@ -1759,12 +3803,24 @@ static int tc358748_probe(struct i2c_client *client,
 			ARRAY_SIZE(tc358764_test_pattern_menu) - 1, 0, 0,
 			tc358764_test_pattern_menu);
 
+	/* entries without valid timings can't be selected */
+	for (i = 0; i < state->link_frequencies_num; i++) {
+		if (state->link_freq_settings[i].usable)
+			continue;
+		if (i < 64)
+			link_freq_skip |= BIT_ULL(i);
+		if (link_freq_def == i)
+			link_freq_def++;
+	}
+
 	state->link_freq =
 		v4l2_ctrl_new_int_menu(&state->hdl, &tc358764_ctrl_ops,
 				       V4L2_CID_LINK_FREQ,
 				       state->link_frequencies_num - 1,
-				       TC358748_DEF_LINK_FREQ,
+				       link_freq_def,
 				       state->link_frequencies);
+	if (state->link_freq)
+		state->link_freq->menu_skip_mask = link_freq_skip;
 
 
 	sd->ctrl_handler = &state->hdl;
@@ -1786,29 +3842,164 @@ static int tc358748_probe(struct i2c_client *client,
 	state->fmt = tc358748_def_fmt;
 
 	/* apply default settings */
-	tc358748_sreset(sd);
-	tc358748_set_buffers(sd);
-	tc358748_set_csi(sd);
-	tc358748_set_csi_color_space(sd);
-	tc358748_sleep_mode(sd, 1);
-	tc358748_set_pll(sd);
-	tc358748_enable_stream(sd, 0);
+	err = tc358748_power_seq(sd, 1, TC358748_PWR_PLL_LOCK);
+	if (!err)
+		err = tc358748_sleep_mode(sd, 1);
+	if (!err)
+		err = tc358748_enable_stream(sd, 0);
+	if (err) {
+		dev_err(&client->dev, "failed to apply default settings: %d\n",
+			err);
+		goto err_hdl;
+	}
+
+	tc358748_debugfs_init(state);
+
+	/* awake and clocked, suspends once the autosuspend delay expired */
+	pm_runtime_set_active(&client->dev);
+	pm_runtime_enable(&client->dev);
+	pm_runtime_set_autosuspend_delay(&client->dev, autosuspend_delay_ms);
+	pm_runtime_use_autosuspend(&client->dev);
 
 	err = tc358748_async_register(sd);
 	if (err < 0)
-		goto err_hdl;
+		goto err_pm;
+
+	pm_runtime_mark_last_busy(&client->dev);
+	pm_runtime_idle(&client->dev);
 
 	v4l2_info(sd, "%s found @ 0x%x (%s)\n", client->name,
 		  client->addr << 1, client->adapter->name);
 
 	return 0;
 
+err_pm:
+	pm_runtime_dont_use_autosuspend(&client->dev);
+	pm_runtime_disable(&client->dev);
+	pm_runtime_set_suspended(&client->dev);
 err_hdl:
+	debugfs_remove_recursive(state->debugfs);
 	media_entity_cleanup(&sd->entity);
 	v4l2_ctrl_handler_free(&state->hdl);
 	return err;
 }
 
+/* --------------- runtime PM --------------- */
+
+/*
+ * The chip stays powered, sleep mode and the gated refclk keep the register
+ * contents. Writes while suspended only go to the cache and are written
+ * back on resume.
+ */
+static int __maybe_unused tc358748_runtime_suspend(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+	struct tc358748_state *state = to_state(sd);
+	int err;
+
+	err = tc358748_sleep_mode(sd, 1);
+	if (err)
+		return err;
+
+	regcache_cache_only(state->regmap, true);
+	clk_disable_unprepare(state->refclk);
+
+	return 0;
+}
+
+static int __maybe_unused tc358748_runtime_resume(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+	struct tc358748_state *state = to_state(sd);
+	int err;
+
+	err = clk_prepare_enable(state->refclk);
+	if (err)
+		return err;
+
+	err = tc358748_regcache_sync(sd);
+	if (err) {
+		regcache_cache_only(state->regmap, true);
+		clk_disable_unprepare(state->refclk);
+		return err;
+	}
+
+	/* the PLL lost its reference, the next power-up relocks it */
+	state->cfg_valid &= ~TC358748_CFG_PLL;
+
+	return 0;
+}
+
+/* --------------- system sleep --------------- */
+
+static int __maybe_unused tc358748_suspend(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+	struct tc358748_state *state = to_state(sd);
+	int err;
+
+	/* state->streaming stays set, resume restarts the stream */
+	if (state->streaming) {
+		err = tc358748_enable_stream(sd, 0);
+		if (err)
+			return err;
+	}
+
+	pm_runtime_disable(dev);
+	if (!pm_runtime_status_suspended(dev)) {
+		err = tc358748_runtime_suspend(dev);
+		if (err) {
+			pm_runtime_enable(dev);
+			return err;
+		}
+		pm_runtime_set_suspended(dev);
+	}
+
+	return 0;
+}
+
+/*
+ * The supply may be cut during system sleep, so the whole register cache is
+ * written back in bursts. The power sequence then relocks the PLL and
+ * rewrites the CSI setup dropped by the stream teardown.
+ */
+static int __maybe_unused tc358748_resume(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+	struct tc358748_state *state = to_state(sd);
+	int err = 0;
+
+	state->resume_start = ktime_get();
+	state->resume_xfers = state->xfer_cnt;
+	state->resume_pending = true;
+
+	regcache_mark_dirty(state->regmap);
+
+	/* unpowered, the next runtime resume syncs the cache */
+	if (state->powered) {
+		err = tc358748_runtime_resume(dev);
+		if (err)
+			goto out;
+		pm_runtime_set_active(dev);
+
+		err = tc358748_power_seq(sd, 1, TC358748_PWR_SLEEP);
+	}
+
+out:
+	pm_runtime_enable(dev);
+
+	if (!err && state->streaming)
+		err = tc358748_s_stream(sd, 1);
+
+	return err;
+}
+
+static const struct dev_pm_ops tc358748_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(tc358748_suspend, tc358748_resume)
+	SET_RUNTIME_PM_OPS(tc358748_runtime_suspend, tc358748_runtime_resume,
+			   NULL)
+};
+
 static int tc358748_remove(struct i2c_client *client)
 {
 	struct v4l2_subdev *sd = i2c_get_clientdata(client);
@@ -1816,6 +4007,14 @@ static int tc358748_remove(struct i2c_client *client)
 
 	v4l2_async_unregister_subdev(sd);
 	v4l2_device_unregister_subdev(sd);
+
+	pm_runtime_dont_use_autosuspend(&client->dev);
+	pm_runtime_disable(&client->dev);
+	if (!pm_runtime_status_suspended(&client->dev))
+		tc358748_runtime_suspend(&client->dev);
+	pm_runtime_set_suspended(&client->dev);
+
+	debugfs_remove_recursive(state->debugfs);
 	mutex_destroy(&state->confctl_mutex);
 	media_entity_cleanup(&sd->entity);
 	v4l2_ctrl_handler_free(&state->hdl);
@@ -1840,6 +4039,7 @@ static struct i2c_driver tc358748_driver = {
 	.driver = {
 		.name = "tc358748",
 		.of_match_table = of_match_ptr(tc358748_of_match),
+		.pm = &tc358748_pm_ops,
 	},
 	.probe = tc358748_probe,
 	.remove = tc358748_remove,
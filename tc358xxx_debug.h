@@ -0,0 +1,156 @@
+/*
+ * tc358xxx_debug.h - debug helpers shared by the Toshiba bridge drivers
+ *
+ * This program is free software; you may redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * The drivers keep their own wrappers, which add the driver's log output
+ * and debugfs files around these.
+ */
+
+#ifndef _TC358XXX_DEBUG_H
+#define _TC358XXX_DEBUG_H
+
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+
+/* --------------- register access trace --------------- */
+
+#define TC358XXX_TRACE_ENTRIES	256 /* must be a power of two */
+
+/*
+ * Writers claim a slot with a single atomic increment and never wait for
+ * the reader; seq is written last, so the reader can skip a slot that is
+ * overwritten while it is copied.
+ */
+struct tc358xxx_trace_entry {
+	u64 ts;		/* ktime_get_ns() */
+	u32 seq;	/* slot index + 1, 0 while the entry is updated */
+	u32 val;
+	u16 reg;
+	u16 len;	/* bytes transferred */
+	s16 ret;
+	char dir;	/* 'R' or 'W' */
+};
+
+struct tc358xxx_trace {
+	atomic_t head;
+	struct tc358xxx_trace_entry entries[TC358XXX_TRACE_ENTRIES];
+};
+
+static inline void tc358xxx_trace_add(struct tc358xxx_trace *trace,
+				      char dir, u16 reg, u32 val, u32 len,
+				      int ret)
+{
+	unsigned int idx = atomic_inc_return(&trace->head) - 1;
+	struct tc358xxx_trace_entry *e =
+		&trace->entries[idx & (TC358XXX_TRACE_ENTRIES - 1)];
+
+	WRITE_ONCE(e->seq, 0);
+	smp_wmb();
+	e->ts = ktime_get_ns();
+	e->val = val;
+	e->reg = reg;
+	e->len = len;
+	e->ret = ret;
+	e->dir = dir;
+	smp_wmb();
+	WRITE_ONCE(e->seq, idx + 1);
+}
+
+/* The first bytes of a little endian buffer, as logged by the trace */
+static inline u32 tc358xxx_trace_val(const u8 *values, u32 n)
+{
+	u32 val = 0;
+	u32 i;
+
+	for (i = 0; i < min_t(u32, n, 4); i++)
+		val |= values[i] << (8 * i);
+
+	return val;
+}
+
+/* Oldest entry first, for a debugfs seq_file */
+static inline int tc358xxx_trace_show(struct seq_file *m,
+				      struct tc358xxx_trace *trace)
+{
+	unsigned int head = atomic_read(&trace->head);
+	unsigned int i = head - TC358XXX_TRACE_ENTRIES;
+
+	seq_printf(m, "# %u accesses, time dir reg val len ret\n", head);
+
+	for (; i != head; i++) {
+		const struct tc358xxx_trace_entry *e =
+			&trace->entries[i & (TC358XXX_TRACE_ENTRIES - 1)];
+		struct tc358xxx_trace_entry copy;
+		u32 seq = READ_ONCE(e->seq);
+		u32 rem;
+
+		/* never written, or already reused for a newer access */
+		if (!seq || seq != i + 1)
+			continue;
+
+		smp_rmb();
+		copy = *e;
+		smp_rmb();
+		if (READ_ONCE(e->seq) != seq)
+			continue;
+
+		rem = do_div(copy.ts, NSEC_PER_SEC);
+		seq_printf(m, "%5llu.%09u %c 0x%04x 0x%08x %u %d\n",
+			   copy.ts, rem, copy.dir, copy.reg, copy.val,
+			   copy.len, copy.ret);
+	}
+
+	return 0;
+}
+
+/* --------------- latency histograms --------------- */
+
+/* Bucket n counts samples below 2^n us, the last the rest */
+#define TC358XXX_LAT_BUCKETS	20
+
+struct tc358xxx_lat_hist {
+	unsigned long samples;
+	unsigned long xfers;	/* bus transactions, all samples */
+	s64 max_ns;
+	unsigned long buckets[TC358XXX_LAT_BUCKETS];
+};
+
+/* The caller serializes updates of hist */
+static inline void tc358xxx_lat_add(struct tc358xxx_lat_hist *hist, s64 ns,
+				    unsigned long xfers)
+{
+	u64 us = div_u64(max_t(s64, ns, 0), NSEC_PER_USEC);
+
+	hist->buckets[min_t(unsigned int, fls64(us),
+			    TC358XXX_LAT_BUCKETS - 1)]++;
+	hist->samples++;
+	hist->xfers += xfers;
+	hist->max_ns = max(hist->max_ns, ns);
+}
+
+static inline void tc358xxx_lat_show_header(struct seq_file *m)
+{
+	seq_puts(m, "# name samples xfers max_us, then samples below 1 2 4 .. us\n");
+}
+
+/* One line: samples, bus transactions, worst case and the log2 histogram */
+static inline void tc358xxx_lat_show(struct seq_file *m, const char *name,
+				     const struct tc358xxx_lat_hist *hist)
+{
+	unsigned int b;
+
+	seq_printf(m, "%s %lu %lu %lld", name, hist->samples, hist->xfers,
+		   div_s64(hist->max_ns, NSEC_PER_USEC));
+	for (b = 0; b < TC358XXX_LAT_BUCKETS; b++)
+		seq_printf(m, " %lu", hist->buckets[b]);
+	seq_putc(m, '\n');
+}
+
+#endif /* _TC358XXX_DEBUG_H */